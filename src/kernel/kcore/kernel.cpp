@@ -20,6 +20,12 @@
 #include <memory/physical_mem.hpp>
 #include <memory/virtual_mem.hpp>
 #include <memory/kernel_alloc.h>
+#include <memory/zero_pool.hpp>
+#include <memory/tlb.hpp>
+#include <memory/ksm.hpp>
+#include <memory/swap.hpp>
+#include <memory/shrinker.hpp>
+#include <memory/page_fault.hpp>
 
 #include <terminal/terminal.h>
 
@@ -101,6 +107,7 @@ void kernel_main(unsigned int magic, multiboot_info* mbt_info) {
 	Features::enableFeatures();
 	initIDT();
 	Memory::PhysicalMemInit();
+	Memory::InitPhysmap();
 
 	/* This is all framebuffer stuff.
 	 * I'm not in too much of a rush about it, it was just a fun experiement
@@ -130,7 +137,13 @@ void kernel_main(unsigned int magic, multiboot_info* mbt_info) {
 	pit_init(1000);
 	keyboard_init();
 
+	Memory::InitReclaim();
 	initKernelAllocator();
+	Memory::InitZeroPool();
+	Memory::InitTLB();
+	Memory::InitKSM();
+	Memory::InitSwap();
+	Memory::InitDemandPaging();
 
 	// After we're done checking features, we need to set up our terminal.
 	// Eventually this will be a userspace program. 
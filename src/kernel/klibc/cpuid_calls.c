@@ -130,7 +130,9 @@ cpu_features __attribute__((target("no-sse"))) cpuFeatures() {
 	// 22:21 are reserved
 	features.SSE4_2 = ecx[20];
 	features.SSE4_1 = ecx[19];
-	// 18:14 are reserved
+	// 18 is reserved
+	features.PCID = ecx[17];
+	// 16:14 are reserved
 	features.CMPXCHG16B = ecx[13];
 	features.FMA = ecx[12];
 	// 11:10 are reserved
@@ -177,6 +179,35 @@ cpu_features __attribute__((target("no-sse"))) cpuFeatures() {
 	features.VME = edx[1];
 	features.FPU = edx[0];
 
+	// ---------------------------------------------
+	// EXTENDED EDX FEATURES
+	// ---------------------------------------------
+	// Every x86_64 cpu has leaf 0x80000001 (it's where the long mode bit lives), but we check anyways.
+	features.PDPE1GB = FEATURE_NOT_SUPPORTED;
+	features.NX = FEATURE_NOT_SUPPORTED;
+	if (__get_cpuid_max(0x80000000, NULL) >= 0x80000001) {
+		__cpuid(0x80000001, ax, bx, cx, dx);
+		char ext_edx[33];
+		itoa(dx, ext_edx, 2);
+		padding_32(ext_edx);
+		strrev(ext_edx, 0, 31);
+		features.PDPE1GB = ext_edx[26];
+		features.NX = ext_edx[20];
+	}
+
+	// ---------------------------------------------
+	// STRUCTURED EXTENDED EBX FEATURES
+	// ---------------------------------------------
+	features.INVPCID = FEATURE_NOT_SUPPORTED;
+	if (__get_cpuid_max(0, NULL) >= 7) {
+		__cpuid_count(7, 0, ax, bx, cx, dx);
+		char ext_ebx[33];
+		itoa(bx, ext_ebx, 2);
+		padding_32(ext_ebx);
+		strrev(ext_ebx, 0, 31);
+		features.INVPCID = ext_ebx[10];
+	}
+
 	return features;
 }
 #undef exx
\ No newline at end of file
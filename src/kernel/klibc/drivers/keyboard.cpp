@@ -10,6 +10,7 @@
 #include <stdio.h>
 #include <klibc/logger.h>
 #include <string.h>
+#include <klibc/idle.h>
 
 // The double extern is cursed. (Also screw gcc attributes, always ruining my nice code).
 extern "C" {
@@ -211,6 +212,8 @@ char kb_getc() {
 			getc_gotten = true;
 			return scancode_to_char(currentState.last_scancode);
 		}
+		// Nothing to do until a key gets pressed, so let the background work have a go.
+		runIdleTasks();
 	}
 }
 
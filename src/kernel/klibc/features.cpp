@@ -8,6 +8,12 @@
 bool Features::AVX;
 bool Features::FXSR;
 bool Features::APIC;
+bool Features::PDPE1GB;
+bool Features::PGE;
+bool Features::PCID;
+bool Features::INVPCID;
+bool Features::PAT;
+cache_info Features::LLC;
 char cpu_name[49];
 const char* Features::highest_supported_float;
 struct cpu_features* Features::features;
@@ -119,6 +125,44 @@ void __attribute__((target("no-sse"))) Features::loadCPUName() {
 	cpu_name[48] = '\0';
 }
 
+/**
+ * @brief Walks the subleaves of a deterministic cache parameters leaf, and keeps the highest level data (or unified) cache.
+ *
+ * @param leaf 4 on Intel, 0x8000001D on AMD. Every subleaf is one cache, until the type comes back as 0.
+ * @param llc Where to put the cache.
+ */
+static void __attribute__((target("no-sse"))) scanCacheLeaf(uint32_t leaf, cache_info* llc) {
+	uint32_t eax, ebx, ecx, edx;
+	for (uint32_t i = 0; i < 16; i++) {
+		__cpuid_count(leaf, i, eax, ebx, ecx, edx);
+		uint32_t type = eax & 0x1F;
+		if (type == 0) break;
+		// 1 is data, 3 is unified. Instruction caches don't matter for where data ends up.
+		if (type == 2) continue;
+		uint8_t level = (eax >> 5) & 0x7;
+		if (level < llc->level) continue;
+		llc->level = level;
+		llc->line_size = (ebx & 0xFFF) + 1;
+		llc->ways = ((ebx >> 22) & 0x3FF) + 1;
+		llc->sets = ecx + 1;
+		uint32_t partitions = ((ebx >> 12) & 0x3FF) + 1;
+		llc->size = llc->ways * partitions * llc->line_size * llc->sets;
+	}
+}
+
+/**
+ * @brief Finds the last level cache. AMD has leaf 4 too, but it's reserved there and comes back empty.
+ *
+ * @return true If a data (or unified) cache was found.
+ * @return false If the cpu doesn't describe its caches.
+ */
+bool __attribute__((target("no-sse"))) Features::loadCacheInfo() {
+	memset(&LLC, 0, sizeof(LLC));
+	if (__get_cpuid_max(0, NULL) >= 4) scanCacheLeaf(4, &LLC);
+	if (LLC.level == 0 && __get_cpuid_max(0x80000000, NULL) >= 0x8000001D) scanCacheLeaf(0x8000001D, &LLC);
+	return LLC.level != 0;
+}
+
 /**
  * @brief Check all important features.
  * It will call abort() if needed features do not exist.
@@ -160,6 +204,18 @@ report it to our GitHub Repo.\n");
 		Logger::Checklist::noCheckEntry("APIC does not exists.");
 	}
 
+	// 1GB pages are optional, the virtual memory manager falls back to 2MB pages without them.
+	PDPE1GB = listFeatureCheck("1GB Pages", features->PDPE1GB == FEATURE_SUPPORTED);
+	// Global pages keep the kernel in the tlb across cr3 switches. Without them everything still works, just slower.
+	PGE = listFeatureCheck("Global Pages", features->PGE == FEATURE_SUPPORTED);
+	// PCIDs let every address space keep its own tlb entries across cr3 switches.
+	PCID = listFeatureCheck("PCID", features->PCID == FEATURE_SUPPORTED);
+	INVPCID = listFeatureCheck("INVPCID", features->INVPCID == FEATURE_SUPPORTED);
+	// The PAT gives us write-combining, which the framebuffer really wants. Without it PAGE_CACHE_WC ends up write-through.
+	PAT = listFeatureCheck("PAT", features->PAT == FEATURE_SUPPORTED);
+	// The last level cache's geometry decides how many page colors there are (see PhysicalAllocColored).
+	listFeatureCheck("Cache Parameters", loadCacheInfo());
+
 	if (features->FXSR == FEATURE_SUPPORTED) {
 		// Just set this up so we can properly use floating point stuff later.
 		char fxsave_region[512] __attribute__((aligned(16)));
@@ -187,6 +243,66 @@ bool Features::getAPIC() {
 	return APIC;
 }
 
+/**
+ * @brief Returns whether or not the cpu supports 1GB pages (PDPE1GB).
+ *
+ * @return true Page directory pointer entries can map 1GB pages.
+ * @return false Only 2MB and 4KB pages can be used.
+ */
+bool Features::get1GBPages() {
+	return PDPE1GB;
+}
+
+/**
+ * @brief Returns whether or not global pages (CR4.PGE) are supported.
+ *
+ * @return true Kernel mappings are global and stay in the tlb across cr3 switches.
+ * @return false The global bit in page tables is ignored.
+ */
+bool Features::getGlobalPages() {
+	return PGE;
+}
+
+/**
+ * @brief Returns whether or not process-context identifiers are supported and enabled (CR4.PCIDE).
+ *
+ * @return true The low 12 bits of cr3 select a PCID.
+ * @return false Every cr3 write flushes the non-global tlb.
+ */
+bool Features::getPCID() {
+	return PCID;
+}
+
+/**
+ * @brief Returns whether or not the invpcid instruction can be used.
+ * Only true when PCIDs are enabled too, invpcid isn't much use without them.
+ *
+ * @return true invpcid can invalidate entries of any PCID.
+ * @return false Only the current PCID can be invalidated (invlpg).
+ */
+bool Features::getINVPCID() {
+	return PCID && INVPCID;
+}
+
+/**
+ * @brief Returns whether or not the page attribute table is supported and set up.
+ *
+ * @return true PAGE_CACHE_WC mappings are write-combining.
+ * @return false PWT/PCD only pick between write-back, write-through and uncached.
+ */
+bool Features::getPAT() {
+	return PAT;
+}
+
+/**
+ * @brief Returns the geometry of the last level cache.
+ *
+ * @return const cache_info* The cache, NULL if cpuid doesn't describe the caches.
+ */
+const cache_info* Features::getLLC() {
+	return LLC.level != 0 ? &LLC : NULL;
+}
+
 const char* Features::getCPUName() {
 	return cpu_name;
 }
@@ -230,8 +346,52 @@ bool Features::setupAPIC() {
 }
 
 
+/**
+ * @brief Sets CR4.PGE, so every mapping with the global bit stays in the tlb when cr3 is reloaded.
+ * The kernel's page tables already have the bit set, so this is all it takes.
+ */
+void Features::enableGlobalPages() {
+	if (!PGE) return;
+	uint64_t cr4;
+	asm volatile("mov %%cr4, %0" : "=r"(cr4));
+	cr4 |= 1 << 7;
+	asm volatile("mov %0, %%cr4" :: "r"(cr4) : "memory");
+}
+
+/**
+ * @brief Sets CR4.PCIDE. The current PCID has to be 0 when this happens, which it always is for the kernel's page tables.
+ */
+void Features::enablePCID() {
+	if (!PCID) return;
+	uint64_t cr4;
+	asm volatile("mov %%cr4, %0" : "=r"(cr4));
+	cr4 |= 1 << 17;
+	asm volatile("mov %0, %%cr4" :: "r"(cr4) : "memory");
+}
+
+/* IA32_PAT holds 8 memory types, and the PAT/PCD/PWT bits of a page table entry pick one of them.
+ * This is the power-on value except for entry 1 (PWT only), which is write-combining instead of write-through.
+ * Entry 1 is used so PAGE_CACHE_WC doesn't need the PAT bit, which moves around depending on the page size.
+ */
+#define IA32_PAT_MSR 0x277
+#define PAT_VALUE    0x0007040600070106ULL // UC, UC-, WT, WB, UC, UC-, WC, WB (entry 7 to 0)
+
+/**
+ * @brief Programs the PAT with a write-combining entry. Nothing is mapped with PWT set yet, so no tlb entries have to go.
+ * The caches are written back around the change, like the manuals ask for.
+ */
+void Features::enablePAT() {
+	if (!PAT) return;
+	asm volatile("wbinvd" ::: "memory");
+	asm volatile("wrmsr" :: "c"(IA32_PAT_MSR), "a"((uint32_t) PAT_VALUE), "d"((uint32_t) (PAT_VALUE >> 32)) : "memory");
+	asm volatile("wbinvd" ::: "memory");
+}
+
 void Features::enableFeatures() {
 	Features::enableSSE();
+	Features::enableGlobalPages();
+	Features::enablePCID();
+	Features::enablePAT();
 	// We'll hopefully get to the APIC eventually.
 	// puts_vga_color("Enabling APIC.\n", VGA_COLOR_LIGHT_CYAN, VGA_COLOR_BLACK);
 	// if (!Features::setupAPIC()) {
@@ -0,0 +1,37 @@
+#include <klibc/idle.h>
+#include <stddef.h>
+#include <panic.h>
+
+#define MAX_IDLE_TASKS 8
+
+idle_task idleTasks[MAX_IDLE_TASKS];
+size_t idleTaskCount = 0;
+size_t nextIdleTask = 0;
+
+/**
+ * @brief Register a function to be called whenever the kernel is idle.
+ *
+ * @param task Task to run. It should do a small amount of work, and return false when there's nothing left to do.
+ */
+void registerIdleTask(idle_task task) {
+	if (idleTaskCount >= MAX_IDLE_TASKS) panic_s("Too many idle tasks registered.");
+	idleTasks[idleTaskCount] = task;
+	idleTaskCount++;
+}
+
+/**
+ * @brief Runs a single step of the idle tasks. Tasks take turns, so one busy task can't starve the others.
+ *
+ * @return true If a task did some work.
+ * @return false If every task is done (for now).
+ */
+bool runIdleTasks(void) {
+	for (size_t i = 0; i < idleTaskCount; i++) {
+		size_t index = (nextIdleTask + i) % idleTaskCount;
+		if (idleTasks[index]()) {
+			nextIdleTask = (index + 1) % idleTaskCount;
+			return true;
+		}
+	}
+	return false;
+}
@@ -20,6 +20,7 @@ extern "C" {
 		uint8_t POPCNT;
 		uint8_t SSE4_2;
 		uint8_t SSE4_1;
+		uint8_t PCID; // bit 17
 		uint8_t CMPXCHG16B;
 		uint8_t FMA;
 		uint8_t SSSE3;
@@ -51,6 +52,13 @@ extern "C" {
 		uint8_t DE;
 		uint8_t VME;
 		uint8_t FPU; // starts at bit 0
+
+		// extended edx (leaf 0x80000001)
+		uint8_t PDPE1GB; // bit 26, 1GB pages
+		uint8_t NX; // bit 20
+
+		// structured extended ebx (leaf 7, subleaf 0)
+		uint8_t INVPCID; // bit 10
 	} cpu_features;
 
 	char* vendorID();
@@ -4,11 +4,26 @@
 #include <stdbool.h>
 #include <klibc/cpuid_calls.h>
 
+// Geometry of a cache, from cpuid leaf 4 (0x8000001D on AMD).
+typedef struct {
+	uint8_t level;
+	uint32_t size;          // In bytes
+	uint32_t ways;
+	uint32_t line_size;
+	uint32_t sets;
+} cache_info;
+
 class Features {
 private:
 	static bool AVX;
 	static bool FXSR;
 	static bool APIC;
+	static bool PDPE1GB;
+	static bool PGE;
+	static bool PCID;
+	static bool INVPCID;
+	static bool PAT;
+	static cache_info LLC;
 	static const char* highest_supported_float;
 	static struct cpu_features* features;
 
@@ -16,13 +31,23 @@ private:
 	static bool listFeatureCheck(const char* name, bool a);
 	static void checkFloatingPointSupport();
 	static void loadCPUName();
+	static bool loadCacheInfo();
 	static void enableSSE();
 	static bool setupAPIC();
+	static void enableGlobalPages();
+	static void enablePCID();
+	static void enablePAT();
 public:
 	static void checkFeatures(struct cpu_features* f);
 	static const char* highestFloat();
 	static const char* getCPUName();
 	static bool getAPIC();
+	static bool get1GBPages();
+	static bool getGlobalPages();
+	static bool getPCID();
+	static bool getINVPCID();
+	static bool getPAT();
+	static const cache_info* getLLC();
 
 
 	static void enableFeatures();
@@ -0,0 +1,18 @@
+#ifndef IDLE_H
+#define IDLE_H
+#include <stdbool.h>
+#ifdef __cplusplus
+extern "C" {
+#endif
+	/* Idle tasks are small pieces of background work that run while the kernel is waiting on something (right now, the keyboard).
+	 * A task should only do a bounded amount of work per call, and return false once it has nothing left to do.
+	 */
+	typedef bool (*idle_task)(void);
+
+	void registerIdleTask(idle_task task);
+	bool runIdleTasks(void);
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,31 @@
+#ifndef KSM_HPP
+#define KSM_HPP
+#include <stdint.h>
+#include <stddef.h>
+
+/* Same-page merging. Pages marked with Memory::SetMergeable get checksummed in the background, and pages with the same
+ * contents get merged into a single read-only frame. Writing to a merged page gives it its own copy again (see BreakCOW).
+ * A page has to keep the same checksum from one pass to the next before it's merged, pages that are still being written to are left alone.
+ */
+#define KSM_MAX_NODES     512   // Pages remembered per pass, anything past this just doesn't get merged until the next pass
+#define KSM_PASS_INTERVAL 1000  // Minimum amount of ms between the start of two passes
+
+typedef struct {
+	size_t passes;          // Full passes over the kernel address space
+	size_t scanned;         // Pages checksummed
+	size_t changed;         // Pages skipped because their checksum changed since the last pass
+	size_t mismatched;      // Pages with the same checksum as another page, but not the same contents
+	size_t merged;          // Frames given back by merging
+	size_t reclaimed;       // Frames currently saved, merged pages that got copied or freed since don't count
+} ksm_stats;
+
+namespace Memory {
+	void InitKSM();
+	bool ScanMergeable();
+
+	namespace Info {
+		void getKSMStats(ksm_stats* snapshot);
+	}
+}
+
+#endif // KSM_HPP
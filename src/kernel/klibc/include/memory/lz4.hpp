@@ -0,0 +1,21 @@
+#ifndef LZ4_HPP
+#define LZ4_HPP
+#include <stdint.h>
+#include <stddef.h>
+
+/* An LZ4 block compressor and decompressor (the raw block format, no frame header).
+ * Greedy matching with a single hash table, so it's nowhere near the best ratio, but it runs at memory speed,
+ * which is what compressed swap needs. Neither function touches the sse registers, they can run inside the page fault handler.
+ */
+#define LZ4_HASH_BITS     12
+#define LZ4_MIN_MATCH     4
+#define LZ4_LAST_LITERALS 5     // The format needs the last 5 bytes to be literals
+#define LZ4_MATCH_LIMIT   12    // and no match can start in the last 12
+#define LZ4_MAX_OFFSET    65535
+
+namespace Memory {
+	size_t LZ4Compress(const uint8_t* src, size_t size, uint8_t* dst, size_t capacity);
+	size_t LZ4Decompress(const uint8_t* src, size_t size, uint8_t* dst, size_t capacity);
+}
+
+#endif // LZ4_HPP
@@ -0,0 +1,51 @@
+#ifndef PAGE_FAULT_HPP
+#define PAGE_FAULT_HPP
+#include <stdint.h>
+#include <stddef.h>
+
+/* Demand paging. A demand region is a range of virtual memory that's reserved, but has nothing behind it yet.
+ * The first access to a page in it faults, and the fault handler maps a zeroed frame there and lets the access try again.
+ * Big sparse reservations only cost the pages that actually get touched.
+ */
+#define MAX_DEMAND_REGIONS 32
+// Reserved at boot for big temporary buffers. Only the pages something actually writes to ever get a frame.
+#define DEMAND_SCRATCH_SIZE (256ULL * 1024 * 1024)
+
+/* Page fault error code bits */
+#define PF_PRESENT  0x01    // The page was present, so this is a protection violation
+#define PF_WRITE    0x02    // The access was a write
+#define PF_USER     0x04    // The access came from ring 3
+#define PF_RESERVED 0x08    // A reserved bit was set in a page table entry
+#define PF_FETCH    0x10    // The access was an instruction fetch
+
+typedef struct {
+	uintptr_t start;
+	uintptr_t end;          // First byte after the region
+	uint64_t flags;         // Page flags the frames get mapped with (BIT_WRITE, BIT_USR, etc.)
+	const char* name;
+	size_t faults;          // Pages mapped in on demand
+} demand_region;
+
+typedef struct {
+	size_t faults;          // Every page fault
+	size_t demand;          // Faults fixed by mapping a new frame
+	size_t cow;             // Writes to copy-on-write pages
+	size_t swap;            // Pages brought back from swap
+	size_t unhandled;       // Faults that weren't in a region, or weren't allowed by it
+} fault_stats;
+
+namespace Memory {
+	void InitDemandPaging();
+	bool RegisterDemandRegion(uintptr_t start, size_t size, uint64_t flags, const char* name);
+	uintptr_t ReserveDemandRange(size_t size, uint64_t flags, const char* name);
+	uintptr_t GetDemandScratch();
+	bool HandlePageFault(uintptr_t addr, uint64_t error_code);
+
+	namespace Info {
+		size_t getDemandRegionCount();
+		bool getDemandRegion(size_t index, demand_region* snapshot);
+		void getFaultStats(fault_stats* snapshot);
+	}
+}
+
+#endif // PAGE_FAULT_HPP
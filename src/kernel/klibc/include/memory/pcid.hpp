@@ -0,0 +1,45 @@
+#ifndef PCID_HPP
+#define PCID_HPP
+#include <stdint.h>
+#include <stddef.h>
+
+/* Process-context identifiers. With CR4.PCIDE set, the low 12 bits of cr3 tag every tlb entry with the address space it belongs to,
+ * so switching address spaces doesn't have to throw the old entries out.
+ *
+ * PCIDs are handed out in generations. Every address space remembers the PCID it got and which generation it got it in.
+ * When all of them are used up, the generation goes up, and every address space gets a new PCID
+ * the next time it's switched to. Nothing has to go around taking PCIDs back, and nothing gets flushed right then either:
+ * a PCID is always loaded without CR3_NOFLUSH the first time after it's handed out, which throws out whatever its old owner left behind.
+ *
+ * PCID 0 always belongs to the kernel's own page tables. It never changes hands, so when it needs flushing
+ * without invpcid, the next switch back to it just leaves off CR3_NOFLUSH.
+ */
+#define PCID_COUNT 4096
+#define PCID_KERNEL 0
+#define CR3_NOFLUSH (1ULL << 63) // Don't flush the new PCID's entries when loading cr3
+
+/* Kept by whatever owns an address space. Zero it before the first switch. */
+typedef struct {
+	uint16_t pcid;
+	uint64_t generation;    // 0 if the address space has never had a PCID
+} pcid_context;
+
+typedef struct {
+	size_t switches;        // Address space switches
+	size_t noflush;         // Switches that kept the tlb entries of the new address space
+	size_t assigned;        // PCIDs handed out
+	size_t rollovers;       // Times every PCID was in use and the generation went up
+	size_t invpcids;        // Targeted invalidations with invpcid
+} pcid_stats;
+
+namespace Memory {
+	void SwitchAddressSpace(pcid_context* context, uintptr_t pml4_phys);
+	void InvalidatePCIDPage(pcid_context* context, uintptr_t virt);
+	void InvalidatePCID(pcid_context* context);
+
+	namespace Info {
+		void getPCIDStats(pcid_stats* snapshot);
+	}
+}
+
+#endif // PCID_HPP
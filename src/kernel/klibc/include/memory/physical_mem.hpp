@@ -14,6 +14,63 @@ typedef struct {
 	size_t reserved;
 } mmap_info;
 
+/* Orders for the buddy allocator. A block of order n is 2^n 4KB frames. */
+#define PHYS_ORDER_4KB  0
+#define PHYS_ORDER_2MB  9
+#define PHYS_ORDER_1GB  18
+#define PHYS_MAX_ORDER  18
+
+/* Zones. Physical memory is split up by what can address it, every region of the allocator sits in exactly one zone.
+ * Allocations take from the highest zone they're allowed to, and only fall back to lower zones when it's empty.
+ */
+#define ZONE_DMA        0   // Below 16MB, for legacy (ISA) DMA
+#define ZONE_DMA32      1   // Below 4GB, for devices that can only use 32 bit addresses
+#define ZONE_NORMAL     2   // Everything else
+#define ZONE_COUNT      3
+
+#define ZONE_DMA_END    0x1000000ULL
+#define ZONE_DMA32_END  0x100000000ULL
+
+/* Allocation counters, maintained on every alloc/free so reading them is O(1).
+ * There is one set for the entire allocator, one for every zone, and one for every region of the memory map.
+ */
+typedef struct {
+	size_t total_frames;                            // 4KB frames managed by the allocator
+	size_t free_frames;                             // 4KB frames that are currently free
+	size_t deferred_frames;                         // Free frames that haven't been handed to the free lists yet (see PhysicalInitDeferred)
+	size_t allocated_blocks[PHYS_MAX_ORDER + 1];    // Blocks currently allocated, by order
+	size_t alloc_count;                             // Successful allocations since boot
+	size_t free_count;                              // Successful frees since boot
+	size_t failed_count;                            // Allocations that couldn't be satisfied
+} phys_counters;
+
+/* Frame descriptors. Every 2MB frame of usable memory has one, kept in a flat array per region and indexed by frame number.
+ * Descriptors are 8 bytes, so 8 of them share a cache line and every 1GB of memory costs 4KB of descriptors.
+ */
+#define FRAME_ALLOCATED  0x01 // The whole frame is part of an allocated block (order >= PHYS_ORDER_2MB)
+#define FRAME_SPLIT      0x02 // The frame has been broken up into blocks smaller than 2MB
+
+typedef struct {
+	uint16_t refcount;      // Amount of mappings that point to this frame
+	uint16_t small_frames;  // Amount of 4KB frames allocated inside this frame, when FRAME_SPLIT is set
+	uint8_t flags;
+	uint8_t order;          // Order of the block the frame belongs to, when FRAME_ALLOCATED is set
+	uint16_t checksum;      // Low bits of the frame's checksum from the last same-page merging pass (see ksm.cpp)
+} __attribute__((aligned(8))) page_frame;
+
+/* Page coloring. Frames whose addresses are the same modulo (LLC size / ways) land in the same sets of the last level cache,
+ * the color of a frame is which of those slices it's in. Handing a consumer frames with different colors keeps its pages from evicting each other.
+ * Only 4KB frames have a color, a 2MB frame covers every color there is (at most PHYS_MAX_COLORS).
+ */
+#define PHYS_MAX_COLORS (1 << PHYS_ORDER_2MB)
+
+typedef struct {
+	size_t colors;          // Amount of colors the last level cache has, 1 if its geometry isn't known
+	size_t colored;         // Allocations that got the color they asked for
+	size_t fallbacks;       // Allocations that had to take a frame with a different color
+	size_t splits;          // Blocks big enough to have every color that got split up for one
+} color_stats;
+
 namespace Memory {
 	void PhysicalMemInit();
 
@@ -22,10 +79,35 @@ namespace Memory {
 		size_t getUsedPageCount();
 		uintptr_t getPhysKernelEnd();
 		const mmap_info* getMMapInfo();
+
+		void getCounters(phys_counters* snapshot);
+		size_t getRegionCount();
+		bool getUsableRange(size_t index, uintptr_t* start, uintptr_t* end);
+		bool getRegionCounters(size_t region, uintptr_t* base, uintptr_t* end, phys_counters* snapshot);
+		bool getZoneCounters(uint8_t zone, size_t* watermark, phys_counters* snapshot);
+		void getWatermarks(size_t* low, size_t* high);
+		void getColorStats(color_stats* snapshot);
 	}
 
+	uintptr_t PhysicalAlloc(uint8_t order, uint8_t max_zone = ZONE_NORMAL);
+	void PhysicalFree(uintptr_t phys_addr, uint8_t order);
+	uintptr_t PhysicalAllocContiguous(size_t bytes, size_t alignment = 0x1000, uintptr_t max_phys_addr = UINTPTR_MAX);
+	void PhysicalFreeContiguous(uintptr_t phys_addr, size_t bytes);
+
+	bool SetPageColoring(bool enabled);
+	bool GetPageColoring();
+	size_t GetPageColor(uintptr_t addr);
+	uintptr_t PhysicalAllocColored(size_t color, uint8_t max_zone = ZONE_NORMAL);
+	uintptr_t PhysicalAllocPage(uintptr_t virt, uint8_t max_zone = ZONE_NORMAL);
+
+	page_frame* GetFrameDescriptor(uintptr_t phys_addr);
+	bool PhysicalInitDeferred();
+
 	uintptr_t PhysicalAlloc2MB();
 	void PhysicalDeAlloc2MB(uintptr_t phys_addr);
+
+	uintptr_t PhysicalAlloc1GB();
+	void PhysicalDeAlloc1GB(uintptr_t phys_addr);
 }
 
 #endif // PHYSICAL_MEM_H
\ No newline at end of file
@@ -0,0 +1,28 @@
+#ifndef RANGE_SET_HPP
+#define RANGE_SET_HPP
+#include <stdint.h>
+#include <stddef.h>
+
+/* A set of physical address ranges, kept sorted and merged.
+ * Inserting merges with every range it overlaps or touches, so no two ranges in a set ever overlap.
+ * That means lookups are a binary search, and two sets can be combined with a single linear sweep.
+ * The storage is provided by the caller, since these get used before the kernel heap exists.
+ */
+typedef struct {
+	uintptr_t start;
+	uintptr_t end;      // First byte after the range
+} phys_range;
+
+typedef struct {
+	phys_range* ranges;
+	size_t count;
+	size_t capacity;
+} range_set;
+
+#define RANGE_SET_INIT(storage) { storage, 0, sizeof(storage) / sizeof(phys_range) }
+
+void rangeSetInsert(range_set* set, uintptr_t start, uintptr_t end);
+bool rangeSetOverlaps(const range_set* set, uintptr_t start, uintptr_t end);
+void rangeSetSubtract(const range_set* set, const range_set* remove, range_set* out);
+
+#endif // RANGE_SET_HPP
@@ -0,0 +1,32 @@
+#ifndef RB_TREE_HPP
+#define RB_TREE_HPP
+#include <stdint.h>
+#include <stddef.h>
+
+/* An intrusive red-black tree. Nodes are embedded in whatever is being stored, and RB_ENTRY gets back to the containing struct.
+ * The tree doesn't know about keys at all. To insert, walk down from the root comparing keys yourself,
+ * then call rbLink with the spot you found and rbInsertColor to rebalance. That way nothing here ever has to allocate.
+ */
+typedef struct rb_node {
+	struct rb_node* parent;
+	struct rb_node* left;
+	struct rb_node* right;
+	bool red;
+} rb_node;
+
+typedef struct {
+	rb_node* root;
+} rb_tree;
+
+#define RB_TREE_INIT { NULL }
+#define RB_ENTRY(ptr, type, member) ((type*) ((uintptr_t) (ptr) - offsetof(type, member)))
+
+void rbLink(rb_node* node, rb_node* parent, rb_node** link);
+void rbInsertColor(rb_tree* tree, rb_node* node);
+void rbErase(rb_tree* tree, rb_node* node);
+
+rb_node* rbFirst(const rb_tree* tree);
+rb_node* rbNext(const rb_node* node);
+rb_node* rbPrev(const rb_node* node);
+
+#endif // RB_TREE_HPP
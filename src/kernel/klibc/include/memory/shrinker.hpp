@@ -0,0 +1,49 @@
+#ifndef SHRINKER_HPP
+#define SHRINKER_HPP
+#include <stdint.h>
+#include <stddef.h>
+
+/* Shrinkers. Anything that holds on to memory it doesn't strictly need (empty slabs, the zeroed page pool, etc.)
+ * registers a shrinker, and gets asked to give some of it back when memory runs low.
+ * Background reclaim runs when the kernel is idle, after an allocation takes free memory under the low watermark (see PhysicalAlloc).
+ * Direct reclaim runs right away, when NewKernelPage can't get a frame. Only once that fails does anything get swapped out.
+ * Amounts are always in 4KB frames.
+ */
+#define MAX_SHRINKERS 8
+
+typedef size_t (*shrinker_count)();
+typedef size_t (*shrinker_scan)(size_t frames);
+
+typedef struct {
+	const char* name;
+	shrinker_count count;   // Frames it could give back right now
+	shrinker_scan scan;     // Gives back up to that many frames (it can go over by a page), and returns how many it did
+	size_t runs;            // Times it was asked to give memory back
+	size_t freed;           // Frames given back since boot
+	size_t last_freed;      // Frames given back the last time it ran
+	uint64_t last_cycles;   // How long the last run took
+} shrinker;
+
+typedef struct {
+	size_t wakeups;         // Times an allocation went under the low watermark with background reclaim asleep
+	size_t background;      // Background reclaim runs
+	size_t direct;          // Direct reclaim runs
+	size_t freed;           // Frames freed by all of them
+} reclaim_stats;
+
+namespace Memory {
+	void InitReclaim();
+	bool RegisterShrinker(const char* name, shrinker_count count, shrinker_scan scan);
+	size_t ShrinkCaches(size_t frames);
+	size_t DirectReclaim(size_t frames);
+	void WakeReclaim();
+	bool BackgroundReclaim();
+
+	namespace Info {
+		size_t getShrinkerCount();
+		bool getShrinker(size_t index, shrinker* snapshot);
+		void getReclaimStats(reclaim_stats* snapshot);
+	}
+}
+
+#endif // SHRINKER_HPP
@@ -0,0 +1,36 @@
+#ifndef SWAP_HPP
+#define SWAP_HPP
+#include <stdint.h>
+#include <stddef.h>
+#include <memory/virtual_mem.hpp>
+
+/* Compressed swap in RAM, like zram. When physical memory runs out, cold pages marked with Memory::SetSwappable get compressed
+ * with LZ4 into memory from the physical allocator, and their entries are replaced with swap entries (see SWAP_ENTRY).
+ * The next access to one faults, and the page fault handler decompresses it into a new frame.
+ * Cold means the accessed bit stayed clear for a whole lap of the clock (see NextColdPage).
+ */
+#define SWAP_MAX_SLOTS       512                    // Pages that can be in swap at once, 1GB before compression
+#define SWAP_MAX_COMPRESSED  (PAGE_2MB_SIZE / 2)    // Pages that don't compress to at least half stay where they are
+#define SWAP_SCAN_TRIES      8                      // Incompressible pages skipped in one go before giving up
+
+typedef struct {
+	size_t stored;          // Pages in swap right now
+	size_t stored_bytes;    // Compressed size of those pages
+	size_t swapped_out;
+	size_t swapped_in;
+	size_t incompressible;  // Cold pages left alone because they didn't compress well enough
+	size_t dropped;         // Pages freed (or mapped over) while they were in swap
+} swap_stats;
+
+namespace Memory {
+	void InitSwap();
+	bool SwapOutColdPage();
+	bool SwapIn(uintptr_t addr, bool user);
+	void DropSwapSlot(size_t slot);
+
+	namespace Info {
+		void getSwapStats(swap_stats* snapshot);
+	}
+}
+
+#endif // SWAP_HPP
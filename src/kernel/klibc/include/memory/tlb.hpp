@@ -0,0 +1,59 @@
+#ifndef TLB_HPP
+#define TLB_HPP
+#include <stdint.h>
+#include <stddef.h>
+
+#include <memory/virtual_mem.hpp>
+
+/* TLB invalidation. Changing a present page table entry means the old translation has to be thrown out of the TLB.
+ * Small ranges are invalidated page by page with invlpg, anything bigger than the threshold reloads cr3 instead,
+ * since at that point it's cheaper to just start over than to issue hundreds of invlpgs.
+ * Unmaps can be queued up and flushed together, so a bunch of them only costs one full flush at most.
+ */
+#define TLB_DEFAULT_THRESHOLD 32 // Pages. Past this a full flush is used instead.
+// A full flush also has to get rid of global (kernel) pages, so it toggles CR4.PGE instead of reloading cr3 when that's on.
+#define TLB_BATCH_SIZE 16        // Ranges that can be queued before the batch turns into a full flush
+#define TLB_DEFERRED_SIZE 64     // Releases that can wait on the queue before it gets flushed early
+
+/* Memory that was unmapped can't be handed out again until the flush, something could still be using it through a stale tlb entry.
+ * Frames, page tables and virtual ranges freed after an unmap wait in the queue, and get released once FlushTLBQueue has run.
+ */
+typedef void (*deferred_release)(uintptr_t addr, uint64_t arg);
+
+/* invpcid types */
+#define INVPCID_ADDRESS     0   // One address in one PCID
+#define INVPCID_CONTEXT     1   // Everything but global pages in one PCID
+#define INVPCID_ALL_GLOBAL  2   // Everything in every PCID, global pages included
+#define INVPCID_ALL         3   // Everything but global pages in every PCID
+
+typedef struct {
+	size_t invlpgs;         // Single page invalidations (invlpg instructions)
+	size_t range_flushes;   // Ranges that were flushed with invlpg
+	size_t full_flushes;    // Full flushes (cr3 reloads)
+	size_t batches;         // Queues that got flushed
+	size_t queued;          // Ranges added to a queue
+	size_t deferred;        // Releases that waited for a flush
+} tlb_stats;
+
+namespace Memory {
+	void FlushTLBPage(uintptr_t virt);
+	void FlushTLBRange(uintptr_t virt, size_t size, size_t page_size = PAGE_4KB_SIZE);
+	void FlushTLBAll();
+	void InvPCID(uint8_t type, uint16_t pcid, uintptr_t virt);
+
+	void QueueTLBFlush(uintptr_t virt, size_t size, size_t page_size = PAGE_4KB_SIZE);
+	void QueueTLBFlushAll();
+	void QueueDeferredRelease(deferred_release release, uintptr_t addr, uint64_t arg);
+	void QueueFrameFree(uintptr_t phys_addr, uint8_t order);
+	void FlushTLBQueue();
+	void InitTLB();
+
+	void SetTLBFlushThreshold(size_t pages);
+	size_t GetTLBFlushThreshold();
+
+	namespace Info {
+		void getTLBStats(tlb_stats* snapshot);
+	}
+}
+
+#endif // TLB_HPP
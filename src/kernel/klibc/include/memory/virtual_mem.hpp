@@ -9,6 +9,14 @@
 #define CANONICAL_UPPER 0xFFFF000000000000ULL
 #define TABLE_ENTRIES 512 
 
+/* The physmap. All usable memory is mapped once starting at PHYSMAP_BASE (pml4[256], the start of the higher half),
+ * so any physical address in RAM can be reached by adding the base. Only valid after Memory::InitPhysmap.
+ */
+#define PHYSMAP_BASE 0xFFFF800000000000ULL
+#define PHYSMAP_SIZE 0x400000000000ULL // 64TB, 128 pml4 entries
+#define PHYS_TO_VIRT(addr) ((uintptr_t) (addr) + PHYSMAP_BASE)
+#define VIRT_TO_PHYS(addr) ((uintptr_t) (addr) - PHYSMAP_BASE)
+
 /* Macros to make page modification not magic. */
 #define GET_PML4_INDEX(page)         (((page) >> 39) & 0x1FF)
 #define GET_PDPT_INDEX(page)         (((page) >> 30) & 0x1FF)
@@ -29,6 +37,29 @@
 #define BIT_WRITE                  0x02ULL
 #define BIT_PRESENT                0x01ULL
 
+// Bits 9-11 are ignored by the cpu and free for us to use.
+#define BIT_COW                    BIT_9 // Read-only mapping of a shared frame, the first write to it makes a copy
+#define BIT_MERGEABLE              BIT_10 // The page can be merged with identical pages (see ksm.cpp)
+#define BIT_SWAPPABLE              BIT_11 // The page can be compressed into swap when memory runs out (see swap.cpp)
+
+/* Swap entries. A 2MB page in swap leaves behind an entry that isn't present, with bit 11 set and the swap slot where the frame would be.
+ * The cpu ignores everything in an entry that isn't present, so BIT_USR stays on it for FreeUserPage to check.
+ */
+#define BIT_SWAPPED                BIT_11
+#define SWAP_ENTRY(slot)           (((uint64_t) (slot) << PTE_OFFSET) | BIT_SWAPPED)
+#define IS_SWAP_ENTRY(entry)       (((entry) & (BIT_SWAPPED | BIT_PRESENT)) == BIT_SWAPPED)
+#define SWAP_SLOT(entry)           (((entry) & PAGE_FRAME) >> PTE_OFFSET)
+
+/* Cache types. PWT and PCD pick an entry in the PAT, which Features::enablePAT sets up so PWT alone is write-combining.
+ * The PAT bit itself is never used, so these are the same for every page size.
+ * The MTRRs still apply on top of these, but a write-combining PAT entry wins over an uncached MTRR.
+ */
+#define PAGE_CACHE_MASK            (BIT_PCD | BIT_PWT)
+#define PAGE_CACHE_WB              0ULL                 // Write-back, the default for everything
+#define PAGE_CACHE_WC              BIT_PWT              // Write-combining, for framebuffers
+#define PAGE_CACHE_UC_MINUS        BIT_PCD              // Uncached, unless the MTRRs say write-combining
+#define PAGE_CACHE_UC              (BIT_PCD | BIT_PWT)  // Uncached, for mmio
+
 #define POS_NX                     63
 #define POS_11                     11
 #define POS_10                     10
@@ -66,21 +97,57 @@
 #define PDE_OFFSET  21ULL
 #define PTE_OFFSET  12ULL
 
+typedef struct {
+	size_t shared;          // Pages mapped a second time by MapShared
+	size_t shared_frames;   // Frames that currently have more than one mapping
+	size_t copied;          // Write faults that gave the page its own copy
+	size_t reused;          // Write faults where nothing else mapped the frame anymore, so it just became writable again
+	size_t merged;          // Frames given back by merging identical mergeable pages
+	size_t unmerged;        // Mergeable pages that stopped sharing a frame again, by getting copied or freed
+} cow_stats;
+
 namespace Memory {
 	void initVirtualMemory();
+	void InitPhysmap();
 
 	uintptr_t VirtToPhysBase(uintptr_t addr);
+	uintptr_t VirtToPhys(uintptr_t addr);
+	void Map(uintptr_t virt, uintptr_t phys, size_t size, uint64_t flags);
+	void Unmap(uintptr_t virt, size_t size);
 	void MapPreAllocMem(uintptr_t addr);
 	void mapFramebuffer(uintptr_t base_addr, size_t size);
+	void SetCacheMode(uintptr_t virt, size_t size, uint64_t mode);
 
 	void reserveMemory(uintptr_t base_addr, size_t size);
+	bool isReserved(uintptr_t base_addr, size_t size);
 
 	uintptr_t NewKernelPage();
+	uintptr_t NewKernelHugePage();
+	uintptr_t MapKernelRange(uintptr_t phys_addr, size_t size);
 	void FreeKernelPage(uintptr_t addr);
 
 	uintptr_t NewUserPage();
 	void FreeUserPage(uintptr_t addr);
 
+	bool MapShared(uintptr_t dst, uintptr_t src, size_t size);
+	uintptr_t ShareKernelPage(uintptr_t addr);
+	bool BreakCOW(uintptr_t addr, bool user);
+
+	void SetMergeable(uintptr_t addr, size_t size, bool mergeable);
+	uintptr_t NextMergeablePage(uintptr_t virt, uintptr_t end, uintptr_t* phys);
+	bool ProtectMergeable(uintptr_t virt);
+	bool MergePage(uintptr_t virt, uintptr_t into);
+
+	void SetSwappable(uintptr_t addr, size_t size, bool swappable);
+	uintptr_t NextColdPage(uintptr_t virt, uintptr_t end, uintptr_t* phys);
+	uint64_t EvictPage(uintptr_t virt, size_t slot);
+	uint64_t GetSwapEntry(uintptr_t virt);
+	bool RestorePage(uintptr_t virt, uint64_t entry);
+
+	namespace Info {
+		void getCOWStats(cow_stats* snapshot);
+	}
+
 	uintptr_t GetMappingEnd();
 }
 
@@ -0,0 +1,36 @@
+#ifndef VMALLOC_HPP
+#define VMALLOC_HPP
+#include <stdint.h>
+#include <stddef.h>
+
+/* Kernel virtual address space. Everything the kernel maps on the fly (kernel pages, vmalloc, MapKernelRange) gets its
+ * addresses from here. Free and used ranges are kept in red-black trees, so finding space is O(log n) instead of
+ * scanning page tables, and freed ranges get merged back together and reused.
+ */
+#define VMALLOC_BASE 0xFFFFC00000000000ULL // pml4[384], right after the physmap
+#define VMALLOC_SIZE 0x10000000000ULL      // 1TB
+#define MAX_VM_AREAS 1024                  // Free and used ranges combined
+
+typedef struct {
+	size_t used_areas;      // Ranges currently allocated
+	size_t free_areas;      // Free ranges, after merging
+	size_t used_bytes;      // Virtual memory currently allocated
+	size_t largest_free;    // Biggest free range
+	size_t vmalloc_pages;   // 4KB frames backing vmalloc allocations
+} vmalloc_stats;
+
+namespace Memory {
+	uintptr_t AllocKernelRange(size_t size, size_t alignment = 0x1000);
+	bool FreeKernelRange(uintptr_t addr);
+
+	namespace Info {
+		void getVmallocStats(vmalloc_stats* snapshot);
+	}
+}
+
+extern "C" {
+	void* vmalloc(size_t bytes);
+	void vfree(void* ptr);
+}
+
+#endif // VMALLOC_HPP
@@ -0,0 +1,30 @@
+#ifndef ZERO_POOL_HPP
+#define ZERO_POOL_HPP
+#include <stdint.h>
+#include <stddef.h>
+
+/* A small pool of kernel pages that have already been zeroed.
+ * The pool gets refilled when the kernel is idle, so anything that needs a clean page doesn't have to clear 2MB while it waits.
+ * Pooled pages are marked mergeable (see SetMergeable) and stay that way once they're handed out,
+ * so they're only for memory nothing but the cpu touches (slabs, etc.).
+ */
+#define ZERO_POOL_SIZE 8
+
+typedef struct {
+	size_t pooled;      // Pages currently sitting in the pool
+	size_t hits;        // Allocations served straight from the pool
+	size_t misses;      // Allocations that had to zero a page themselves
+	size_t refilled;    // Pages zeroed in the background since boot
+} zero_pool_stats;
+
+namespace Memory {
+	void InitZeroPool();
+	uintptr_t NewZeroedKernelPage();
+	bool RefillZeroPool();
+
+	namespace Info {
+		void getZeroPoolStats(zero_pool_stats* snapshot);
+	}
+}
+
+#endif // ZERO_POOL_HPP
@@ -13,6 +13,15 @@ extern "C" {
 	int meminfo(int argc, char** argv);
 	int meminfo_help(int argc, char** argv);
 
+	int fbbench(int argc, char** argv);
+	int fbbench_help(int argc, char** argv);
+
+	int memreclaim(int argc, char** argv);
+	int memreclaim_help(int argc, char** argv);
+
+	int pagecolor(int argc, char** argv);
+	int pagecolor_help(int argc, char** argv);
+
 	int sysinfo(int argc, char** argv);
 	void sysinfo_boot();
 #ifdef __cplusplus
@@ -6,6 +6,8 @@
 #include <klibc/kprint.h>
 #include <memory/kernel_alloc.h>
 #include <memory/virtual_mem.hpp>
+#include <memory/zero_pool.hpp>
+#include <memory/shrinker.hpp>
 
 
 #define SET_BIT(bitlist_entry, bit)   (bitlist_entry = bitlist_entry | (1 << (8 - bit)))
@@ -45,6 +47,7 @@ typedef struct slab_header_t {
 
 	uintptr_t chunk_base;
 	size_t chunk_count; // There will be this / 8 entries in bitlist
+	size_t used_chunks; // Once this hits 0 the slab can be given back (see kfree)
 } __attribute__((packed)) slab_header_t;
 
 slab_header_t* first_slab;
@@ -92,27 +95,30 @@ void printSlabInfo(slab_header_t* info, uintptr_t base, size_t bls, size_t paddi
 }
 
 void createSpanList() {
-	uintptr_t base = Memory::NewKernelPage();
+	bool extra = span_slab_start != NULL;
+	// The page comes pre-zeroed, so the bitlist (and every chunk) already starts out free.
+	uintptr_t base = Memory::NewZeroedKernelPage();
 	slab_header_t* header = (slab_header_t*) base;
 	header->object_size = sizeof(allocated_span_t);
 	header->next_slab = NULL;
 
 	uint64_t bls = calculateBitlistSize(sizeof(allocated_span_t));
 	header->chunk_count = bls * 8;
-	// Set all entries in the bitlist to zero.
-	memset((header + sizeof(header)), 0, bls);
-
 	// Calculate the base
 	uint64_t padding = calculatePadding(bls, sizeof(allocated_span_t));
 
 	// This should be border aligned.
 	// The calculation grows the chunklist "backwards" ensuring no overlap and a perfect alignment.
 	header->chunk_base = base + sizeof(slab_header_t) + bls + padding;
+	// Mostly empty slabs are mostly zeroes, same-page merging can share them until they fill up.
+	Memory::SetMergeable(base, PAGE_2MB_SIZE, true);
+	// Spans are only looked at by kfree, so every slab after the first can go to swap when memory runs out.
+	if (extra) Memory::SetSwappable(base, PAGE_2MB_SIZE, true);
 
 	if (span_slab_start == NULL) {
 		span_slab_start = header;
 	} else {
-		span_slab_start->next_slab = header;
+		span_slab_end->next_slab = header;
 	}
 	span_slab_end = header;
 }
@@ -121,24 +127,26 @@ void createSpanList() {
  * @brief Creates a slab of object_size byte chunks.
  *
  * @param object_size Amount of bytes per chunk.
+ * @param swappable If the slab can be swapped out. Only for slabs made when the ones of that size were full,
+ * the first slab of each size stays where it is.
  */
-void initSlab(uint64_t object_size) {
-	uintptr_t base = Memory::NewKernelPage();
+void initSlab(uint64_t object_size, bool swappable = false) {
+	// The page comes pre-zeroed, so the bitlist (and every chunk) already starts out free.
+	uintptr_t base = Memory::NewZeroedKernelPage();
 	slab_header_t* header = (slab_header_t*) base;
 	header->object_size = object_size;
 	header->next_slab = NULL;
 
 	uint64_t bls = calculateBitlistSize(object_size);
 	header->chunk_count = bls * 8;
-	// Set all entries in the bitlist to zero.
-	memset((header + sizeof(header)), 0, bls);
-
 	// Calculate the base
 	uint64_t padding = calculatePadding(bls, object_size);
 
 	// This should be border aligned.
 	// The calculation grows the chunklist "backwards" ensuring no overlap and a perfect alignment.
 	header->chunk_base = base + sizeof(slab_header_t) + bls + padding;
+	Memory::SetMergeable(base, PAGE_2MB_SIZE, true);
+	if (swappable) Memory::SetSwappable(base, PAGE_2MB_SIZE, true);
 
 	if (first_slab == NULL) {
 		first_slab = header;
@@ -150,6 +158,65 @@ void initSlab(uint64_t object_size) {
 	//printSlabInfo(header, base, bls, padding);
 }
 
+/**
+ * @brief Counts the frames held by empty slabs, span slabs included.
+ */
+size_t countEmptySlabs() {
+	size_t frames = 0;
+	for (slab_header_t* header = first_slab; header != NULL; header = header->next_slab) {
+		if (header->used_chunks == 0) frames += PAGE_2MB_SIZE / PAGE_4KB_SIZE;
+	}
+	for (slab_header_t* header = span_slab_start; header != NULL; header = header->next_slab) {
+		if (header->used_chunks == 0) frames += PAGE_2MB_SIZE / PAGE_4KB_SIZE;
+	}
+	return frames;
+}
+
+/**
+ * @brief Frees the empty slabs in a list, until enough frames have been freed.
+ *
+ * @param first First slab of the list.
+ * @param last Last slab of the list.
+ * @param frames Amount of 4KB frames to free.
+ * @return size_t Amount of frames freed.
+ */
+size_t releaseEmptySlabs(slab_header_t** first, slab_header_t** last, size_t frames) {
+	size_t freed = 0;
+	slab_header_t* prev = NULL;
+	slab_header_t* header = *first;
+	while (header != NULL && freed < frames) {
+		// The page is unmapped as soon as it's freed, so get the next one first.
+		slab_header_t* next = header->next_slab;
+		if (header->used_chunks == 0) {
+			if (prev == NULL) {
+				*first = next;
+			} else {
+				prev->next_slab = next;
+			}
+			if (*last == header) *last = prev;
+			Memory::FreeKernelPage((uintptr_t) header);
+			freed += PAGE_2MB_SIZE / PAGE_4KB_SIZE;
+		} else {
+			prev = header;
+		}
+		header = next;
+	}
+	return freed;
+}
+
+/**
+ * @brief Shrinker for the slab allocator. Unlike kfree, this also gives back the first slab of a size,
+ * the next kalloc of that size just creates a new one.
+ *
+ * @param frames Amount of 4KB frames to free.
+ * @return size_t Amount of frames freed.
+ */
+size_t shrinkSlabs(size_t frames) {
+	size_t freed = releaseEmptySlabs(&first_slab, &last_slab, frames);
+	if (freed < frames) freed += releaseEmptySlabs(&span_slab_start, &span_slab_end, frames - freed);
+	return freed;
+}
+
 /**
  * @brief Initializes the kernel allocator. Creates a 2, 4, 8, and 4096 cache.
  */
@@ -174,6 +241,8 @@ void initKernelAllocator() {
 	createSpanList();
 	printf("\t%u Byte Header Initialized.\n", sizeof(allocated_span_t));
 
+	Memory::RegisterShrinker("slab", countEmptySlabs, shrinkSlabs);
+
 	set_to_last();
 }
 
@@ -195,6 +264,7 @@ void setChunkUsed(slab_header_t* header, size_t chunk) {
 	uint8_t index = chunk % 8;
 	if (chunk % 8 == 0) index = 8;
 
+	if (!GET_BIT(BITLIST_BASE(header)[bitlist_spot], index)) header->used_chunks++;
 	SET_BIT(BITLIST_BASE(header)[bitlist_spot], index);
 }
 
@@ -211,6 +281,7 @@ void setChunkFree(slab_header_t* header, size_t chunk) {
 	uint8_t index = chunk % 8;
 	if (chunk % 8 == 0) index = 8;
 
+	if (GET_BIT(BITLIST_BASE(header)[bitlist_spot], index)) header->used_chunks--;
 	CLEAR_BIT(BITLIST_BASE(header)[bitlist_spot], index);
 }
 
@@ -295,8 +366,23 @@ void removeSpan(allocated_span_t* span) {
 	setChunkFree(header, chunk);
 }
 
+/**
+ * @brief Gives an empty slab's page back to the virtual memory manager.
+ * The first slab of every size is kept around, so freeing the last object of a size doesn't make the next kalloc create a new slab.
+ *
+ * @param header The slab.
+ * @param prev The slab before it in the list.
+ */
+void releaseSlab(slab_header_t* header, slab_header_t* prev) {
+	prev->next_slab = header->next_slab;
+	if (last_slab == header) last_slab = prev;
+	// The frame only goes back to the physical allocator after the next tlb flush.
+	Memory::FreeKernelPage((uintptr_t) header);
+}
+
 void kfree(void* ptr) {
 	slab_header_t* header = first_slab;
+	slab_header_t* prev = NULL;
 	while (header != NULL) {
 		// If the addr is after the starting addr of the header and before the end address it's in that slab
 		if ((uintptr_t) ptr > (uintptr_t) header && (uintptr_t) ptr < (uintptr_t) header + PAGE_2MB_SIZE) {
@@ -316,8 +402,18 @@ void kfree(void* ptr) {
 				memset(ptr, 0, header->object_size);
 				setChunkFree(header, chunk);
 			}
+			if (header->used_chunks == 0) {
+				// Only release it if there's an earlier slab of the same size.
+				for (slab_header_t* s = first_slab; s != header; s = s->next_slab) {
+					if (s->object_size == header->object_size) {
+						releaseSlab(header, prev);
+						break;
+					}
+				}
+			}
 			return;
 		}
+		prev = header;
 		header = header->next_slab;
 	}
 }
@@ -331,11 +427,13 @@ void* kalloc(size_t bytes) {
 
 	slab_header_t* header = first_slab;
 	size_t chunk_number = 0;
+	bool full = false;
 	while (header != NULL) {
 		if (header->object_size != object_size) {
 			header = header->next_slab;
 			continue;
 		}
+		full = true;
 
 		size_t consective_chunks = 0;
 		chunk_number = 0;
@@ -367,7 +465,7 @@ void* kalloc(size_t bytes) {
 
 finish:
 	if (header == NULL) {
-		initSlab(object_size);
+		initSlab(object_size, full);
 		return kalloc(bytes);
 	} else {
 		//printf("chunk #: %llu\n", (chunk_number - 1));
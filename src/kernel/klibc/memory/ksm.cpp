@@ -0,0 +1,147 @@
+#include <memory/ksm.hpp>
+#include <memory/rb_tree.hpp>
+#include <memory/virtual_mem.hpp>
+#include <memory/physical_mem.hpp>
+#include <memory/vmalloc.hpp>
+#include <klibc/idle.h>
+#include <timing.h>
+
+/* Every page that was stable this pass gets a node, in a tree sorted by checksum.
+ * The next stable page with the same checksum is compared against it and merged into it.
+ * The tree is thrown away at the start of every pass, so nodes for pages that have been freed or copied don't stick around.
+ */
+typedef struct {
+	rb_node node;
+	uint64_t checksum;
+	uintptr_t virt;         // A page that maps the frame
+	uintptr_t phys;
+} ksm_node;
+
+ksm_node ksm_nodes[KSM_MAX_NODES];
+size_t ksm_node_count = 0;
+rb_tree ksm_tree = RB_TREE_INIT;
+
+uintptr_t scan_cursor = VMALLOC_BASE;
+size_t pass_started = 0;
+bool pass_running = false;
+ksm_stats ksm_counters;
+
+/**
+ * @brief FNV-1a over the frame, 8 bytes at a time. It only has to tell pages apart, they get compared in full before being merged.
+ */
+static uint64_t checksumFrame(uintptr_t phys) {
+	const uint64_t* data = (const uint64_t*) PHYS_TO_VIRT(phys);
+	uint64_t hash = 0xCBF29CE484222325ULL;
+	for (size_t i = 0; i < PAGE_2MB_SIZE / sizeof(uint64_t); i++) {
+		hash = (hash ^ data[i]) * 0x100000001B3ULL;
+	}
+	return hash;
+}
+
+static bool framesEqual(uintptr_t a, uintptr_t b) {
+	const uint64_t* first = (const uint64_t*) PHYS_TO_VIRT(a);
+	const uint64_t* second = (const uint64_t*) PHYS_TO_VIRT(b);
+	for (size_t i = 0; i < PAGE_2MB_SIZE / sizeof(uint64_t); i++) {
+		if (first[i] != second[i]) return false;
+	}
+	return true;
+}
+
+/**
+ * @brief Finds the node with a checksum, or adds one for the page if there isn't one yet.
+ *
+ * @return ksm_node* The node that was already there, NULL if the page got added (or there was no space for it).
+ */
+static ksm_node* findOrInsert(uint64_t checksum, uintptr_t virt, uintptr_t phys) {
+	rb_node** link = &ksm_tree.root;
+	rb_node* parent = NULL;
+	while (*link != NULL) {
+		parent = *link;
+		ksm_node* node = RB_ENTRY(parent, ksm_node, node);
+		if (checksum == node->checksum) return node;
+		link = checksum < node->checksum ? &parent->left : &parent->right;
+	}
+	if (ksm_node_count >= KSM_MAX_NODES) return NULL;
+
+	ksm_node* node = &ksm_nodes[ksm_node_count++];
+	node->checksum = checksum;
+	node->virt = virt;
+	node->phys = phys;
+	rbLink(&node->node, parent, link);
+	rbInsertColor(&ksm_tree, &node->node);
+	return NULL;
+}
+
+/**
+ * @brief Registers the scanner as an idle task. Nothing gets scanned until something is marked with SetMergeable.
+ */
+void Memory::InitKSM() {
+	registerIdleTask(Memory::ScanMergeable);
+}
+
+/**
+ * @brief Scans a single mergeable page, merging it if it's stable and matches a page seen earlier in the pass.
+ * A new pass starts at most every KSM_PASS_INTERVAL ms.
+ *
+ * @return true If a page was scanned.
+ * @return false If the current pass is done and it isn't time for the next one yet.
+ */
+bool Memory::ScanMergeable() {
+	if (!pass_running) {
+		if (ksm_counters.passes > 0 && get_system_up_time() - pass_started < KSM_PASS_INTERVAL) return false;
+		pass_running = true;
+		pass_started = get_system_up_time();
+		scan_cursor = VMALLOC_BASE;
+		ksm_tree.root = NULL;
+		ksm_node_count = 0;
+	}
+
+	uintptr_t phys;
+	uintptr_t virt = Memory::NextMergeablePage(scan_cursor, VMALLOC_BASE + VMALLOC_SIZE, &phys);
+	if (virt == 0) {
+		pass_running = false;
+		ksm_counters.passes++;
+		return false;
+	}
+	scan_cursor = virt + PAGE_2MB_SIZE;
+	ksm_counters.scanned++;
+
+	uint64_t checksum = checksumFrame(phys);
+	page_frame* frame = Memory::GetFrameDescriptor(phys);
+	// Shared frames are read-only and can't change, everything else has to look the same as it did last pass.
+	if (frame->refcount == 0 && frame->checksum != (uint16_t) checksum) {
+		frame->checksum = (uint16_t) checksum;
+		ksm_counters.changed++;
+		return true;
+	}
+
+	ksm_node* match = findOrInsert(checksum, virt, phys);
+	if (match == NULL || match->phys == phys) return true;
+	// Neither page can change from here on, the first write to either of them faults.
+	if (Memory::VirtToPhysBase(match->virt) != match->phys || !Memory::ProtectMergeable(match->virt)) {
+		// The page that was remembered has been freed or copied since, this one takes its place.
+		match->virt = virt;
+		match->phys = phys;
+		return true;
+	}
+	if (!Memory::ProtectMergeable(virt)) return true;
+	if (!framesEqual(phys, match->phys)) {
+		ksm_counters.mismatched++;
+		return true;
+	}
+	Memory::MergePage(virt, match->phys);
+	return true;
+}
+
+/**
+ * @brief Copies the same-page merging counters.
+ *
+ * @param snapshot Where to put the counters.
+ */
+void Memory::Info::getKSMStats(ksm_stats* snapshot) {
+	cow_stats cow;
+	Memory::Info::getCOWStats(&cow);
+	*snapshot = ksm_counters;
+	snapshot->merged = cow.merged;
+	snapshot->reclaimed = cow.merged > cow.unmerged ? cow.merged - cow.unmerged : 0;
+}
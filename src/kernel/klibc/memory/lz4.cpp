@@ -0,0 +1,167 @@
+#include <memory/lz4.hpp>
+
+// Positions of the last 4 byte sequence with each hash, relative to the start of the input.
+uint32_t lz4_table[1 << LZ4_HASH_BITS];
+
+static inline uint32_t __attribute__((target("no-sse"))) read32(const uint8_t* ptr) {
+	uint32_t value;
+	__builtin_memcpy(&value, ptr, sizeof(value));
+	return value;
+}
+
+static inline uint32_t __attribute__((target("no-sse"))) hash32(uint32_t sequence) {
+	return (sequence * 2654435761U) >> (32 - LZ4_HASH_BITS);
+}
+
+static inline void __attribute__((target("no-sse"))) copyBytes(uint8_t* dst, const uint8_t* src, size_t count) {
+	asm volatile("rep movsb" : "+D"(dst), "+S"(src), "+c"(count) :: "memory");
+}
+
+/**
+ * @brief Writes the rest of a length that didn't fit in the token, as a run of 255s and whatever is left.
+ */
+static inline uint8_t* __attribute__((target("no-sse"))) writeLength(uint8_t* op, size_t length) {
+	while (length >= 255) {
+		*op++ = 255;
+		length -= 255;
+	}
+	*op++ = (uint8_t) length;
+	return op;
+}
+
+/**
+ * @brief Compresses a buffer into an LZ4 block.
+ *
+ * @param src Data to compress.
+ * @param size Size of the data.
+ * @param dst Where to put the compressed block.
+ * @param capacity Size of dst. The compression gives up once the block won't fit.
+ * @return size_t Size of the block, 0 if it didn't fit in capacity.
+ */
+size_t __attribute__((target("no-sse"))) Memory::LZ4Compress(const uint8_t* src, size_t size, uint8_t* dst, size_t capacity) {
+	const uint8_t* ip = src;
+	const uint8_t* anchor = src;
+	const uint8_t* end = src + size;
+	uint8_t* op = dst;
+	uint8_t* op_end = dst + capacity;
+
+	if (size >= LZ4_MATCH_LIMIT + 1) {
+		for (size_t i = 0; i < (1 << LZ4_HASH_BITS); i++) lz4_table[i] = 0;
+		const uint8_t* match_limit = end - LZ4_MATCH_LIMIT;
+		const uint8_t* copy_limit = end - LZ4_LAST_LITERALS;
+		size_t misses = 0;
+
+		while (ip < match_limit) {
+			uint32_t sequence = read32(ip);
+			uint32_t hash = hash32(sequence);
+			const uint8_t* ref = src + lz4_table[hash];
+			lz4_table[hash] = (uint32_t) (ip - src);
+			if (ref >= ip || ip - ref > LZ4_MAX_OFFSET || read32(ref) != sequence) {
+				// Incompressible data speeds up the longer it goes without a match.
+				ip += 1 + (misses++ >> 6);
+				continue;
+			}
+			misses = 0;
+
+			const uint8_t* match_end = ip + LZ4_MIN_MATCH;
+			ref += LZ4_MIN_MATCH;
+			while (match_end < copy_limit && *match_end == *ref) {
+				match_end++;
+				ref++;
+			}
+
+			size_t literals = ip - anchor;
+			size_t match = match_end - ip - LZ4_MIN_MATCH;
+			// Worst case for this sequence: token, literal length, literals, offset, match length.
+			if ((size_t) (op_end - op) < 1 + (literals / 255 + 1) + literals + 2 + (match / 255 + 1)) return 0;
+
+			uint8_t* token = op++;
+			*token = (uint8_t) ((literals >= 15 ? 15 : literals) << 4);
+			if (literals >= 15) op = writeLength(op, literals - 15);
+			copyBytes(op, anchor, literals);
+			op += literals;
+
+			uint16_t offset = (uint16_t) (match_end - ref);
+			*op++ = offset & 0xFF;
+			*op++ = offset >> 8;
+
+			*token |= (uint8_t) (match >= 15 ? 15 : match);
+			if (match >= 15) op = writeLength(op, match - 15);
+
+			ip = match_end;
+			anchor = ip;
+		}
+	}
+
+	// Whatever's left goes out as literals, in a sequence without a match.
+	size_t literals = end - anchor;
+	if ((size_t) (op_end - op) < 1 + (literals / 255 + 1) + literals) return 0;
+	uint8_t* token = op++;
+	*token = (uint8_t) ((literals >= 15 ? 15 : literals) << 4);
+	if (literals >= 15) op = writeLength(op, literals - 15);
+	copyBytes(op, anchor, literals);
+	op += literals;
+	return op - dst;
+}
+
+/**
+ * @brief Decompresses an LZ4 block.
+ *
+ * @param src The compressed block.
+ * @param size Size of the block.
+ * @param dst Where to put the data.
+ * @param capacity Size of dst.
+ * @return size_t Amount of bytes decompressed, 0 if the block is corrupt or doesn't fit in capacity.
+ */
+size_t __attribute__((target("no-sse"))) Memory::LZ4Decompress(const uint8_t* src, size_t size, uint8_t* dst, size_t capacity) {
+	const uint8_t* ip = src;
+	const uint8_t* ip_end = src + size;
+	uint8_t* op = dst;
+	uint8_t* op_end = dst + capacity;
+
+	while (ip < ip_end) {
+		uint8_t token = *ip++;
+		size_t literals = token >> 4;
+		if (literals == 15) {
+			uint8_t byte;
+			do {
+				if (ip >= ip_end) return 0;
+				byte = *ip++;
+				literals += byte;
+			} while (byte == 255);
+		}
+		if ((size_t) (ip_end - ip) < literals || (size_t) (op_end - op) < literals) return 0;
+		copyBytes(op, ip, literals);
+		ip += literals;
+		op += literals;
+		// The last sequence is only literals.
+		if (ip == ip_end) break;
+
+		if (ip_end - ip < 2) return 0;
+		size_t offset = ip[0] | (ip[1] << 8);
+		ip += 2;
+		if (offset == 0 || offset > (size_t) (op - dst)) return 0;
+
+		size_t match = token & 15;
+		if (match == 15) {
+			uint8_t byte;
+			do {
+				if (ip >= ip_end) return 0;
+				byte = *ip++;
+				match += byte;
+			} while (byte == 255);
+		}
+		match += LZ4_MIN_MATCH;
+		if ((size_t) (op_end - op) < match) return 0;
+
+		const uint8_t* ref = op - offset;
+		if (offset >= match) {
+			copyBytes(op, ref, match);
+			op += match;
+		} else {
+			// The match overlaps what it's writing (a repeating pattern), so it has to go a byte at a time.
+			for (size_t i = 0; i < match; i++) *op++ = *ref++;
+		}
+	}
+	return op - dst;
+}
@@ -0,0 +1,183 @@
+#include <memory/page_fault.hpp>
+#include <memory/virtual_mem.hpp>
+#include <memory/physical_mem.hpp>
+#include <memory/swap.hpp>
+#include <memory/vmalloc.hpp>
+
+// Sorted by start address, and never overlapping.
+demand_region demand_regions[MAX_DEMAND_REGIONS];
+size_t demand_region_count = 0;
+fault_stats fault_counters;
+uintptr_t demand_scratch = 0;
+
+/**
+ * @brief Finds the region containing an address.
+ *
+ * @return demand_region* The region, NULL if no region has the address.
+ */
+static demand_region* findDemandRegion(uintptr_t addr) {
+	size_t low = 0;
+	size_t high = demand_region_count;
+	while (low < high) {
+		size_t mid = (low + high) / 2;
+		if (addr < demand_regions[mid].start) {
+			high = mid;
+		} else if (addr >= demand_regions[mid].end) {
+			low = mid + 1;
+		} else {
+			return &demand_regions[mid];
+		}
+	}
+	return NULL;
+}
+
+/**
+ * @brief Reserves a range of virtual memory to be backed on demand. Nothing gets mapped until it's touched.
+ *
+ * @param start Start of the range, 4KB aligned.
+ * @param size Size of the range, rounded up to 4KB.
+ * @param flags Page flags for the frames mapped into the range (BIT_WRITE, BIT_USR, BIT_GLOBAL, etc.).
+ * @param name Name of the region, shown by meminfo. Has to stay around as long as the region does.
+ * @return true If the region was added.
+ * @return false If the range isn't aligned, overlaps another region, or there's no space for another region.
+ */
+bool Memory::RegisterDemandRegion(uintptr_t start, size_t size, uint64_t flags, const char* name) {
+	uintptr_t end = start + ((size + PAGE_4KB_SIZE - 1) & ~(PAGE_4KB_SIZE - 1ULL));
+	if (start & (PAGE_4KB_SIZE - 1) || size == 0 || end < start) return false;
+	if (demand_region_count >= MAX_DEMAND_REGIONS) return false;
+
+	size_t i = 0;
+	while (i < demand_region_count && demand_regions[i].start < start) i++;
+	if (i > 0 && demand_regions[i - 1].end > start) return false;
+	if (i < demand_region_count && demand_regions[i].start < end) return false;
+
+	for (size_t j = demand_region_count; j > i; j--) {
+		demand_regions[j] = demand_regions[j - 1];
+	}
+	demand_regions[i].start = start;
+	demand_regions[i].end = end;
+	demand_regions[i].flags = flags;
+	demand_regions[i].name = name;
+	demand_regions[i].faults = 0;
+	demand_region_count++;
+	return true;
+}
+
+/**
+ * @brief Reserves kernel address space that's backed on demand, and registers it as a demand region.
+ *
+ * @param size Size of the range, rounded up to 4KB.
+ * @param flags Page flags for the frames mapped into the range.
+ * @param name Name of the region, shown by meminfo. Has to stay around as long as the region does.
+ * @return uintptr_t Start of the range, 0 if there's no address space or no space for another region.
+ */
+uintptr_t Memory::ReserveDemandRange(size_t size, uint64_t flags, const char* name) {
+	uintptr_t start = Memory::AllocKernelRange(size);
+	if (start == 0) return 0;
+	if (!Memory::RegisterDemandRegion(start, size, flags, name)) {
+		Memory::FreeKernelRange(start);
+		return 0;
+	}
+	return start;
+}
+
+/**
+ * @brief Reserves the kernel scratch range (DEMAND_SCRATCH_SIZE). It costs nothing until it's written to.
+ */
+void Memory::InitDemandPaging() {
+	demand_scratch = Memory::ReserveDemandRange(DEMAND_SCRATCH_SIZE, BIT_GLOBAL | BIT_WRITE, "kernel scratch");
+}
+
+/**
+ * @brief Gets the kernel scratch range.
+ *
+ * @return uintptr_t Start of the range (DEMAND_SCRATCH_SIZE bytes long), 0 if it couldn't be reserved.
+ */
+uintptr_t Memory::GetDemandScratch() {
+	return demand_scratch;
+}
+
+/**
+ * @brief Tries to fix a page fault, by breaking a copy-on-write page, bringing a page back from swap,
+ * or by mapping a zeroed frame if the address is in a demand region.
+ *
+ * @param addr The faulting address (cr2).
+ * @param error_code The error code pushed by the cpu, see the PF_* bits.
+ * @return true If the fault was fixed and the access can be retried.
+ * @return false If the fault is a real error.
+ */
+bool Memory::HandlePageFault(uintptr_t addr, uint64_t error_code) {
+	fault_counters.faults++;
+	// Writes to copy-on-write pages show up as protection violations.
+	if ((error_code & (PF_PRESENT | PF_WRITE)) == (PF_PRESENT | PF_WRITE) && Memory::BreakCOW(addr, error_code & PF_USER)) {
+		fault_counters.cow++;
+		return true;
+	}
+	// Something's mapped there already, so we're not the ones who should be fixing it.
+	if (error_code & (PF_PRESENT | PF_RESERVED)) {
+		fault_counters.unhandled++;
+		return false;
+	}
+	if (Memory::SwapIn(addr, error_code & PF_USER)) {
+		fault_counters.swap++;
+		return true;
+	}
+
+	demand_region* region = findDemandRegion(addr);
+	if (region == NULL
+		|| ((error_code & PF_USER) && !(region->flags & BIT_USR))
+		|| ((error_code & PF_WRITE) && !(region->flags & BIT_WRITE))) {
+		fault_counters.unhandled++;
+		return false;
+	}
+
+	uintptr_t frame = Memory::PhysicalAllocPage(addr);
+	if (!frame) {
+		fault_counters.unhandled++;
+		return false;
+	}
+	// Zero it through the physmap before it's visible at the faulting address.
+	// rep stosq instead of memset, we're inside the fault handler and it doesn't save the sse registers.
+	uint64_t* page = (uint64_t*) PHYS_TO_VIRT(frame);
+	size_t count = PAGE_4KB_SIZE / sizeof(uint64_t);
+	asm volatile("rep stosq" : "+D"(page), "+c"(count) : "a"(0ULL) : "memory");
+
+	Memory::Map(addr & ~(PAGE_4KB_SIZE - 1ULL), frame, PAGE_4KB_SIZE, region->flags);
+	region->faults++;
+	fault_counters.demand++;
+	return true;
+}
+
+/**
+ * @brief Called by the page fault handler in idt_main.c.
+ */
+extern "C" bool handlePageFault(uint64_t addr, uint64_t error_code) {
+	return Memory::HandlePageFault(addr, error_code);
+}
+
+size_t Memory::Info::getDemandRegionCount() {
+	return demand_region_count;
+}
+
+/**
+ * @brief Copies a demand region.
+ *
+ * @param index Index of the region, between 0 and getDemandRegionCount().
+ * @param snapshot Where to copy the region to.
+ * @return true If the region exists.
+ * @return false If the index is out of range.
+ */
+bool Memory::Info::getDemandRegion(size_t index, demand_region* snapshot) {
+	if (index >= demand_region_count) return false;
+	*snapshot = demand_regions[index];
+	return true;
+}
+
+/**
+ * @brief Copies the page fault counters.
+ *
+ * @param snapshot Where to put the counters.
+ */
+void Memory::Info::getFaultStats(fault_stats* snapshot) {
+	*snapshot = fault_counters;
+}
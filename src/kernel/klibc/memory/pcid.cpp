@@ -0,0 +1,154 @@
+#include <memory/pcid.hpp>
+#include <memory/tlb.hpp>
+#include <klibc/features.hpp>
+
+#define PCID_WORDS (PCID_COUNT / 64)
+
+uint64_t pcid_bitmap[PCID_WORDS] = { 1 }; // PCID 0 is the kernel's, it's never handed out
+uint64_t pcid_generation = 1;
+size_t pcid_hint = 0;                   // Word to start searching from
+pcid_context* current_context = NULL;   // NULL when the kernel's own tables are loaded
+bool kernel_pcid_stale = false;         // PCID 0 has to be flushed the next time it's loaded
+pcid_stats pcid_counters;
+
+static inline void writeCR3(uint64_t cr3) {
+	asm volatile("mov %0, %%cr3" :: "r"(cr3) : "memory");
+}
+
+/**
+ * @brief Gives an address space a PCID from the current generation.
+ * If they're all taken, a new generation starts and every address space has to get a new one.
+ * This never flushes anything itself, a PCID always gets flushed the first time it's loaded (see SwitchAddressSpace).
+ *
+ * @param context The address space.
+ */
+static void assignPCID(pcid_context* context) {
+	for (size_t tries = 0; tries < 2; tries++) {
+		for (size_t n = 0; n < PCID_WORDS; n++) {
+			size_t word = (pcid_hint + n) % PCID_WORDS;
+			if (pcid_bitmap[word] == ~0ULL) continue;
+			size_t bit = __builtin_ctzll(~pcid_bitmap[word]);
+			pcid_bitmap[word] |= 1ULL << bit;
+			pcid_hint = word;
+			context->pcid = (word * 64) + bit;
+			context->generation = pcid_generation;
+			pcid_counters.assigned++;
+			return;
+		}
+		// Every PCID is taken. Start over, the old owners find out when their generation doesn't match.
+		pcid_generation++;
+		for (size_t i = 0; i < PCID_WORDS; i++) pcid_bitmap[i] = 0;
+		pcid_bitmap[0] = 1;
+		pcid_hint = 0;
+		pcid_counters.rollovers++;
+	}
+}
+
+/**
+ * @brief Checks if an address space has a PCID in the current generation.
+ */
+static inline bool hasPCID(pcid_context* context) {
+	return context->generation == pcid_generation;
+}
+
+/**
+ * @brief Loads an address space.
+ * If it still has its PCID, the tlb entries it left behind last time are kept (CR3_NOFLUSH).
+ * Otherwise it gets a new PCID, which is flushed as it's loaded, since the PCID may have belonged to someone else before.
+ *
+ * @param context The address space's PCID state. NULL for the kernel's own page tables, which always use PCID 0.
+ * @param pml4_phys Physical address of the address space's pml4.
+ */
+void Memory::SwitchAddressSpace(pcid_context* context, uintptr_t pml4_phys) {
+	pcid_counters.switches++;
+	if (!Features::getPCID()) {
+		current_context = context;
+		writeCR3(pml4_phys);
+		return;
+	}
+
+	uint64_t cr3 = pml4_phys;
+	if (context == NULL && kernel_pcid_stale) {
+		cr3 |= PCID_KERNEL;
+		kernel_pcid_stale = false;
+	} else if (context == NULL) {
+		cr3 |= PCID_KERNEL | CR3_NOFLUSH;
+		pcid_counters.noflush++;
+	} else if (hasPCID(context)) {
+		cr3 |= context->pcid | CR3_NOFLUSH;
+		pcid_counters.noflush++;
+	} else {
+		assignPCID(context);
+		cr3 |= context->pcid;
+	}
+	current_context = context;
+	writeCR3(cr3);
+}
+
+/**
+ * @brief Invalidates one page in an address space, which doesn't have to be the one that's loaded.
+ * Without invpcid, an address space that isn't loaded just loses its PCID, so it starts over with a clean one.
+ * The kernel's PCID gets flushed the next time it's loaded instead.
+ *
+ * @param context The address space. NULL for the kernel's own page tables.
+ * @param virt Virtual address in the page.
+ */
+void Memory::InvalidatePCIDPage(pcid_context* context, uintptr_t virt) {
+	if (context == current_context) {
+		Memory::FlushTLBPage(virt);
+		return;
+	}
+	// Without PCIDs nothing is kept across switches, and an old PCID gets flushed before it's used again.
+	if (!Features::getPCID() || (context != NULL && !hasPCID(context))) return;
+
+	if (Features::getINVPCID()) {
+		Memory::InvPCID(INVPCID_ADDRESS, context == NULL ? PCID_KERNEL : context->pcid, virt);
+		pcid_counters.invpcids++;
+	} else if (context == NULL) {
+		kernel_pcid_stale = true;
+	} else {
+		context->generation = 0;
+	}
+}
+
+/**
+ * @brief Invalidates every non-global tlb entry of an address space.
+ *
+ * @param context The address space. NULL for the kernel's own page tables.
+ */
+void Memory::InvalidatePCID(pcid_context* context) {
+	if (!Features::getPCID()) {
+		if (context == current_context) {
+			uint64_t cr3;
+			asm volatile("mov %%cr3, %0" : "=r"(cr3));
+			writeCR3(cr3);
+		}
+		return;
+	}
+	if (context != NULL && !hasPCID(context)) return;
+
+	uint16_t pcid = context == NULL ? PCID_KERNEL : context->pcid;
+	if (Features::getINVPCID()) {
+		Memory::InvPCID(INVPCID_CONTEXT, pcid, 0);
+		pcid_counters.invpcids++;
+	} else if (context == current_context) {
+		// Reloading cr3 without CR3_NOFLUSH flushes the current PCID.
+		uint64_t cr3;
+		asm volatile("mov %%cr3, %0" : "=r"(cr3));
+		writeCR3(cr3 & ~CR3_NOFLUSH);
+	} else if (context == NULL) {
+		// The kernel keeps PCID 0 forever, so it can't just be given a new one.
+		kernel_pcid_stale = true;
+	} else {
+		context->generation = 0;
+	}
+}
+
+/**
+ * @brief Copies the PCID counters.
+ *
+ * @param snapshot Where to put the counters.
+ */
+void Memory::Info::getPCIDStats(pcid_stats* snapshot) {
+	*snapshot = pcid_counters;
+}
@@ -1,33 +1,99 @@
 #include <memory/physical_mem.hpp>
 #include <memory/virtual_mem.hpp>
+#include <memory/range_set.hpp>
 #include <stdlib.h>
 #include <string.h>
 #include <panic.h>
 #include <stdio.h>
 #include <klibc/kprint.h>
 #include <klibc/logger.h>
+#include <klibc/idle.h>
+#include <klibc/features.hpp>
+#include <memory/shrinker.hpp>
 #include <idt.h>
 #include <assert.h>
 
 mmap_info mem_info;
 
-typedef struct Block {
-	uintptr_t pointer;
-	bool free;
-	Block* next_block;
-} __attribute__((packed)) Block;
+/* Physical memory is managed by a binary buddy allocator, running over every usable region of the memory map.
+ * A block of order `n` is 2^n contiguous 4KB frames, always aligned to its own size in physical memory.
+ * Order 0 is a 4KB frame, order 9 is a 2MB page, and order 18 is a 1GB page.
+ *
+ * Each region keeps a free list per order. Free lists are stored as bitmaps, one bit per block of that order,
+ * where a set bit means the block is free. This keeps all the metadata at ~2 bits per 4KB frame,
+ * and means we never have to touch the free memory itself (it isn't mapped anywhere).
+ * Bitmaps are scanned a full uint64_t at a time. Counting the trailing zeros of a word (tzcnt)
+ * gives the first free block in that word, meaning we skip 64 blocks with a single comparison.
+ *
+ * Every region also has an array of frame descriptors (page_frame), one for each 2MB frame.
+ * These are what the rest of the kernel uses to attach state to physical memory (reference counts, etc.).
+ *
+ * Allocating splits the smallest free block that fits, handing the upper halves back to the lower orders.
+ * Freeing checks if the buddy (the other half of the parent block) is free, and if it is merges them.
+ * This repeats until the buddy isn't free, or we hit the max order.
+ *
+ * Building all of that for every region at boot means touching ~68KB of metadata per GB of RAM, which adds up fast on big machines.
+ * Instead, regions are initialized in 1GB chunks (aligned to the max order, so a block and its buddy never end up in different chunks).
+ * Boot only initializes enough chunks to get the kernel going (BOOT_INIT_SIZE), everything above a region's init_end is "deferred".
+ * Deferred chunks get initialized when the kernel is idle, or right away if an allocation can't be satisfied without them.
+ *
+ * Regions are split on the zone boundaries (16MB and 4GB), so every region belongs to exactly one zone.
+ * Since regions are sorted, each zone is just a run of consecutive regions, with its own counters and allocation cursor.
+ * Allocations start at the highest zone they can use. Falling back into a lower zone isn't allowed to take it below its watermark,
+ * so the scarce low memory is still there when a driver that actually needs it asks.
+ */
+#define MAX_REGIONS 64
+#define BITS_PER_WORD 64
+#define ORDER_COUNT (PHYS_MAX_ORDER + 1)
 
-Block* block_list = NULL;
-Block* last_block = NULL;
-Block* last_block_start = NULL;
+typedef struct {
+	uintptr_t base;                     // Physical address of the first frame in the region (4KB aligned)
+	uintptr_t end;                      // Physical address of the first byte after the region
+	uintptr_t init_end;                 // Everything in [base, init_end) has been given to the free lists
+	size_t free_blocks[ORDER_COUNT];    // Amount of set bits in each free list
+	size_t hint[ORDER_COUNT];           // Word in each free list to start searching from
+	uint64_t* free_list[ORDER_COUNT];
+	page_frame* frames;                 // One descriptor per 2MB frame, indexed by blockIndex(region, pfn, PHYS_ORDER_2MB)
+	uint8_t zone;
+	phys_counters counters;
+} phys_region;
 
-#define MAX_RESERVED 50
 typedef struct {
-	uintptr_t addr;
-	size_t size;
-} region;
-region reservedMemory[MAX_RESERVED];
-size_t reservedChunks = 0;
+	size_t first_region;                // Index of the zone's first region in regions[]
+	size_t region_count;
+	size_t last_region;                 // Region (relative to first_region) we last allocated from
+	size_t watermark;                   // Free frames allocations falling back from a higher zone have to leave alone
+	phys_counters counters;
+} phys_zone;
+
+phys_region regions[MAX_REGIONS];
+size_t region_count = 0;
+
+phys_zone zones[ZONE_COUNT];
+
+// Totals across every region. Updated alongside each region's (and zone's) own counters.
+phys_counters counters;
+
+// Allocations that leave less than low_watermark frames free wake up background reclaim, which keeps going until it's back over high_watermark.
+size_t low_watermark = 0;
+size_t high_watermark = 0;
+
+// Amount of page colors (a power of 2), and the order of the smallest block that has all of them. See PhysicalAllocColored.
+size_t page_colors = 1;
+uint8_t color_order = 0;
+bool page_coloring = false;
+color_stats color_counters;
+
+// Virtual address where the next bitmap will be placed. Bitmaps start directly after the kernel.
+uintptr_t metadata_end = 0;
+
+// Reserved memory comes from the memory map, the kernel itself, and anything passed to Memory::reserveMemory.
+// The usable set is just the available entries of the memory map, regions get built from usable - reserved.
+#define MAX_RANGES 256
+phys_range reserved_ranges[MAX_RANGES];
+range_set reserved = RANGE_SET_INIT(reserved_ranges);
+phys_range usable_ranges[MAX_RANGES];
+range_set usable = RANGE_SET_INIT(usable_ranges);
 
 uintptr_t phys_kernel_end = 0;
 
@@ -39,113 +105,296 @@ uintptr_t Memory::Info::getPhysKernelEnd() {
 	return phys_kernel_end;
 }
 
-size_t Memory::Info::getFreePageCount() {
-	size_t free_phys_pages = 0;
-	Block* current = block_list;
-	while (current != NULL) {
-		if (current->free) free_phys_pages++;
-		current = current->next_block;
+// ------------------------------------------------------------------------------------------------
+// Bitmap helpers
+// ------------------------------------------------------------------------------------------------
+static inline size_t bitmapWords(size_t bits) {
+	return (bits + BITS_PER_WORD - 1) / BITS_PER_WORD;
+}
+
+static inline void bitmapSet(uint64_t* bitmap, size_t bit) {
+	bitmap[bit / BITS_PER_WORD] |= (1ULL << (bit % BITS_PER_WORD));
+}
+
+static inline void bitmapClear(uint64_t* bitmap, size_t bit) {
+	bitmap[bit / BITS_PER_WORD] &= ~(1ULL << (bit % BITS_PER_WORD));
+}
+
+static inline bool bitmapTest(uint64_t* bitmap, size_t bit) {
+	return bitmap[bit / BITS_PER_WORD] & (1ULL << (bit % BITS_PER_WORD));
+}
+
+// ------------------------------------------------------------------------------------------------
+// Buddy helpers
+// ------------------------------------------------------------------------------------------------
+// Block indexes are relative to the region base rounded down to the max order.
+// This means every order's bitmap lines up on the same 1GB boundaries, and a block's index is just (pfn >> order) - offset.
+static inline uintptr_t regionAlignedPFN(phys_region* region) {
+	return (region->base / PAGE_4KB_SIZE) & ~((1ULL << PHYS_MAX_ORDER) - 1);
+}
+
+static inline size_t blockIndex(phys_region* region, uintptr_t pfn, uint8_t order) {
+	return (pfn >> order) - (regionAlignedPFN(region) >> order);
+}
+
+static inline size_t blocksInOrder(phys_region* region, uint8_t order) {
+	return (((region->end / PAGE_4KB_SIZE) - 1) >> order) - (regionAlignedPFN(region) >> order) + 1;
+}
+
+// Descriptors are aligned to a cache line, so no descriptor ever straddles two lines.
+#define CACHE_LINE 64
+
+// Deferred initialization works in chunks of the largest block size.
+#define INIT_CHUNK_SIZE (PAGE_4KB_SIZE << PHYS_MAX_ORDER)
+// Amount of memory initialized at boot. The kernel heap and page tables only need a few MB to get to the terminal.
+#define BOOT_INIT_SIZE (64ULL * 1024 * 1024)
+// Orders with at least one full bitmap word per chunk. Every chunk owns its words in these, so they can be zeroed chunk by chunk.
+// The higher orders share words between chunks, but they're tiny (less than a word per GB), so we just zero them at boot.
+#define LAZY_MAX_ORDER (PHYS_MAX_ORDER - 6)
+
+static inline size_t regionMetadataSize(phys_region* region) {
+	size_t size = 0;
+	for (uint8_t order = 0; order <= PHYS_MAX_ORDER; order++) {
+		size += bitmapWords(blocksInOrder(region, order)) * sizeof(uint64_t);
 	}
-	return free_phys_pages;
+	size += CACHE_LINE; // Worst case padding to get the descriptors onto a cache line
+	size += blocksInOrder(region, PHYS_ORDER_2MB) * sizeof(page_frame);
+	return size;
 }
 
-size_t Memory::Info::getUsedPageCount() {
-	size_t used_phys_pages = 0;
-	Block* current = block_list;
-	while (current != NULL) {
-		if (!(current->free)) used_phys_pages++;
-		current = current->next_block;
-	}
-	return used_phys_pages;
-}
-
-/**
- * @brief This is some voodoo magic. It's also poorly commented. GLHF :)
- *
- * @param start_address Start address of the chunk of memory
- * @param length Length of the chunk of memory
- * @param type Type of memory chunk, as defined by the MultiBoot2 Memory Map Tag
- */
-void map_chunk(uintptr_t start_address, size_t length, uint32_t type) {
-	if (type != MULTIBOOT_MEMORY_AVAILABLE) return;
-	if (start_address < 0x100000) return;
-	if (start_address <= phys_kernel_end) {
-		// We have to make sure that we can map the physical memory behind the kernel.
-		if (start_address + length < phys_kernel_end) return;
-		length = length - (phys_kernel_end - start_address);
-		start_address = phys_kernel_end;
-	}
-
-	// check if the memory region just so happens to contain reserved memory
-	uintptr_t end_addr = start_address + length;
-	for (size_t i = 0; i < reservedChunks; i++) {
-		uintptr_t start_reserved = reservedMemory[i].addr;
-		uintptr_t end_reserved = reservedMemory[i].addr + reservedMemory[i].size;
-
-		if (start_reserved > start_address && start_reserved < end_addr) {
-			// split the chunk into start_address -> start_reserved then end_reserved -> end_addr
-			// First chunk
-			size_t len = start_reserved - start_address;
-			map_chunk(start_address, len, MULTIBOOT_MEMORY_AVAILABLE);
-			if (end_reserved > end_addr) {
-				Memory::reserveMemory(end_addr, end_reserved - end_addr);
-				break;
-			}
-			// second chunk
-			len = end_addr - end_reserved;
-			map_chunk(end_reserved, len, MULTIBOOT_MEMORY_AVAILABLE);
+// Whether or not the entire block is inside the initialized part of the region. Blocks on the edges of a region can hang off the end.
+static inline bool blockInRegion(phys_region* region, uintptr_t pfn, uint8_t order) {
+	uintptr_t start = pfn * PAGE_4KB_SIZE;
+	uintptr_t end = start + (PAGE_4KB_SIZE << order);
+	return start >= region->base && end <= region->init_end;
+}
+
+static inline void pushBlock(phys_region* region, uintptr_t pfn, uint8_t order) {
+	size_t index = blockIndex(region, pfn, order);
+	bitmapSet(region->free_list[order], index);
+	region->free_blocks[order]++;
+	// Make sure the next search can't skip over this block.
+	if (index / BITS_PER_WORD < region->hint[order]) region->hint[order] = index / BITS_PER_WORD;
+}
+
+static inline void removeBlock(phys_region* region, uintptr_t pfn, uint8_t order) {
+	bitmapClear(region->free_list[order], blockIndex(region, pfn, order));
+	region->free_blocks[order]--;
+}
+
+/**
+ * @brief Pops the first free block of an order off of a region's free list.
+ * GCC turns __builtin_ctzll into tzcnt (or bsf on older cpus), so this never loops over individual bits.
+ *
+ * @param region Region to search. Must have at least one free block of the requested order.
+ * @param order Order of the block.
+ * @return uintptr_t PFN of the block.
+ */
+uintptr_t popBlock(phys_region* region, uint8_t order) {
+	uint64_t* list = region->free_list[order];
+	// Only the words for [base, init_end) hold anything, the rest of the bitmap hasn't even been cleared yet.
+	size_t words = (blockIndex(region, (region->init_end / PAGE_4KB_SIZE) - 1, order) / BITS_PER_WORD) + 1;
+	for (size_t i = 0; i < words; i++) {
+		size_t word = (region->hint[order] + i) % words;
+		if (list[word] == 0) continue; // No free blocks in this word
+		region->hint[order] = word;
+
+		size_t index = (word * BITS_PER_WORD) + __builtin_ctzll(list[word]);
+		uintptr_t pfn = (regionAlignedPFN(region) >> order) + index;
+		pfn <<= order;
+		removeBlock(region, pfn, order);
+		return pfn;
+	}
+	// The free count said there was something here. If we get here the bookkeeping is broken.
+	panic_s("Physical allocator free list is corrupted.");
+	return 0;
+}
+
+/**
+ * @brief Gives every frame in [start, end) to the buddy allocator, using the largest aligned blocks possible.
+ *
+ * @param region Region that contains the range.
+ * @param start Physical address of the start of the range (4KB aligned).
+ * @param end Physical address of the end of the range (4KB aligned).
+ */
+void freeRange(phys_region* region, uintptr_t start, uintptr_t end) {
+	uintptr_t pfn = start / PAGE_4KB_SIZE;
+	uintptr_t end_pfn = end / PAGE_4KB_SIZE;
+	while (pfn < end_pfn) {
+		uint8_t order = PHYS_MAX_ORDER;
+		// Shrink the block until it's both aligned and fits in what's left of the range.
+		while (order > 0 && ((pfn & ((1ULL << order) - 1)) || pfn + (1ULL << order) > end_pfn)) {
+			order--;
 		}
+		pushBlock(region, pfn, order);
+		pfn += (1ULL << order);
 	}
+}
+
+/**
+ * @brief Finds the region that contains a physical address.
+ * Regions are kept sorted by base address, so this is a binary search over (at most) MAX_REGIONS entries.
+ *
+ * @param phys_addr Physical address to search for.
+ * @return phys_region* Region containing the address, NULL if the address isn't tracked by the allocator.
+ */
+phys_region* findRegion(uintptr_t phys_addr) {
+	size_t low = 0;
+	size_t high = region_count;
+	while (low < high) {
+		size_t mid = (low + high) / 2;
+		phys_region* region = &regions[mid];
+		if (phys_addr < region->base) {
+			high = mid;
+		} else if (phys_addr >= region->end) {
+			low = mid + 1;
+		} else {
+			return region;
+		}
+	}
+	return NULL;
+}
+
+/**
+ * @brief Get the amount of free 4KB frames.
+ *
+ * @return size_t Amount of free frames.
+ */
+size_t Memory::Info::getFreePageCount() {
+	return counters.free_frames;
+}
+
+/**
+ * @brief Get the amount of used 4KB frames.
+ *
+ * @return size_t Amount of used frames.
+ */
+size_t Memory::Info::getUsedPageCount() {
+	return counters.total_frames - counters.free_frames;
+}
 
-	// We want the start address to be on a 2MB boundary.
-	uintptr_t old_start_addr = start_address;
-	uintptr_t new_start_address = (start_address + 0x1FFFFF) & ~0x1FFFFF; // Round up & clear the lower 21 bits 
-	length = length - (new_start_address - old_start_addr); // Adjust length to start at the new boundary
+/**
+ * @brief Copies the allocator wide counters. This never touches the free lists, so it's cheap enough to poll constantly.
+ *
+ * @param snapshot Where to copy the counters to.
+ */
+void Memory::Info::getCounters(phys_counters* snapshot) {
+	*snapshot = counters;
+}
 
-	printf("\tMemory Chunk: 0x%llx -> 0x%llx bytes\n", new_start_address, length);
-	size_t max_pages = length / PAGE_2MB_SIZE;
+/**
+ * @brief Get the amount of memory map regions managed by the allocator.
+ *
+ * @return size_t Amount of regions.
+ */
+size_t Memory::Info::getRegionCount() {
+	return region_count;
+}
 
-	// Calculate the size of the linked list, then see how many pages it takes up
-	size_t size = (sizeof(Block) * max_pages);
-	size_t pages_taken = (size / PAGE_2MB_SIZE) + 1;
+/**
+ * @brief Gets a range of usable memory from the memory map. Unlike regions, these include memory that's been reserved (like the kernel).
+ *
+ * @param index Index of the range, starting at 0.
+ * @param start Set to the physical address of the start of the range.
+ * @param end Set to the physical address of the end of the range.
+ * @return true If the range exists.
+ * @return false If the index is out of range.
+ */
+bool Memory::Info::getUsableRange(size_t index, uintptr_t* start, uintptr_t* end) {
+	if (index >= usable.count) return false;
+	*start = usable.ranges[index].start;
+	*end = usable.ranges[index].end;
+	return true;
+}
 
-	Block* first_block;
-	// Write all the blocks in the chunk
-	if (last_block == NULL) {
-		last_block = (Block*) ((uint64_t) (&kernel_end));
-		first_block = (Block*) (last_block);
-	} else {
-		first_block = (Block*) (last_block);
-		last_block_start->next_block = first_block;
-	}
-	// We have to round up the start address to the nearest 2mb boundary
-	first_block->next_block = NULL;
-	first_block->pointer = new_start_address + (PAGE_2MB_SIZE * pages_taken);
-	first_block->free = true;
-	last_block = first_block + sizeof(Block);
-	if (block_list == NULL)
-		block_list = first_block;
-
-	// This will map the entire next 2mb block of memory. This avoids a page fault.
-	// The page fault handler will handle page faults correctly *after* we initialize the physical allocator.
-	// Unfortunately until then we have to be a little bit messy. 
-	if (((uintptr_t) last_block) + sizeof(Block) >= (Memory::GetMappingEnd() + KERNEL_VIRTUAL_BASE)) Memory::MapPreAllocMem(((uintptr_t) last_block) + sizeof(Block));
-
-	Block* last = first_block;
-	// We've already allocated block 0
-	for (size_t i = 1; i <= max_pages - 1; i++) {
-		Block* current_block = (Block*) (last_block);
-		last->next_block = current_block;
-		current_block->next_block = NULL;
-		current_block->pointer = last->pointer + PAGE_2MB_SIZE;
-		current_block->free = true;
-		last_block_start = current_block;
-		last_block = current_block + sizeof(Block);
-		last = current_block;
-		if (((uintptr_t) last_block) + sizeof(Block) >= (Memory::GetMappingEnd() + KERNEL_VIRTUAL_BASE)) { Memory::MapPreAllocMem(((uintptr_t) last_block) + sizeof(Block)); }
-	}
-
-	printf("\t\tTotal Blocks: %llu -> Last Addr: 0x%llx\n", max_pages, new_start_address + (max_pages * PAGE_2MB_SIZE));
+/**
+ * @brief Copies the counters of a single region.
+ *
+ * @param region Index of the region, between 0 and getRegionCount().
+ * @param base Set to the physical address of the start of the region. Can be NULL.
+ * @param end Set to the physical address of the end of the region. Can be NULL.
+ * @param snapshot Where to copy the counters to.
+ * @return true If the region exists.
+ * @return false If the index is out of range.
+ */
+bool Memory::Info::getRegionCounters(size_t region, uintptr_t* base, uintptr_t* end, phys_counters* snapshot) {
+	if (region >= region_count) return false;
+	if (base != NULL) *base = regions[region].base;
+	if (end != NULL) *end = regions[region].end;
+	*snapshot = regions[region].counters;
+	return true;
+}
+
+/**
+ * @brief Copies the counters of a zone.
+ *
+ * @param zone ZONE_DMA, ZONE_DMA32, or ZONE_NORMAL.
+ * @param watermark Set to the amount of free frames fallback allocations have to leave in the zone. Can be NULL.
+ * @param snapshot Where to copy the counters to.
+ * @return true If the zone exists.
+ * @return false If the zone is out of range.
+ */
+bool Memory::Info::getZoneCounters(uint8_t zone, size_t* watermark, phys_counters* snapshot) {
+	if (zone >= ZONE_COUNT) return false;
+	if (watermark != NULL) *watermark = zones[zone].watermark;
+	*snapshot = zones[zone].counters;
+	return true;
+}
+
+/**
+ * @brief Gets the watermarks background reclaim works between (see shrinker.cpp).
+ *
+ * @param low Set to the amount of free frames under which reclaim gets woken up. Can be NULL.
+ * @param high Set to the amount of free frames reclaim tries to get back to. Can be NULL.
+ */
+void Memory::Info::getWatermarks(size_t* low, size_t* high) {
+	if (low != NULL) *low = low_watermark;
+	if (high != NULL) *high = high_watermark;
+}
+
+/**
+ * @brief Makes sure the metadata area is mapped up to (and including) end.
+ * Before the allocator exists the page fault handler can't back anything, so we map the 2MB pages ourselves.
+ *
+ * @param end Virtual address of the last byte that needs to be accessible.
+ */
+void mapMetadata(uintptr_t end) {
+	while (end >= (Memory::GetMappingEnd() + KERNEL_VIRTUAL_BASE)) {
+		Memory::MapPreAllocMem(Memory::GetMappingEnd() + KERNEL_VIRTUAL_BASE);
+	}
+}
+
+/**
+ * @brief Adds a usable range of memory to the end of the region list.
+ * This only records the bounds of the region, the free lists get built once we know how big the metadata is.
+ *
+ * @param start_address Start address of the range.
+ * @param end_address First byte after the range.
+ */
+void addRegion(uintptr_t start_address, uintptr_t end_address) {
+	// Regions can't cross a zone boundary, so split them there.
+	if (start_address < ZONE_DMA_END && end_address > ZONE_DMA_END) {
+		addRegion(start_address, ZONE_DMA_END);
+		addRegion(ZONE_DMA_END, end_address);
+		return;
+	}
+	if (start_address < ZONE_DMA32_END && end_address > ZONE_DMA32_END) {
+		addRegion(start_address, ZONE_DMA32_END);
+		addRegion(ZONE_DMA32_END, end_address);
+		return;
+	}
+
+	// The buddy allocator works on 4KB frames, so we only need the region to start and end on a 4KB boundary.
+	uintptr_t new_start_address = (start_address + 0xFFF) & ~0xFFFULL; // Round up & clear the lower 12 bits
+	uintptr_t new_end_address = end_address & ~0xFFFULL;                // Round down
+	if (new_end_address <= new_start_address) return;
+	if (region_count >= MAX_REGIONS) panic_s("Too many usable memory regions.");
+	printf("\tMemory Chunk: 0x%llx -> 0x%llx bytes\n", new_start_address, new_end_address - new_start_address);
+
+	memset(&regions[region_count], 0, sizeof(phys_region));
+	regions[region_count].base = new_start_address;
+	regions[region_count].end = new_end_address;
+	region_count++;
 }
 
 void fillMMapInfo(struct multiboot_tag_mmap* mmap_tag) {
@@ -171,15 +420,25 @@ const mmap_info* Memory::Info::getMMapInfo() {
 
 /**
  * @brief Reserves an area of memory for system processes. This is to prevent the mmap from (1) overwriting it, and (2) the mmap from pointing to it.
+ * This has to happen before PhysicalMemInit for the allocator to stay out of it. Overlapping reservations get merged.
  *
  * @param base_addr Base address of the section to mark as reserved.
  * @param size Length of the region in bytes.
  */
 void Memory::reserveMemory(uintptr_t base_addr, size_t size) {
-	assert(reservedChunks <= MAX_RESERVED);
-	reservedMemory[reservedChunks].addr = base_addr;
-	reservedMemory[reservedChunks].size = size;
-	reservedChunks++;
+	rangeSetInsert(&reserved, base_addr, base_addr + size);
+}
+
+/**
+ * @brief Checks if any part of an area of memory is reserved, either by the memory map or by reserveMemory.
+ *
+ * @param base_addr Base address of the area.
+ * @param size Length of the area in bytes.
+ * @return true If any of the area is reserved.
+ * @return false If none of it is.
+ */
+bool Memory::isReserved(uintptr_t base_addr, size_t size) {
+	return rangeSetOverlaps(&reserved, base_addr, base_addr + size);
 }
 
 void Memory::PhysicalMemInit() {
@@ -190,31 +449,239 @@ void Memory::PhysicalMemInit() {
 	set_colors(VGA_COLOR_YELLOW, VGA_DEFAULT_BG);
 	printf("Initalizing Physical Memory Allocator:\n");
 	set_to_last();
-	set_colors(VGA_COLOR_BROWN, VGA_DEFAULT_BG);
+	// Everything below the end of the kernel is off limits, along with anything the memory map says isn't available.
+	rangeSetInsert(&reserved, 0, phys_kernel_end);
 	for (mmap = mmap_tag->entries; (size_t) mmap < (size_t) mmap_tag + mmap_tag->size; mmap = (struct multiboot_mmap_entry*) ((size_t) mmap + (size_t) mmap_tag->entry_size)) {
-		map_chunk(mmap->addr, mmap->len, mmap->type);
+		if (mmap->type == MULTIBOOT_MEMORY_AVAILABLE) {
+			rangeSetInsert(&usable, mmap->addr, mmap->addr + mmap->len);
+		} else {
+			rangeSetInsert(&reserved, mmap->addr, mmap->addr + mmap->len);
+		}
 	}
-	set_to_last();
 
-	// We need to get the offset that the memory map has taken up, then mark it as not free.
-	// The first "n" number of blocks represent the memory directly behind the kernel
-	uintptr_t end_of_map = (uintptr_t) last_block - (uintptr_t) (&kernel_end);
-	size_t amount_of_blocks = (end_of_map / PAGE_2MB_SIZE) + 1; // We need to round up a page.
+	// Both sets are sorted, so this comes out sorted too, which is what findRegion needs.
+	phys_range available_ranges[MAX_REGIONS];
+	range_set available = RANGE_SET_INIT(available_ranges);
+	rangeSetSubtract(&usable, &reserved, &available);
+	set_colors(VGA_COLOR_BROWN, VGA_DEFAULT_BG);
+	for (size_t i = 0; i < available.count; i++) {
+		addRegion(available.ranges[i].start, available.ranges[i].end);
+	}
+	set_to_last();
 
+	// The free lists go directly after the kernel. We size them from the regions as they are now,
+	// the first region may shrink once we take the metadata out of it, but that only makes the lists smaller.
+	metadata_end = ((uintptr_t) (&kernel_end) + 7) & ~7ULL;
+	for (size_t i = 0; i < region_count; i++) {
+		metadata_end += regionMetadataSize(&regions[i]);
+	}
+	mapMetadata(metadata_end);
 
-	// Finally, we need to set phys_kernel_end to the new address including the memory map
+	// Finally, we need to set phys_kernel_end to the new address including the free lists.
 	// Setting kernel_end becomes a mess, so I wont even bother. 
 	// Everything after both memory init functions will use this value and add the virtual base as needed.
-	phys_kernel_end = (uintptr_t) last_block - KERNEL_VIRTUAL_BASE;
+	phys_kernel_end = ((metadata_end - KERNEL_VIRTUAL_BASE) + 0xFFF) & ~0xFFFULL;
 
+	// Cut the metadata out of the regions, and lay out where their free lists and descriptors go.
+	uintptr_t metadata = ((uintptr_t) (&kernel_end) + 7) & ~7ULL;
 	size_t index = 0;
-	Block* current = block_list;
-	while (index < amount_of_blocks) {
-		if (current->pointer > phys_kernel_end) break;
-		current->free = false;
-		current = current->next_block;
+	for (size_t i = 0; i < region_count; i++) {
+		phys_region region = regions[i];
+		if (region.end <= phys_kernel_end) continue;
+		if (region.base < phys_kernel_end) region.base = phys_kernel_end;
+
+		// Only the small high order bitmaps get cleared here, the rest is cleared as each chunk gets initialized.
+		for (uint8_t order = 0; order <= PHYS_MAX_ORDER; order++) {
+			size_t size = bitmapWords(blocksInOrder(&region, order)) * sizeof(uint64_t);
+			region.free_list[order] = (uint64_t*) metadata;
+			if (order > LAZY_MAX_ORDER) memset(region.free_list[order], 0, size);
+			metadata += size;
+		}
+
+		metadata = (metadata + CACHE_LINE - 1) & ~(CACHE_LINE - 1ULL);
+		region.frames = (page_frame*) metadata;
+		metadata += blocksInOrder(&region, PHYS_ORDER_2MB) * sizeof(page_frame);
+
+		// Nothing is on the free lists yet, but all of it is free. It just hasn't been initialized.
+		region.init_end = region.base;
+		size_t frames = (region.end - region.base) / PAGE_4KB_SIZE;
+		region.counters.total_frames = frames;
+		region.counters.free_frames = frames;
+		region.counters.deferred_frames = frames;
+		counters.total_frames += frames;
+		counters.free_frames += frames;
+		counters.deferred_frames += frames;
+
+		// Regions are sorted, so the zone's regions all end up next to each other.
+		if (region.base < ZONE_DMA_END) {
+			region.zone = ZONE_DMA;
+		} else if (region.base < ZONE_DMA32_END) {
+			region.zone = ZONE_DMA32;
+		} else {
+			region.zone = ZONE_NORMAL;
+		}
+		phys_zone* zone = &zones[region.zone];
+		if (zone->region_count == 0) zone->first_region = index;
+		zone->region_count++;
+		zone->counters.total_frames += frames;
+		zone->counters.free_frames += frames;
+		zone->counters.deferred_frames += frames;
+
+		regions[index] = region;
 		index++;
 	}
+	region_count = index;
+
+	// Hardly anything needs ISA DMA, but when it does there's no other way to get it. Nothing else gets to fall back into it.
+	// 32 bit devices are a lot more common (and so is having nothing but DMA32), so we only keep a slice of it back.
+	zones[ZONE_DMA].watermark = zones[ZONE_DMA].counters.total_frames;
+	zones[ZONE_DMA32].watermark = zones[ZONE_DMA32].counters.total_frames / 16;
+	low_watermark = counters.total_frames / 32;
+	high_watermark = counters.total_frames / 16;
+
+	// Every way of the cache is (size / ways) bytes, the frames in it are the colors.
+	const cache_info* llc = Features::getLLC();
+	if (llc != NULL && llc->ways > 0) {
+		size_t frames = llc->size / llc->ways / PAGE_4KB_SIZE;
+		while (page_colors * 2 <= frames && page_colors < PHYS_MAX_COLORS) {
+			page_colors *= 2;
+			color_order++;
+		}
+	}
+
+	// Get enough memory ready to boot, the rest can wait.
+	while ((counters.total_frames - counters.deferred_frames) * PAGE_4KB_SIZE < BOOT_INIT_SIZE) {
+		if (!Memory::PhysicalInitDeferred()) break;
+	}
+	registerIdleTask(Memory::PhysicalInitDeferred);
+
+	set_colors(VGA_COLOR_BROWN, VGA_DEFAULT_BG);
+	printf("\tInitialized 0x%llx bytes, deferred 0x%llx bytes\n", (counters.total_frames - counters.deferred_frames) * PAGE_4KB_SIZE, counters.deferred_frames * PAGE_4KB_SIZE);
+	set_to_last();
+}
+
+/**
+ * @brief Initializes the next chunk of a region, clearing its part of the metadata and giving its frames to the free lists.
+ *
+ * @param region Region to initialize.
+ * @return true If a chunk was initialized.
+ * @return false If the region is already fully initialized.
+ */
+bool initChunk(phys_region* region) {
+	if (region->init_end >= region->end) return false;
+	uintptr_t start = region->init_end;
+	uintptr_t end = (start + INIT_CHUNK_SIZE) & ~(INIT_CHUNK_SIZE - 1);
+	if (end > region->end) end = region->end;
+	// Clear from the start of the whole chunk, the first chunk of a region may begin partway through it.
+	uintptr_t start_pfn = (start & ~(INIT_CHUNK_SIZE - 1)) / PAGE_4KB_SIZE;
+	uintptr_t end_pfn = end / PAGE_4KB_SIZE;
+
+	for (uint8_t order = 0; order <= LAZY_MAX_ORDER; order++) {
+		size_t first = blockIndex(region, start_pfn, order) / BITS_PER_WORD;
+		size_t last = blockIndex(region, end_pfn - 1, order) / BITS_PER_WORD;
+		memset(&region->free_list[order][first], 0, (last - first + 1) * sizeof(uint64_t));
+	}
+	size_t first = blockIndex(region, start_pfn, PHYS_ORDER_2MB);
+	size_t last = blockIndex(region, end_pfn - 1, PHYS_ORDER_2MB);
+	memset(&region->frames[first], 0, (last - first + 1) * sizeof(page_frame));
+
+	region->init_end = end;
+	freeRange(region, start, end);
+
+	size_t frames = (end - start) / PAGE_4KB_SIZE;
+	region->counters.deferred_frames -= frames;
+	zones[region->zone].counters.deferred_frames -= frames;
+	counters.deferred_frames -= frames;
+	return true;
+}
+
+/**
+ * @brief Initializes the next deferred chunk in a zone.
+ *
+ * @param zone Zone to initialize.
+ * @return true If a chunk was initialized.
+ * @return false If the whole zone has already been initialized.
+ */
+bool initZoneChunk(phys_zone* zone) {
+	for (size_t i = 0; i < zone->region_count; i++) {
+		if (initChunk(&regions[zone->first_region + i])) return true;
+	}
+	return false;
+}
+
+/**
+ * @brief Initializes one chunk (at most 1GB) of deferred physical memory.
+ * This gets run as an idle task, so memory keeps getting initialized in the background after boot.
+ * The highest zones go first, since that's where most allocations come from.
+ *
+ * @return true If a chunk was initialized.
+ * @return false If all memory has already been initialized.
+ */
+bool Memory::PhysicalInitDeferred() {
+	for (int zone = ZONE_COUNT - 1; zone >= 0; zone--) {
+		if (initZoneChunk(&zones[zone])) return true;
+	}
+	return false;
+}
+
+/**
+ * @brief Updates the descriptors of every 2MB frame a block covers.
+ *
+ * @param region Region containing the block.
+ * @param pfn PFN of the first 4KB frame in the block.
+ * @param order Order of the block.
+ * @param allocated True if the block was just allocated, false if it was just freed.
+ */
+void updateDescriptors(phys_region* region, uintptr_t pfn, uint8_t order, bool allocated) {
+	page_frame* frame = &region->frames[blockIndex(region, pfn, PHYS_ORDER_2MB)];
+	if (order < PHYS_ORDER_2MB) {
+		// Small blocks only ever touch a single frame, we just keep track of how much of it is in use.
+		if (allocated) {
+			frame->small_frames += (1 << order);
+			frame->flags |= FRAME_SPLIT;
+		} else {
+			frame->small_frames -= (1 << order);
+			if (frame->small_frames == 0) frame->flags &= ~FRAME_SPLIT;
+		}
+		return;
+	}
+
+	for (size_t i = 0; i < (1ULL << (order - PHYS_ORDER_2MB)); i++) {
+		if (allocated) {
+			frame[i].flags |= FRAME_ALLOCATED;
+			frame[i].order = order;
+		} else {
+			frame[i].flags &= ~FRAME_ALLOCATED;
+			frame[i].order = 0;
+			frame[i].refcount = 0;
+			frame[i].checksum = 0;
+		}
+	}
+}
+
+// Keeps the region, zone, and allocator wide counters in sync.
+static inline void countAlloc(phys_counters* c, uint8_t order) {
+	c->free_frames -= (1ULL << order);
+	c->allocated_blocks[order]++;
+	c->alloc_count++;
+}
+
+static inline void countAlloc(phys_region* region, uint8_t order) {
+	countAlloc(&region->counters, order);
+	countAlloc(&zones[region->zone].counters, order);
+	countAlloc(&counters, order);
+}
+
+static inline void countFree(phys_counters* c, uint8_t order) {
+	c->free_frames += (1ULL << order);
+	c->allocated_blocks[order]--;
+	c->free_count++;
+}
+
+static inline void countFree(phys_region* region, uint8_t order) {
+	countFree(&region->counters, order);
+	countFree(&zones[region->zone].counters, order);
+	countFree(&counters, order);
 }
 
 // ------------------------------------------------------------------------------------------------
@@ -222,39 +689,545 @@ void Memory::PhysicalMemInit() {
 // The allocator will deal with these 2mb by further dividing it up into 4kb pages if needed,
 // along with dealing with actually mapping it to the virtual address space. 
 // ------------------------------------------------------------------------------------------------
-// We're going to keep a pointer to the last allocated block, which makes allocation O(1) normal case
-// In the case that the user uses all memory, this will likely end up being O(n) normal
-Block* last_allocated_block = NULL;
+// We start searching from the region (and word, see phys_region::hint) that the zone last allocated from.
+// This makes allocation O(1) in the normal case, and only falls back to scanning when a region fills up.
 
 /**
- * @brief Get a 2MB page in physical memory.
+ * @brief Takes a block off of a zone's free lists, splitting a bigger one if needed. Only looks at initialized memory.
  *
- * @return uintptr_t Pointer to the base of the chunk of memory.
- * Check for a 0 return value, this means it couldn't find a chunk of memory.
+ * @param zone Zone to allocate from.
+ * @param order Order of the block.
+ * @return uintptr_t Physical address of the block, 0 if there wasn't a block big enough.
  */
-uintptr_t Memory::PhysicalAlloc2MB() {
-	// First attempt, we check if last_allocated_block.next_block is free
-	if (last_allocated_block != NULL && last_allocated_block->next_block != NULL) {
-		if (last_allocated_block->next_block->free) {
-			last_allocated_block = last_allocated_block->next_block;
-			last_allocated_block->free = false;
-			return (last_allocated_block->pointer);
+uintptr_t allocBlock(phys_zone* zone, uint8_t order) {
+	for (uint8_t current = order; current <= PHYS_MAX_ORDER; current++) {
+		for (size_t i = 0; i < zone->region_count; i++) {
+			size_t index = (zone->last_region + i) % zone->region_count;
+			phys_region* region = &regions[zone->first_region + index];
+			if (region->free_blocks[current] == 0) continue;
+
+			uintptr_t pfn = popBlock(region, current);
+			// Split the block, giving the upper half back each time, until it's the size we want.
+			while (current > order) {
+				current--;
+				pushBlock(region, pfn + (1ULL << current), current);
+			}
+			zone->last_region = index;
+			updateDescriptors(region, pfn, order, true);
+			countAlloc(region, order);
+			return pfn * PAGE_4KB_SIZE;
 		}
 	}
+	return 0;
+}
+
+/**
+ * @brief Wakes up background reclaim once free memory drops under the low watermark.
+ * Reclaim itself can't run from in here, the allocation could be for a page table in the middle of a walk that reclaim would free.
+ */
+static inline void checkWatermark() {
+	if (counters.free_frames < low_watermark) Memory::WakeReclaim();
+}
+
+/**
+ * @brief Allocates from a single zone, initializing more of the zone if it hasn't been yet.
+ *
+ * @param zone Zone to allocate from.
+ * @param order Order of the block.
+ * @return uintptr_t Physical address of the block, 0 if the zone doesn't have a block big enough.
+ */
+uintptr_t allocFromZone(phys_zone* zone, uint8_t order) {
+	while (true) {
+		uintptr_t phys_addr = allocBlock(zone, order);
+		if (phys_addr != 0) return phys_addr;
+		// Nothing big enough has been initialized yet, pull in more memory and try again.
+		if (!initZoneChunk(zone)) return 0;
+	}
+}
+
+/**
+ * @brief Allocate a naturally aligned block of 2^order physically contiguous 4KB frames.
+ * The smallest free block that fits is split down, so larger blocks are only broken up when nothing smaller is left.
+ *
+ * @param order Order of the block. PHYS_ORDER_4KB, PHYS_ORDER_2MB, and PHYS_ORDER_1GB cover the page sizes.
+ * @param max_zone Highest zone the block can come from. ZONE_DMA and ZONE_DMA32 are for devices that can't address all of memory.
+ * @return uintptr_t Physical address of the block. Check for a 0 return value, this means there wasn't a block big enough.
+ */
+uintptr_t Memory::PhysicalAlloc(uint8_t order, uint8_t max_zone) {
+	if (order > PHYS_MAX_ORDER || max_zone >= ZONE_COUNT) {
+		counters.failed_count++;
+		return 0;
+	}
+	// The highest zone that actually has memory is where we'd prefer to get it from. Anything below it is a fallback.
+	int preferred = max_zone;
+	while (preferred > 0 && zones[preferred].region_count == 0) preferred--;
 
-	// We have to go through the entire map otherwise
-	Block* current = block_list;
-	while (current != NULL) {
-		if (current->free) {
-			current->free = false;
-			last_allocated_block = current;
-			return (current->pointer);
+	for (int z = preferred; z >= 0; z--) {
+		phys_zone* zone = &zones[z];
+		if (z != preferred && zone->counters.free_frames < zone->watermark + (1ULL << order)) continue;
+		uintptr_t phys_addr = allocFromZone(zone, order);
+		if (phys_addr != 0) {
+			checkWatermark();
+			return phys_addr;
 		}
-		current = current->next_block;
 	}
+	zones[max_zone].counters.failed_count++;
+	counters.failed_count++;
 	return 0; // GCC complains about returning null, bc we're technically returning an int, not a pointer
 }
 
+/**
+ * @brief Give a block back to the allocator, merging it with its buddy as many times as possible.
+ * Call memset and clear the memory before passing to this function.
+ *
+ * @param phys_addr Base address of the block. This must be the address PhysicalAlloc returned.
+ * @param order Order the block was allocated with.
+ */
+void Memory::PhysicalFree(uintptr_t phys_addr, uint8_t order) {
+	phys_region* region = findRegion(phys_addr);
+	if (region == NULL || order > PHYS_MAX_ORDER) return;
+	if (phys_addr >= region->init_end) return; // Never been handed out
+
+	uintptr_t pfn = phys_addr / PAGE_4KB_SIZE;
+	// If this block, or any block that contains it, is already free this is a double free.
+	for (uint8_t current = order; current <= PHYS_MAX_ORDER; current++) {
+		uintptr_t parent = pfn & ~((1ULL << current) - 1);
+		if (!blockInRegion(region, parent, current)) break;
+		if (bitmapTest(region->free_list[current], blockIndex(region, parent, current))) return;
+	}
+
+	// Large blocks have to be freed with the order they were allocated with, otherwise we'd merge memory that's still in use.
+	if (order >= PHYS_ORDER_2MB) {
+		page_frame* frame = &region->frames[blockIndex(region, pfn, PHYS_ORDER_2MB)];
+		if (!(frame->flags & FRAME_ALLOCATED) || frame->order != order) return;
+	}
+	updateDescriptors(region, pfn, order, false);
+	countFree(region, order);
+
+	while (order < PHYS_MAX_ORDER) {
+		uintptr_t buddy = pfn ^ (1ULL << order);
+		if (!blockInRegion(region, buddy, order)) break;
+		if (!bitmapTest(region->free_list[order], blockIndex(region, buddy, order))) break;
+
+		removeBlock(region, buddy, order);
+		pfn &= ~(1ULL << order); // The merged block starts at whichever half was lower.
+		order++;
+	}
+	pushBlock(region, pfn, order);
+}
+
+// ------------------------------------------------------------------------------------------------
+// Contiguous allocations
+// ------------------------------------------------------------------------------------------------
+// A contiguous allocation takes the smallest buddy block that covers it (or a run of 1GB blocks), and gives the tail back.
+// What's left gets tracked as a set of ordinary blocks: 1GB blocks first, then one block per set bit of the remaining size, biggest first.
+// Since the start is aligned to the biggest block, every one of those blocks is naturally aligned,
+// and freeing just splits the range up the same way and frees each block normally.
+
+/**
+ * @brief Finds the lowest free block of an order that ends at or below limit_pfn. Doesn't take it off the free list.
+ *
+ * @param region Region to search.
+ * @param order Order of the block.
+ * @param limit_pfn First PFN the block isn't allowed to touch.
+ * @return uintptr_t PFN of the block, 0 if there isn't one.
+ */
+uintptr_t findBlockBelow(phys_region* region, uint8_t order, uintptr_t limit_pfn) {
+	uintptr_t end_pfn = region->init_end / PAGE_4KB_SIZE;
+	if (limit_pfn < end_pfn) end_pfn = limit_pfn;
+	if (end_pfn <= region->base / PAGE_4KB_SIZE) return 0;
+
+	uint64_t* list = region->free_list[order];
+	size_t last_word = blockIndex(region, end_pfn - 1, order) / BITS_PER_WORD;
+	for (size_t word = 0; word <= last_word; word++) {
+		if (list[word] == 0) continue;
+		// This is the lowest free block, if it's over the limit then so is everything after it.
+		size_t index = (word * BITS_PER_WORD) + __builtin_ctzll(list[word]);
+		uintptr_t pfn = ((regionAlignedPFN(region) >> order) + index) << order;
+		if (pfn + (1ULL << order) > end_pfn) return 0;
+		return pfn;
+	}
+	return 0;
+}
+
+/**
+ * @brief Marks the first `pages` frames of a block that was just taken off the free lists as allocated, and frees the rest.
+ *
+ * @param region Region containing the block.
+ * @param pfn First PFN of the block.
+ * @param pages Amount of frames to keep.
+ * @param block_pages Size of the block (or run of blocks) in frames.
+ */
+void claimRange(phys_region* region, uintptr_t pfn, size_t pages, size_t block_pages) {
+	uintptr_t current = pfn;
+	size_t left = pages;
+	while (left > 0) {
+		uint8_t order = PHYS_MAX_ORDER;
+		while ((1ULL << order) > left) order--;
+		updateDescriptors(region, current, order, true);
+		countAlloc(region, order);
+		current += (1ULL << order);
+		left -= (1ULL << order);
+	}
+	// Nothing in the tail can have a free buddy, its buddies are either allocated or also in the tail.
+	freeRange(region, (pfn + pages) * PAGE_4KB_SIZE, (pfn + block_pages) * PAGE_4KB_SIZE);
+}
+
+/**
+ * @brief Tries to allocate a contiguous range (of at most 1GB) from one zone.
+ *
+ * @param zone Zone to allocate from.
+ * @param pages Amount of frames.
+ * @param order Order of the block that covers the range, including the alignment.
+ * @param limit_pfn First PFN the range isn't allowed to touch.
+ * @return uintptr_t PFN of the range, 0 if there wasn't space.
+ */
+uintptr_t allocContiguousBlock(phys_zone* zone, size_t pages, uint8_t order, uintptr_t limit_pfn) {
+	for (uint8_t current = order; current <= PHYS_MAX_ORDER; current++) {
+		for (size_t i = 0; i < zone->region_count; i++) {
+			phys_region* region = &regions[zone->first_region + i];
+			if (region->free_blocks[current] == 0) continue;
+
+			// Regions that are entirely under the limit can use the normal (hinted) search.
+			uintptr_t pfn;
+			if (region->end / PAGE_4KB_SIZE <= limit_pfn) {
+				pfn = popBlock(region, current);
+			} else {
+				pfn = findBlockBelow(region, current, limit_pfn);
+				if (pfn == 0) continue;
+				removeBlock(region, pfn, current);
+			}
+			// Keep the lower half each time, which keeps us under the limit.
+			uint8_t split = current;
+			while (split > order) {
+				split--;
+				pushBlock(region, pfn + (1ULL << split), split);
+			}
+			claimRange(region, pfn, pages, 1ULL << order);
+			return pfn;
+		}
+	}
+	return 0;
+}
+
+/**
+ * @brief Tries to allocate a range of more than 1GB from one zone, by finding a run of free 1GB blocks.
+ * There's one bit per GB in the 1GB free lists, so this is a short scan even on huge machines.
+ *
+ * @param zone Zone to allocate from.
+ * @param pages Amount of frames.
+ * @param align_pages Alignment in frames, a power of two.
+ * @param limit_pfn First PFN the range isn't allowed to touch.
+ * @return uintptr_t PFN of the range, 0 if there wasn't a long enough run.
+ */
+uintptr_t allocContiguousRun(phys_zone* zone, size_t pages, size_t align_pages, uintptr_t limit_pfn) {
+	size_t needed = (pages + (1ULL << PHYS_MAX_ORDER) - 1) >> PHYS_MAX_ORDER;
+	for (size_t i = 0; i < zone->region_count; i++) {
+		phys_region* region = &regions[zone->first_region + i];
+		if (region->free_blocks[PHYS_MAX_ORDER] < needed) continue;
+
+		size_t blocks = blocksInOrder(region, PHYS_MAX_ORDER);
+		size_t run = 0;
+		for (size_t index = 0; index < blocks; index++) {
+			uintptr_t pfn = ((regionAlignedPFN(region) >> PHYS_MAX_ORDER) + index) << PHYS_MAX_ORDER;
+			if (pfn + (1ULL << PHYS_MAX_ORDER) > limit_pfn) break;
+			if (!blockInRegion(region, pfn, PHYS_MAX_ORDER) || !bitmapTest(region->free_list[PHYS_MAX_ORDER], index)) {
+				run = 0;
+				continue;
+			}
+			if (run == 0 && (pfn & (align_pages - 1))) continue; // A run has to start on the alignment
+			run++;
+			if (run < needed) continue;
+
+			uintptr_t start = pfn - ((needed - 1) << PHYS_MAX_ORDER);
+			for (size_t j = 0; j < needed; j++) {
+				removeBlock(region, start + (j << PHYS_MAX_ORDER), PHYS_MAX_ORDER);
+			}
+			claimRange(region, start, pages, needed << PHYS_MAX_ORDER);
+			return start;
+		}
+	}
+	return 0;
+}
+
+/**
+ * @brief Allocate physically contiguous memory. Meant for DMA buffers, framebuffers, and big tables.
+ *
+ * @param bytes Size of the allocation. Rounded up to 4KB.
+ * @param alignment Alignment of the physical address, a power of two. Anything below 4KB is treated as 4KB.
+ * @param max_phys_addr Highest physical address any byte of the allocation can be at. 0xFFFFFFFF for a 32 bit device, for example.
+ * @return uintptr_t Physical address of the memory, 0 if there wasn't a big enough range. Free it with PhysicalFreeContiguous.
+ */
+uintptr_t Memory::PhysicalAllocContiguous(size_t bytes, size_t alignment, uintptr_t max_phys_addr) {
+	size_t pages = (bytes + PAGE_4KB_SIZE - 1) / PAGE_4KB_SIZE;
+	if (alignment < PAGE_4KB_SIZE) alignment = PAGE_4KB_SIZE;
+	if (pages == 0 || (alignment & (alignment - 1))) {
+		counters.failed_count++;
+		return 0;
+	}
+	size_t align_pages = alignment / PAGE_4KB_SIZE;
+	// Adding one to the max address could overflow, so round down first.
+	uintptr_t limit_pfn = (max_phys_addr / PAGE_4KB_SIZE) + ((max_phys_addr % PAGE_4KB_SIZE) == PAGE_4KB_SIZE - 1 ? 1 : 0);
+
+	// The covering block has to be big enough for the size and the alignment.
+	uint8_t order = 0;
+	while (order < 63 && ((1ULL << order) < pages || (1ULL << order) < align_pages)) order++;
+
+	// Same zone policy as PhysicalAlloc, start from the highest zone the limit allows.
+	int preferred = ZONE_DMA;
+	if (limit_pfn > ZONE_DMA32_END / PAGE_4KB_SIZE) {
+		preferred = ZONE_NORMAL;
+	} else if (limit_pfn > ZONE_DMA_END / PAGE_4KB_SIZE) {
+		preferred = ZONE_DMA32;
+	}
+	while (preferred > 0 && zones[preferred].region_count == 0) preferred--;
+
+	for (int z = preferred; z >= 0; z--) {
+		phys_zone* zone = &zones[z];
+		if (z != preferred && zone->counters.free_frames < zone->watermark + pages) continue;
+		if (order <= PHYS_MAX_ORDER) {
+			while (true) {
+				uintptr_t pfn = allocContiguousBlock(zone, pages, order, limit_pfn);
+				if (pfn != 0) {
+					checkWatermark();
+					return pfn * PAGE_4KB_SIZE;
+				}
+				if (!initZoneChunk(zone)) break;
+			}
+		} else {
+			// Runs can span chunks, so the whole zone has to be initialized first.
+			while (initZoneChunk(zone));
+			uintptr_t pfn = allocContiguousRun(zone, pages, align_pages, limit_pfn);
+			if (pfn != 0) {
+				checkWatermark();
+				return pfn * PAGE_4KB_SIZE;
+			}
+		}
+	}
+	zones[preferred].counters.failed_count++;
+	counters.failed_count++;
+	return 0;
+}
+
+/**
+ * @brief Free memory from PhysicalAllocContiguous.
+ *
+ * @param phys_addr Address PhysicalAllocContiguous returned.
+ * @param bytes The same size that was passed to PhysicalAllocContiguous.
+ */
+void Memory::PhysicalFreeContiguous(uintptr_t phys_addr, size_t bytes) {
+	size_t left = (bytes + PAGE_4KB_SIZE - 1) / PAGE_4KB_SIZE;
+	while (left > 0) {
+		uint8_t order = PHYS_MAX_ORDER;
+		while ((1ULL << order) > left) order--;
+		Memory::PhysicalFree(phys_addr, order);
+		phys_addr += (PAGE_4KB_SIZE << order);
+		left -= (1ULL << order);
+	}
+}
+
+// ------------------------------------------------------------------------------------------------
+// Page coloring
+// ------------------------------------------------------------------------------------------------
+// The color of a frame is just the low bits of its pfn. A free block of order k covers 2^k colors in a row,
+// so whether it has the color we want only depends on (pfn >> k) modulo (colors >> k).
+// Block indexes start on a 1GB boundary, which keeps that true for the bitmap index too,
+// meaning every block that could have the color sits at a fixed stride in the free list.
+// Blocks of order color_order and up have every color, any of them will do.
+
+// Bitmap words looked at per free list before moving on to the next order. Keeps a fragmented free list from making allocation O(n).
+#define COLOR_SCAN_WORDS 256
+
+/**
+ * @brief Finds a free block that contains a color. Doesn't take it off the free list.
+ *
+ * @param region Region to search. Must have at least one free block of the order.
+ * @param order Order of the block, below color_order.
+ * @param color Color the block has to contain.
+ * @return uintptr_t PFN of the block, 0 if there isn't one (or it wasn't found quickly enough).
+ */
+uintptr_t findColoredBlock(phys_region* region, uint8_t order, size_t color) {
+	size_t stride = page_colors >> order;
+	size_t first = (color >> order) & (stride - 1);
+	// Narrow strides have several candidates per word, wide ones only have a candidate every few words.
+	size_t word_step = 1;
+	uint64_t mask = 0;
+	if (stride >= BITS_PER_WORD) {
+		word_step = stride / BITS_PER_WORD;
+		mask = 1ULL << (first % BITS_PER_WORD);
+	} else {
+		for (size_t bit = first; bit < BITS_PER_WORD; bit += stride) mask |= 1ULL << bit;
+	}
+
+	uint64_t* list = region->free_list[order];
+	size_t words = (blockIndex(region, (region->init_end / PAGE_4KB_SIZE) - 1, order) / BITS_PER_WORD) + 1;
+	size_t offset = (stride >= BITS_PER_WORD) ? first / BITS_PER_WORD : 0;
+	if (offset >= words) return 0;
+	size_t candidates = (words - offset + word_step - 1) / word_step;
+	// Start around the hint like popBlock, that's where the free blocks were last time.
+	size_t start = (region->hint[order] / word_step) % candidates;
+	size_t limit = candidates < COLOR_SCAN_WORDS ? candidates : COLOR_SCAN_WORDS;
+	for (size_t i = 0; i < limit; i++) {
+		size_t word = offset + ((start + i) % candidates) * word_step;
+		uint64_t match = list[word] & mask;
+		if (match == 0) continue;
+		size_t index = (word * BITS_PER_WORD) + __builtin_ctzll(match);
+		return ((regionAlignedPFN(region) >> order) + index) << order;
+	}
+	return 0;
+}
+
+/**
+ * @brief Takes a 4KB frame of one color off of a zone's free lists, splitting the smallest block that has the color.
+ *
+ * @param zone Zone to allocate from.
+ * @param color Color of the frame.
+ * @return uintptr_t Physical address of the frame, 0 if nothing initialized has the color.
+ */
+uintptr_t allocColoredBlock(phys_zone* zone, size_t color) {
+	for (uint8_t current = PHYS_ORDER_4KB; current <= PHYS_MAX_ORDER; current++) {
+		for (size_t i = 0; i < zone->region_count; i++) {
+			size_t index = (zone->last_region + i) % zone->region_count;
+			phys_region* region = &regions[zone->first_region + index];
+			if (region->free_blocks[current] == 0) continue;
+
+			uintptr_t pfn;
+			if (current < color_order) {
+				pfn = findColoredBlock(region, current, color);
+				if (pfn == 0) continue;
+				removeBlock(region, pfn, current);
+			} else {
+				pfn = popBlock(region, current);
+				color_counters.splits++;
+			}
+			// Split it down like allocBlock, except we keep whichever half has the color instead of always the lower one.
+			uintptr_t target = pfn + (color & ((1ULL << current) - 1));
+			while (current > PHYS_ORDER_4KB) {
+				current--;
+				uintptr_t half = 1ULL << current;
+				if ((target - pfn) & half) {
+					pushBlock(region, pfn, current);
+					pfn += half;
+				} else {
+					pushBlock(region, pfn + half, current);
+				}
+			}
+			zone->last_region = index;
+			updateDescriptors(region, pfn, PHYS_ORDER_4KB, true);
+			countAlloc(region, PHYS_ORDER_4KB);
+			return pfn * PAGE_4KB_SIZE;
+		}
+	}
+	return 0;
+}
+
+/**
+ * @brief Turns page coloring on or off. While it's off PhysicalAllocPage hands out frames in address order like PhysicalAlloc.
+ *
+ * @param enabled Whether or not to color pages.
+ * @return true If the mode was changed.
+ * @return false If coloring was asked for, but the cache geometry isn't known (or there's only one color).
+ */
+bool Memory::SetPageColoring(bool enabled) {
+	if (enabled && page_colors < 2) return false;
+	page_coloring = enabled;
+	return true;
+}
+
+bool Memory::GetPageColoring() {
+	return page_coloring;
+}
+
+/**
+ * @brief Gets the color of an address. Works for virtual addresses too, a frame mapped there ideally has the same color.
+ *
+ * @param addr Physical (or virtual) address.
+ * @return size_t Color of the address, always 0 if the cache geometry isn't known.
+ */
+size_t Memory::GetPageColor(uintptr_t addr) {
+	return (addr / PAGE_4KB_SIZE) & (page_colors - 1);
+}
+
+/**
+ * @brief Allocates a 4KB frame with a specific color. Works whether or not page coloring is turned on.
+ * If nothing that's allowed has the color, this falls back to a frame of any color instead of failing.
+ *
+ * @param color Color of the frame, see GetPageColor. Only the bits under the amount of colors are used.
+ * @param max_zone Highest zone the frame can come from.
+ * @return uintptr_t Physical address of the frame, 0 if there's no memory left.
+ */
+uintptr_t Memory::PhysicalAllocColored(size_t color, uint8_t max_zone) {
+	if (page_colors < 2 || max_zone >= ZONE_COUNT) return Memory::PhysicalAlloc(PHYS_ORDER_4KB, max_zone);
+	color &= page_colors - 1;
+
+	int preferred = max_zone;
+	while (preferred > 0 && zones[preferred].region_count == 0) preferred--;
+
+	for (int z = preferred; z >= 0; z--) {
+		phys_zone* zone = &zones[z];
+		if (z != preferred && zone->counters.free_frames < zone->watermark + 1) continue;
+		while (true) {
+			uintptr_t phys_addr = allocColoredBlock(zone, color);
+			if (phys_addr != 0) {
+				color_counters.colored++;
+				checkWatermark();
+				return phys_addr;
+			}
+			if (!initZoneChunk(zone)) break;
+		}
+	}
+	// Every frame that's left has the wrong color, still better than nothing.
+	uintptr_t phys_addr = Memory::PhysicalAlloc(PHYS_ORDER_4KB, max_zone);
+	if (phys_addr != 0) color_counters.fallbacks++;
+	return phys_addr;
+}
+
+/**
+ * @brief Allocates the 4KB frame that's going to be mapped at a virtual address.
+ * With page coloring on the frame gets the same color as the address, so pages that are next to each other virtually
+ * end up in different cache sets, the same as if the memory was physically contiguous.
+ *
+ * @param virt Virtual address the frame is for.
+ * @param max_zone Highest zone the frame can come from.
+ * @return uintptr_t Physical address of the frame, 0 if there's no memory left.
+ */
+uintptr_t Memory::PhysicalAllocPage(uintptr_t virt, uint8_t max_zone) {
+	if (!page_coloring) return Memory::PhysicalAlloc(PHYS_ORDER_4KB, max_zone);
+	return Memory::PhysicalAllocColored(Memory::GetPageColor(virt), max_zone);
+}
+
+/**
+ * @brief Copies the page coloring counters.
+ *
+ * @param snapshot Where to put the counters.
+ */
+void Memory::Info::getColorStats(color_stats* snapshot) {
+	*snapshot = color_counters;
+	snapshot->colors = page_colors;
+}
+
+/**
+ * @brief Get the descriptor of the 2MB frame that contains a physical address.
+ *
+ * @param phys_addr Any physical address inside the frame.
+ * @return page_frame* The descriptor, or NULL if the address isn't managed by the allocator.
+ */
+page_frame* Memory::GetFrameDescriptor(uintptr_t phys_addr) {
+	phys_region* region = findRegion(phys_addr);
+	if (region == NULL || phys_addr >= region->init_end) return NULL;
+	return &region->frames[blockIndex(region, phys_addr / PAGE_4KB_SIZE, PHYS_ORDER_2MB)];
+}
+
+/**
+ * @brief Get a 2MB page in physical memory.
+ *
+ * @return uintptr_t Pointer to the base of the chunk of memory.
+ * Check for a 0 return value, this means it couldn't find a chunk of memory.
+ */
+uintptr_t Memory::PhysicalAlloc2MB() {
+	return Memory::PhysicalAlloc(PHYS_ORDER_2MB);
+}
+
 /**
  * @brief Mark the page starting at phys_addr as free.
  * Call memset and clear the memory before passing to this function.
@@ -263,12 +1236,24 @@ uintptr_t Memory::PhysicalAlloc2MB() {
  * @param phys_addr Base address of the page to be freed.
  */
 void Memory::PhysicalDeAlloc2MB(uintptr_t phys_addr) {
-	Block* current = block_list;
-	while (current != NULL) {
-		if (current->pointer == phys_addr) {
-			current->free = true;
-			return;
-		}
-		current = current->next_block;
-	}
-}
\ No newline at end of file
+	Memory::PhysicalFree(phys_addr, PHYS_ORDER_2MB);
+}
+
+/**
+ * @brief Get a 1GB page in physical memory.
+ *
+ * @return uintptr_t Pointer to the base of the chunk of memory.
+ * Check for a 0 return value, this means it couldn't find a chunk of memory.
+ */
+uintptr_t Memory::PhysicalAlloc1GB() {
+	return Memory::PhysicalAlloc(PHYS_ORDER_1GB);
+}
+
+/**
+ * @brief Mark the 1GB page starting at phys_addr as free.
+ *
+ * @param phys_addr Base address of the page to be freed.
+ */
+void Memory::PhysicalDeAlloc1GB(uintptr_t phys_addr) {
+	Memory::PhysicalFree(phys_addr, PHYS_ORDER_1GB);
+}
@@ -0,0 +1,103 @@
+#include <memory/range_set.hpp>
+#include <panic.h>
+
+/**
+ * @brief Finds the first range that ends after an address.
+ *
+ * @param set Set to search.
+ * @param addr Address to search for.
+ * @return size_t Index of the range, or set->count if every range ends at or before addr.
+ */
+static size_t firstEndingAfter(const range_set* set, uintptr_t addr) {
+	size_t low = 0;
+	size_t high = set->count;
+	while (low < high) {
+		size_t mid = (low + high) / 2;
+		if (set->ranges[mid].end <= addr) {
+			low = mid + 1;
+		} else {
+			high = mid;
+		}
+	}
+	return low;
+}
+
+/**
+ * @brief Adds [start, end) to a set, merging it with any range it overlaps or touches.
+ *
+ * @param set Set to add to.
+ * @param start Start of the range.
+ * @param end First byte after the range.
+ */
+void rangeSetInsert(range_set* set, uintptr_t start, uintptr_t end) {
+	if (end <= start) return;
+	// Ranges that end exactly at start touch the new one, so step back to include them.
+	size_t first = firstEndingAfter(set, start);
+	if (first > 0 && set->ranges[first - 1].end == start) first--;
+
+	// Swallow every range that overlaps (or touches) the new one.
+	size_t last = first;
+	while (last < set->count && set->ranges[last].start <= end) {
+		if (set->ranges[last].start < start) start = set->ranges[last].start;
+		if (set->ranges[last].end > end) end = set->ranges[last].end;
+		last++;
+	}
+
+	size_t removed = last - first;
+	if (removed == 0) {
+		// Nothing to merge with, shift everything after it up by one to make space.
+		if (set->count >= set->capacity) panic_s("Physical range set is full.");
+		for (size_t i = set->count; i > first; i--) {
+			set->ranges[i] = set->ranges[i - 1];
+		}
+		set->count++;
+	} else if (removed > 1) {
+		// The merged range takes the first slot, the rest get closed up.
+		for (size_t i = last; i < set->count; i++) {
+			set->ranges[i - removed + 1] = set->ranges[i];
+		}
+		set->count -= removed - 1;
+	}
+	set->ranges[first].start = start;
+	set->ranges[first].end = end;
+}
+
+/**
+ * @brief Checks if any part of [start, end) is in a set.
+ *
+ * @param set Set to search.
+ * @param start Start of the range.
+ * @param end First byte after the range.
+ * @return true If the range overlaps anything in the set.
+ * @return false If the range is entirely outside the set.
+ */
+bool rangeSetOverlaps(const range_set* set, uintptr_t start, uintptr_t end) {
+	if (end <= start) return false;
+	size_t index = firstEndingAfter(set, start);
+	return index < set->count && set->ranges[index].start < end;
+}
+
+/**
+ * @brief Builds out = set - remove, in a single pass over both sets.
+ * Both sets are sorted, so we walk them side by side, cutting each range of set around whatever it overlaps in remove.
+ *
+ * @param set Ranges to start with.
+ * @param remove Ranges to cut out.
+ * @param out Where to put the result. Must be empty, and can't be either of the other sets.
+ */
+void rangeSetSubtract(const range_set* set, const range_set* remove, range_set* out) {
+	size_t r = 0;
+	for (size_t i = 0; i < set->count; i++) {
+		uintptr_t current = set->ranges[i].start;
+		uintptr_t end = set->ranges[i].end;
+		// Skip the removals that are entirely behind us. These can't affect any later range either.
+		while (r < remove->count && remove->ranges[r].end <= current) r++;
+
+		// A removal can stick out past the end of this range, so don't consume them here.
+		for (size_t k = r; k < remove->count && remove->ranges[k].start < end; k++) {
+			if (remove->ranges[k].start > current) rangeSetInsert(out, current, remove->ranges[k].start);
+			if (remove->ranges[k].end > current) current = remove->ranges[k].end;
+		}
+		if (current < end) rangeSetInsert(out, current, end);
+	}
+}
@@ -0,0 +1,251 @@
+#include <memory/rb_tree.hpp>
+
+/**
+ * @brief Points whatever pointed at old (its parent, or the root) at replacement instead.
+ */
+static void changeChild(rb_tree* tree, rb_node* parent, rb_node* old, rb_node* replacement) {
+	if (parent == NULL) {
+		tree->root = replacement;
+	} else if (parent->left == old) {
+		parent->left = replacement;
+	} else {
+		parent->right = replacement;
+	}
+}
+
+static void rotateLeft(rb_tree* tree, rb_node* node) {
+	rb_node* right = node->right;
+	node->right = right->left;
+	if (right->left != NULL) right->left->parent = node;
+	right->parent = node->parent;
+	changeChild(tree, node->parent, node, right);
+	right->left = node;
+	node->parent = right;
+}
+
+static void rotateRight(rb_tree* tree, rb_node* node) {
+	rb_node* left = node->left;
+	node->left = left->right;
+	if (left->right != NULL) left->right->parent = node;
+	left->parent = node->parent;
+	changeChild(tree, node->parent, node, left);
+	left->right = node;
+	node->parent = left;
+}
+
+static inline bool isRed(const rb_node* node) {
+	return node != NULL && node->red;
+}
+
+/**
+ * @brief Puts a node into the tree at the spot found while searching. The tree still has to be rebalanced with rbInsertColor.
+ *
+ * @param node The new node.
+ * @param parent The last node visited while searching, NULL if the tree is empty.
+ * @param link The child pointer of parent (or the root) that was NULL.
+ */
+void rbLink(rb_node* node, rb_node* parent, rb_node** link) {
+	node->parent = parent;
+	node->left = NULL;
+	node->right = NULL;
+	node->red = true;
+	*link = node;
+}
+
+/**
+ * @brief Rebalances the tree after rbLink.
+ *
+ * @param tree The tree.
+ * @param node The node that was just linked.
+ */
+void rbInsertColor(rb_tree* tree, rb_node* node) {
+	rb_node* parent;
+	while ((parent = node->parent) != NULL && parent->red) {
+		// The root is always black, so a red parent always has a parent of its own.
+		rb_node* grandparent = parent->parent;
+		if (parent == grandparent->left) {
+			rb_node* uncle = grandparent->right;
+			if (isRed(uncle)) {
+				parent->red = false;
+				uncle->red = false;
+				grandparent->red = true;
+				node = grandparent;
+				continue;
+			}
+			if (node == parent->right) {
+				rotateLeft(tree, parent);
+				node = parent;
+				parent = node->parent;
+			}
+			parent->red = false;
+			grandparent->red = true;
+			rotateRight(tree, grandparent);
+		} else {
+			rb_node* uncle = grandparent->left;
+			if (isRed(uncle)) {
+				parent->red = false;
+				uncle->red = false;
+				grandparent->red = true;
+				node = grandparent;
+				continue;
+			}
+			if (node == parent->left) {
+				rotateRight(tree, parent);
+				node = parent;
+				parent = node->parent;
+			}
+			parent->red = false;
+			grandparent->red = true;
+			rotateLeft(tree, grandparent);
+		}
+	}
+	tree->root->red = false;
+}
+
+/**
+ * @brief Fixes the colors after a black node was taken out from between parent and node.
+ */
+static void eraseColor(rb_tree* tree, rb_node* node, rb_node* parent) {
+	while (!isRed(node) && node != tree->root) {
+		if (parent->left == node) {
+			rb_node* sibling = parent->right;
+			if (sibling->red) {
+				sibling->red = false;
+				parent->red = true;
+				rotateLeft(tree, parent);
+				sibling = parent->right;
+			}
+			if (!isRed(sibling->left) && !isRed(sibling->right)) {
+				sibling->red = true;
+				node = parent;
+				parent = node->parent;
+				continue;
+			}
+			if (!isRed(sibling->right)) {
+				sibling->left->red = false;
+				sibling->red = true;
+				rotateRight(tree, sibling);
+				sibling = parent->right;
+			}
+			sibling->red = parent->red;
+			parent->red = false;
+			sibling->right->red = false;
+			rotateLeft(tree, parent);
+			node = tree->root;
+		} else {
+			rb_node* sibling = parent->left;
+			if (sibling->red) {
+				sibling->red = false;
+				parent->red = true;
+				rotateRight(tree, parent);
+				sibling = parent->left;
+			}
+			if (!isRed(sibling->left) && !isRed(sibling->right)) {
+				sibling->red = true;
+				node = parent;
+				parent = node->parent;
+				continue;
+			}
+			if (!isRed(sibling->left)) {
+				sibling->right->red = false;
+				sibling->red = true;
+				rotateLeft(tree, sibling);
+				sibling = parent->left;
+			}
+			sibling->red = parent->red;
+			parent->red = false;
+			sibling->left->red = false;
+			rotateRight(tree, parent);
+			node = tree->root;
+		}
+	}
+	if (node != NULL) node->red = false;
+}
+
+/**
+ * @brief Takes a node out of the tree.
+ *
+ * @param tree The tree.
+ * @param node The node, which has to be in the tree.
+ */
+void rbErase(rb_tree* tree, rb_node* node) {
+	rb_node* child;
+	rb_node* parent;
+	bool red;
+
+	if (node->left != NULL && node->right != NULL) {
+		// Two children. The successor takes the node's place, and the successor's old spot is what actually gets removed.
+		rb_node* old = node;
+		node = node->right;
+		while (node->left != NULL) node = node->left;
+
+		child = node->right;
+		parent = node->parent;
+		red = node->red;
+		if (child != NULL) child->parent = parent;
+		if (parent == old) {
+			parent->right = child;
+			parent = node;
+		} else {
+			parent->left = child;
+		}
+
+		node->parent = old->parent;
+		node->red = old->red;
+		node->left = old->left;
+		node->right = old->right;
+		changeChild(tree, old->parent, old, node);
+		old->left->parent = node;
+		if (old->right != NULL) old->right->parent = node;
+	} else {
+		child = node->left != NULL ? node->left : node->right;
+		parent = node->parent;
+		red = node->red;
+		if (child != NULL) child->parent = parent;
+		changeChild(tree, parent, node, child);
+	}
+
+	if (!red) eraseColor(tree, child, parent);
+}
+
+/**
+ * @brief Gets the leftmost (smallest) node.
+ *
+ * @return rb_node* The node, NULL if the tree is empty.
+ */
+rb_node* rbFirst(const rb_tree* tree) {
+	rb_node* node = tree->root;
+	if (node == NULL) return NULL;
+	while (node->left != NULL) node = node->left;
+	return node;
+}
+
+/**
+ * @brief Gets the next node in order.
+ *
+ * @return rb_node* The next node, NULL if this is the last one.
+ */
+rb_node* rbNext(const rb_node* node) {
+	if (node->right != NULL) {
+		node = node->right;
+		while (node->left != NULL) node = node->left;
+		return (rb_node*) node;
+	}
+	while (node->parent != NULL && node == node->parent->right) node = node->parent;
+	return node->parent;
+}
+
+/**
+ * @brief Gets the previous node in order.
+ *
+ * @return rb_node* The previous node, NULL if this is the first one.
+ */
+rb_node* rbPrev(const rb_node* node) {
+	if (node->left != NULL) {
+		node = node->left;
+		while (node->right != NULL) node = node->right;
+		return (rb_node*) node;
+	}
+	while (node->parent != NULL && node == node->parent->left) node = node->parent;
+	return node->parent;
+}
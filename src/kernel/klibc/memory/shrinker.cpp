@@ -0,0 +1,126 @@
+#include <memory/shrinker.hpp>
+#include <memory/physical_mem.hpp>
+#include <memory/tlb.hpp>
+#include <klibc/idle.h>
+#include <klibc/internal_calls.h>
+
+shrinker shrinkers[MAX_SHRINKERS];
+size_t shrinker_count_total = 0;
+bool reclaim_woken = false;
+reclaim_stats reclaim_counters;
+
+/**
+ * @brief Registers background reclaim as an idle task. It sleeps until the physical allocator wakes it up.
+ */
+void Memory::InitReclaim() {
+	registerIdleTask(Memory::BackgroundReclaim);
+}
+
+/**
+ * @brief Adds a shrinker. Shrinkers are asked in the order they were registered.
+ *
+ * @param name Name shown by memreclaim. Has to stay around forever.
+ * @param count Returns how many frames the shrinker could give back.
+ * @param scan Gives back up to the frames it's passed, and returns how many it did.
+ * @return true If the shrinker was added.
+ * @return false If there's no space for another one.
+ */
+bool Memory::RegisterShrinker(const char* name, shrinker_count count, shrinker_scan scan) {
+	if (shrinker_count_total >= MAX_SHRINKERS || count == NULL || scan == NULL) return false;
+	shrinker* entry = &shrinkers[shrinker_count_total++];
+	entry->name = name;
+	entry->count = count;
+	entry->scan = scan;
+	return true;
+}
+
+/**
+ * @brief Asks the shrinkers for memory until enough of it has been given back.
+ * The tlb queue gets flushed at the end, so the frames are actually free by the time this returns.
+ *
+ * @param frames Amount of 4KB frames to free. SIZE_MAX to take everything the shrinkers have.
+ * @return size_t Amount of frames freed.
+ */
+size_t Memory::ShrinkCaches(size_t frames) {
+	size_t freed = 0;
+	for (size_t i = 0; i < shrinker_count_total && freed < frames; i++) {
+		shrinker* entry = &shrinkers[i];
+		if (entry->count() == 0) continue;
+		uint64_t start = rdtsc();
+		size_t done = entry->scan(frames - freed);
+		entry->last_cycles = rdtsc() - start;
+		entry->last_freed = done;
+		entry->freed += done;
+		entry->runs++;
+		freed += done;
+	}
+	if (freed > 0) Memory::FlushTLBQueue();
+	reclaim_counters.freed += freed;
+	return freed;
+}
+
+/**
+ * @brief Reclaims memory right away, for an allocation that just failed.
+ *
+ * @param frames Amount of 4KB frames needed.
+ * @return size_t Amount of frames freed.
+ */
+size_t Memory::DirectReclaim(size_t frames) {
+	reclaim_counters.direct++;
+	return Memory::ShrinkCaches(frames);
+}
+
+/**
+ * @brief Called by the physical allocator when free memory goes under the low watermark. Reclaim happens the next time the kernel is idle.
+ */
+void Memory::WakeReclaim() {
+	if (reclaim_woken) return;
+	reclaim_woken = true;
+	reclaim_counters.wakeups++;
+}
+
+/**
+ * @brief Frees memory until it's back over the high watermark, or the shrinkers run out. Then goes back to sleep.
+ *
+ * @return true If anything was freed.
+ * @return false If reclaim wasn't woken up, or there was nothing to free.
+ */
+bool Memory::BackgroundReclaim() {
+	if (!reclaim_woken) return false;
+	reclaim_woken = false;
+
+	size_t high;
+	Memory::Info::getWatermarks(NULL, &high);
+	size_t free = Memory::Info::getFreePageCount();
+	if (free >= high) return false;
+
+	reclaim_counters.background++;
+	return Memory::ShrinkCaches(high - free) > 0;
+}
+
+size_t Memory::Info::getShrinkerCount() {
+	return shrinker_count_total;
+}
+
+/**
+ * @brief Copies a shrinker and its counters.
+ *
+ * @param index Index of the shrinker, between 0 and getShrinkerCount().
+ * @param snapshot Where to copy the shrinker to.
+ * @return true If the shrinker exists.
+ * @return false If the index is out of range.
+ */
+bool Memory::Info::getShrinker(size_t index, shrinker* snapshot) {
+	if (index >= shrinker_count_total) return false;
+	*snapshot = shrinkers[index];
+	return true;
+}
+
+/**
+ * @brief Copies the reclaim counters.
+ *
+ * @param snapshot Where to put the counters.
+ */
+void Memory::Info::getReclaimStats(reclaim_stats* snapshot) {
+	*snapshot = reclaim_counters;
+}
@@ -0,0 +1,157 @@
+#include <memory/swap.hpp>
+#include <memory/lz4.hpp>
+#include <memory/physical_mem.hpp>
+#include <memory/vmalloc.hpp>
+#include <panic.h>
+
+typedef struct swap_slot {
+	uintptr_t phys;             // The compressed page, from PhysicalAllocContiguous
+	uint64_t entry;             // The page's entry before it was swapped out, for its flags
+	size_t size;                // Compressed size
+	struct swap_slot* next_free;
+} swap_slot;
+
+swap_slot swap_slots[SWAP_MAX_SLOTS];
+swap_slot* free_slots = NULL;
+/* Pages get compressed in here first. The result can't go straight into the pool,
+ * when memory has run out there's no room for it until the page's own frame is freed.
+ */
+uint8_t* swap_staging = NULL;
+uintptr_t swap_hand = VMALLOC_BASE;
+swap_stats swap_counters;
+
+/**
+ * @brief rep movsb, for the same reason as the codec: swapping can happen inside the page fault handler, which doesn't save the sse registers.
+ */
+static inline void copyBytes(uint8_t* dst, const uint8_t* src, size_t count) {
+	asm volatile("rep movsb" : "+D"(dst), "+S"(src), "+c"(count) :: "memory");
+}
+
+/**
+ * @brief Moves the clock hand to the next cold page, wrapping around at the end of the kernel address space.
+ * The first lap can end up just clearing accessed bits, so three goes is enough to find a cold page if there is one.
+ *
+ * @param phys Set to the frame behind the page.
+ * @return uintptr_t Virtual address of the page, 0 if nothing can be swapped out.
+ */
+static uintptr_t findColdPage(uintptr_t* phys) {
+	for (int i = 0; i < 3; i++) {
+		uintptr_t virt = Memory::NextColdPage(swap_hand, VMALLOC_BASE + VMALLOC_SIZE, phys);
+		if (virt != 0) {
+			swap_hand = virt + PAGE_2MB_SIZE;
+			return virt;
+		}
+		swap_hand = VMALLOC_BASE;
+	}
+	return 0;
+}
+
+static void freeSlot(swap_slot* slot) {
+	Memory::PhysicalFreeContiguous(slot->phys, slot->size);
+	swap_counters.stored--;
+	swap_counters.stored_bytes -= slot->size;
+	slot->phys = 0;
+	slot->next_free = free_slots;
+	free_slots = slot;
+}
+
+/**
+ * @brief Sets up the swap slots and the staging page. Nothing is swapped out before this.
+ */
+void Memory::InitSwap() {
+	for (size_t i = SWAP_MAX_SLOTS; i > 0; i--) {
+		swap_slots[i - 1].next_free = free_slots;
+		free_slots = &swap_slots[i - 1];
+	}
+	swap_staging = (uint8_t*) Memory::NewKernelPage();
+}
+
+/**
+ * @brief Compresses a cold page into swap and frees its frame.
+ * Pages are at most SWAP_MAX_COMPRESSED in swap, so the copy of the next page swapped out can fit in what's left of this one's frame,
+ * and its own frame stays whole.
+ *
+ * @return true If a page was swapped out.
+ * @return false If there's nothing cold that compresses well enough, or swap is full.
+ */
+bool Memory::SwapOutColdPage() {
+	if (swap_staging == NULL) return false;
+	for (int i = 0; i < SWAP_SCAN_TRIES && free_slots != NULL; i++) {
+		uintptr_t phys;
+		uintptr_t virt = findColdPage(&phys);
+		if (virt == 0) return false;
+		swap_slot* slot = free_slots;
+		uint64_t entry = Memory::EvictPage(virt, slot - swap_slots);
+		if (entry == 0) return false;
+
+		// Nothing can write to the page anymore, so it gets compressed straight from the physmap.
+		size_t size = Memory::LZ4Compress((const uint8_t*) PHYS_TO_VIRT(phys), PAGE_2MB_SIZE, swap_staging, SWAP_MAX_COMPRESSED);
+		if (size == 0) {
+			// Not worth it. It goes back marked accessed, so the clock leaves it alone for a lap.
+			Memory::RestorePage(virt, entry | BIT_ACCESS);
+			swap_counters.incompressible++;
+			continue;
+		}
+
+		// EvictPage already flushed the page, so the frame can go back right away and the compressed copy can use it.
+		Memory::PhysicalFree(phys, PHYS_ORDER_2MB);
+		slot->phys = Memory::PhysicalAllocContiguous(size);
+		if (!slot->phys) panic_s("No memory for a swapped out page.");
+		copyBytes((uint8_t*) PHYS_TO_VIRT(slot->phys), swap_staging, size);
+		slot->entry = entry;
+		slot->size = size;
+		free_slots = slot->next_free;
+
+		swap_counters.stored++;
+		swap_counters.stored_bytes += size;
+		swap_counters.swapped_out++;
+		return true;
+	}
+	return false;
+}
+
+/**
+ * @brief Brings a page back from swap. Called by the page fault handler for pages that aren't present.
+ * If there's no free frame for it, other cold pages get swapped out to make room.
+ *
+ * @param addr Any address in the page.
+ * @param user If the access came from ring 3.
+ * @return true If the page is back, and the access can be retried.
+ * @return false If the page isn't in swap, or there's no way to make room for it.
+ */
+bool Memory::SwapIn(uintptr_t addr, bool user) {
+	uint64_t entry = Memory::GetSwapEntry(addr);
+	if (entry == 0 || (user && !(entry & BIT_USR))) return false;
+	swap_slot* slot = &swap_slots[SWAP_SLOT(entry)];
+
+	uintptr_t frame = Memory::PhysicalAlloc(PHYS_ORDER_2MB);
+	while (!frame && Memory::SwapOutColdPage()) frame = Memory::PhysicalAlloc(PHYS_ORDER_2MB);
+	if (!frame) return false;
+
+	size_t size = Memory::LZ4Decompress((const uint8_t*) PHYS_TO_VIRT(slot->phys), slot->size, (uint8_t*) PHYS_TO_VIRT(frame), PAGE_2MB_SIZE);
+	if (size != PAGE_2MB_SIZE) panic_s("Swapped out page is corrupted.");
+	Memory::RestorePage(addr, frame | (slot->entry & (0xFFFULL | BIT_NX)));
+	freeSlot(slot);
+	swap_counters.swapped_in++;
+	return true;
+}
+
+/**
+ * @brief Throws away a page in swap, for when its mapping goes away. Called by Unmap and Map.
+ *
+ * @param slot Slot from the swap entry.
+ */
+void Memory::DropSwapSlot(size_t slot) {
+	if (slot >= SWAP_MAX_SLOTS || swap_slots[slot].phys == 0) return;
+	freeSlot(&swap_slots[slot]);
+	swap_counters.dropped++;
+}
+
+/**
+ * @brief Copies the swap counters.
+ *
+ * @param snapshot Where to put the counters.
+ */
+void Memory::Info::getSwapStats(swap_stats* snapshot) {
+	*snapshot = swap_counters;
+}
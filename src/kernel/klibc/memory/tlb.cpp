@@ -0,0 +1,245 @@
+#include <memory/tlb.hpp>
+#include <memory/physical_mem.hpp>
+#include <klibc/features.hpp>
+#include <klibc/idle.h>
+
+#define CR4_PGE (1ULL << 7)
+
+typedef struct {
+	uintptr_t virt;
+	size_t size;
+	size_t page_size;
+} tlb_range;
+
+tlb_range flush_queue[TLB_BATCH_SIZE];
+size_t queue_count = 0;
+size_t queue_pages = 0;
+bool queue_full_flush = false; // Set once the queue overflows or passes the threshold
+
+typedef struct {
+	deferred_release release;
+	uintptr_t addr;
+	uint64_t arg;
+} tlb_release;
+
+tlb_release release_queue[TLB_DEFERRED_SIZE];
+size_t release_count = 0;
+
+size_t flush_threshold = TLB_DEFAULT_THRESHOLD;
+tlb_stats tlb_counters;
+
+/**
+ * @brief Amount of invlpgs it takes to flush a range. One per page, no matter how big the page is.
+ */
+static size_t rangePages(uintptr_t virt, size_t size, size_t page_size) {
+	uintptr_t start = virt & ~(page_size - 1);
+	uintptr_t end = (virt + size + page_size - 1) & ~(page_size - 1);
+	return (end - start) / page_size;
+}
+
+/**
+ * @brief Invalidates the TLB entry for a single page.
+ *
+ * @param virt Any virtual address inside the page.
+ */
+void Memory::FlushTLBPage(uintptr_t virt) {
+	asm volatile("invlpg (%0)" :: "r"(virt) : "memory");
+	tlb_counters.invlpgs++;
+}
+
+/**
+ * @brief Runs invpcid. Only valid if Features::getINVPCID() is true.
+ *
+ * @param type One of the INVPCID_* types.
+ * @param pcid PCID to invalidate, ignored by the "all" types.
+ * @param virt Address to invalidate, only used by INVPCID_ADDRESS.
+ */
+void Memory::InvPCID(uint8_t type, uint16_t pcid, uintptr_t virt) {
+	struct {
+		uint64_t pcid;
+		uint64_t virt;
+	} __attribute__((aligned(16))) descriptor = { pcid, virt };
+	asm volatile("invpcid %0, %1" :: "m"(descriptor), "r"((uint64_t) type) : "memory");
+}
+
+/**
+ * @brief Invalidates every TLB entry, in every PCID.
+ * Reloading cr3 leaves global pages alone (and only touches the current PCID), and global pages are the kernel pages we're usually flushing for.
+ * invpcid can flush everything in one go, otherwise toggling CR4.PGE throws out everything, global or not.
+ */
+void Memory::FlushTLBAll() {
+	uint64_t cr4;
+	asm volatile("mov %%cr4, %0" : "=r"(cr4));
+	if (Features::getINVPCID()) {
+		Memory::InvPCID(INVPCID_ALL_GLOBAL, 0, 0);
+	} else if (cr4 & CR4_PGE) {
+		asm volatile("mov %0, %%cr4" :: "r"(cr4 & ~CR4_PGE) : "memory");
+		asm volatile("mov %0, %%cr4" :: "r"(cr4) : "memory");
+	} else {
+		uint64_t cr3;
+		asm volatile("mov %%cr3, %0" : "=r"(cr3));
+		asm volatile("mov %0, %%cr3" :: "r"(cr3) : "memory");
+	}
+	tlb_counters.full_flushes++;
+}
+
+/**
+ * @brief Invalidates the TLB entries for a range of virtual memory.
+ * Ranges over the threshold get a full flush instead.
+ *
+ * @param virt Start of the range.
+ * @param size Size of the range in bytes.
+ * @param page_size Size of the pages mapping the range. A single invlpg covers an entire 2MB or 1GB page.
+ */
+void Memory::FlushTLBRange(uintptr_t virt, size_t size, size_t page_size) {
+	if (size == 0) return;
+	size_t pages = rangePages(virt, size, page_size);
+	if (pages > flush_threshold) {
+		Memory::FlushTLBAll();
+		return;
+	}
+	virt &= ~(page_size - 1);
+	for (size_t i = 0; i < pages; i++) {
+		Memory::FlushTLBPage(virt + (i * page_size));
+	}
+	tlb_counters.range_flushes++;
+}
+
+/**
+ * @brief Queues a range to be invalidated by the next FlushTLBQueue.
+ * Useful when unmapping a bunch of things at once, the flush only has to happen before the memory gets reused.
+ *
+ * @param virt Start of the range.
+ * @param size Size of the range in bytes.
+ * @param page_size Size of the pages mapping the range.
+ */
+void Memory::QueueTLBFlush(uintptr_t virt, size_t size, size_t page_size) {
+	if (size == 0) return;
+	tlb_counters.queued++;
+	if (queue_full_flush) return; // Everything's getting thrown out anyways.
+
+	queue_pages += rangePages(virt, size, page_size);
+	if (queue_count >= TLB_BATCH_SIZE || queue_pages > flush_threshold) {
+		queue_full_flush = true;
+		return;
+	}
+	flush_queue[queue_count].virt = virt;
+	flush_queue[queue_count].size = size;
+	flush_queue[queue_count].page_size = page_size;
+	queue_count++;
+}
+
+/**
+ * @brief Makes the next FlushTLBQueue a full flush.
+ * Needed when page tables get freed while other PCIDs might still have them cached, since invlpg only reaches the current PCID.
+ */
+void Memory::QueueTLBFlushAll() {
+	queue_full_flush = true;
+}
+
+/**
+ * @brief Waits to release something until the queued ranges have been flushed.
+ * If the queue is already full, it gets flushed right away to make space.
+ *
+ * @param release Function that does the releasing.
+ * @param addr Passed to release.
+ * @param arg Passed to release.
+ */
+void Memory::QueueDeferredRelease(deferred_release release, uintptr_t addr, uint64_t arg) {
+	if (release_count >= TLB_DEFERRED_SIZE) Memory::FlushTLBQueue();
+	release_queue[release_count].release = release;
+	release_queue[release_count].addr = addr;
+	release_queue[release_count].arg = arg;
+	release_count++;
+}
+
+static void releaseFrame(uintptr_t phys_addr, uint64_t order) {
+	Memory::PhysicalFree(phys_addr, order);
+}
+
+/**
+ * @brief Frees a physical frame once the queued ranges have been flushed.
+ *
+ * @param phys_addr Physical address of the frame.
+ * @param order Order of the frame (see PhysicalFree).
+ */
+void Memory::QueueFrameFree(uintptr_t phys_addr, uint8_t order) {
+	Memory::QueueDeferredRelease(releaseFrame, phys_addr, order);
+}
+
+static inline bool rangesQueued() {
+	return queue_count != 0 || queue_full_flush;
+}
+
+/**
+ * @brief Invalidates the queued ranges, with a single full flush if there's too much of it.
+ */
+static void flushRanges() {
+	if (queue_full_flush) {
+		Memory::FlushTLBAll();
+	} else {
+		for (size_t i = 0; i < queue_count; i++) {
+			Memory::FlushTLBRange(flush_queue[i].virt, flush_queue[i].size, flush_queue[i].page_size);
+		}
+	}
+	tlb_counters.batches++;
+	queue_count = 0;
+	queue_pages = 0;
+	queue_full_flush = false;
+}
+
+/**
+ * @brief Invalidates everything that has been queued, then releases everything that was waiting on the flush.
+ */
+void Memory::FlushTLBQueue() {
+	while (rangesQueued() || release_count > 0) {
+		if (rangesQueued()) flushRanges();
+		// A release can free more things, which can queue more ranges as well as more releases.
+		// Those releases sit on top of the queue, so stop and flush as soon as anything new is queued, or they'd go out before their range does.
+		while (release_count > 0 && !rangesQueued()) {
+			tlb_release entry = release_queue[--release_count];
+			entry.release(entry.addr, entry.arg);
+			tlb_counters.deferred++;
+		}
+	}
+}
+
+/**
+ * @brief Flushes the queue while the kernel is idle, so freed memory doesn't sit around waiting for the queue to fill up.
+ *
+ * @return true If there was anything to flush.
+ */
+static bool flushQueueIdle() {
+	if (queue_count == 0 && !queue_full_flush && release_count == 0) return false;
+	Memory::FlushTLBQueue();
+	return true;
+}
+
+/**
+ * @brief Registers the idle flush.
+ */
+void Memory::InitTLB() {
+	registerIdleTask(flushQueueIdle);
+}
+
+/**
+ * @brief Sets how many pages can be invalidated one by one before a full flush is used instead.
+ *
+ * @param pages The new threshold. 0 makes every flush a full flush.
+ */
+void Memory::SetTLBFlushThreshold(size_t pages) {
+	flush_threshold = pages;
+}
+
+size_t Memory::GetTLBFlushThreshold() {
+	return flush_threshold;
+}
+
+/**
+ * @brief Copies the TLB flush counters.
+ *
+ * @param snapshot Where to put the counters.
+ */
+void Memory::Info::getTLBStats(tlb_stats* snapshot) {
+	*snapshot = tlb_counters;
+}
@@ -83,6 +83,11 @@
 #include <drivers/serial.h>
 #include <memory/virtual_mem.hpp>
 #include <memory/physical_mem.hpp>
+#include <memory/tlb.hpp>
+#include <memory/vmalloc.hpp>
+#include <memory/swap.hpp>
+#include <memory/shrinker.hpp>
+#include <klibc/features.hpp>
 
 /* To start out, we're defining:
  * The top level page (pml4)
@@ -150,6 +155,9 @@ uintptr_t kernel_mapping_end = 0;
  *
  * To start out, we're also not going to map any physical memory to userspace. This will be dealt with later on.
  * We're just going to give the userspace a pde, allowing 2MB pages, and mark it as not present.
+ *
+ * Every kernel page is marked global (BIT_GLOBAL), so its tlb entries stay around when cr3 changes.
+ * The bit is ignored until Features::enableFeatures turns on CR4.PGE, so it's safe to set it this early.
  */
 void Memory::initVirtualMemory() {
 	/* Clear the tables */
@@ -186,7 +194,7 @@ void Memory::initVirtualMemory() {
 	kpde[0] |= BIT_WRITE | BIT_PRESENT;
 	for (int i = 0; i < TABLE_ENTRIES; i++) {
 		set_page_frame(&(kpte[i]), PAGE_4KB_SIZE * i);
-		kpte[i] |= BIT_WRITE | BIT_PRESENT;
+		kpte[i] |= BIT_GLOBAL | BIT_WRITE | BIT_PRESENT;
 	}
 	// The upper 1MB needs to be mapped to the upper kernel address space
 
@@ -195,17 +203,15 @@ void Memory::initVirtualMemory() {
 
 	uint64_t total_size = (uint64_t) (&kernel_end) - KERNEL_VIRTUAL_BASE;
 	// To determine where we need to mark addresses for the page table, we need to figure out how many 2MB pages this takes up.
-	uint64_t total_pages = (total_size + PAGE_2MB_SIZE) / PAGE_2MB_SIZE; // We add the page size to total_size so we can round up a page
+	uint64_t total_pages = (total_size + PAGE_2MB_SIZE - 1) / PAGE_2MB_SIZE;
 
 	// If the kernel takes up more than 2MB of memory, we need to mark those pages.
 	// If it only takes up 1 page, we've already dealt with it above when we mapped kpte.
 	// We want to map the first 2MB page after the kernel for the physical map
-	if (total_pages <= 511) {
-		for (uint64_t i = 1; i <= total_pages; i++) {
-			set_page_frame(&(kpde[i]), PAGE_2MB_SIZE * i);
-			kernel_mapping_end = PAGE_2MB_SIZE * i;
-			kpde[i] |= BIT_SIZE | BIT_WRITE | BIT_PRESENT;
-		}
+	if (total_pages < TABLE_ENTRIES) {
+		// kernel_mapping_end has to cover the static tables before Map can find them.
+		kernel_mapping_end = PAGE_2MB_SIZE * (total_pages + 1);
+		Memory::Map(KERNEL_VIRTUAL_BASE + PAGE_2MB_SIZE, PAGE_2MB_SIZE, kernel_mapping_end - PAGE_2MB_SIZE, BIT_GLOBAL | BIT_WRITE);
 	} else {
 		// We have to determine how many other pte's we need.
 		// For right now, I can't see the kernel needing more than 1GB of memory, at least not at launch.
@@ -222,6 +228,12 @@ void Memory::initVirtualMemory() {
 
 	uint64_t ptr = (uint64_t) pml4 - KERNEL_VIRTUAL_BASE;
 	asm volatile("mov %%rax, %%cr3" ::"a"(ptr));
+
+	// Without CR0.WP the kernel can write to read-only pages, and copy-on-write pages would never fault.
+	uint64_t cr0;
+	asm volatile("mov %%cr0, %0" : "=r"(cr0));
+	cr0 |= 1 << 16;
+	asm volatile("mov %0, %%cr0" :: "r"(cr0) : "memory");
 }
 
 uintptr_t Memory::GetMappingEnd() {
@@ -240,36 +252,456 @@ uintptr_t getFrame(uintptr_t ptr) {
 	return (ptr & ~0xFFF0000000000FFF);
 }
 
+// ------------------------------------------------------------------------------------------------
+// Page tables
+// ------------------------------------------------------------------------------------------------
+/* Page table entries hold physical addresses, but we need a virtual address to read or write a table.
+ * The static tables (and everything else in the kernel binary) are mapped at KERNEL_VIRTUAL_BASE + phys,
+ * and once the physmap exists every other table is at PHYS_TO_VIRT(phys).
+ * Before that (mostly while the physmap itself is being built), new tables come out of 2MB kernel pages split into 512 tables each,
+ * and we remember where each 2MB chunk of tables is mapped so tableVirt can translate them back.
+ */
+#define MAX_TABLE_CHUNKS 64
+#define TABLES_PER_CHUNK (PAGE_2MB_SIZE / PAGE_4KB_SIZE)
+// Refill before we run out. Getting a new chunk can itself need a table (a page directory for an empty kpdp slot).
+#define TABLE_RESERVE 4
+
+typedef struct {
+	uintptr_t virt;
+	uintptr_t phys;
+} table_chunk;
+
+bool physmap_ready = false;
+
+table_chunk table_chunks[MAX_TABLE_CHUNKS];
+// Used when the very first chunk needs a table to be mapped, before there are any chunks at all.
+uint64_t boot_tables[TABLE_RESERVE][TABLE_ENTRIES] __attribute__((aligned(0x1000)));
+size_t boot_tables_used = 0;
+size_t table_chunk_count = 0;
+size_t tables_left = 0;         // Unused tables in the last chunk
+bool refilling_tables = false;
+
+/**
+ * @brief Get the virtual address of a page table from its physical address.
+ *
+ * @param phys Physical address of the table. Page table entries can be passed directly, the flags get removed.
+ * @return uint64_t* Pointer to the table.
+ */
+uint64_t* tableVirt(uintptr_t phys) {
+	phys = getFrame(phys);
+	if (phys < kernel_mapping_end) return (uint64_t*) (phys + KERNEL_VIRTUAL_BASE);
+	if (physmap_ready) return (uint64_t*) PHYS_TO_VIRT(phys);
+	for (size_t i = 0; i < table_chunk_count; i++) {
+		if (phys >= table_chunks[i].phys && phys < table_chunks[i].phys + PAGE_2MB_SIZE) {
+			return (uint64_t*) (table_chunks[i].virt + (phys - table_chunks[i].phys));
+		}
+	}
+	panic_s("Page table is not mapped.");
+	return NULL;
+}
+
+/**
+ * @brief Maps another 2MB chunk of page tables.
+ */
+void refillTables() {
+	if (table_chunk_count >= MAX_TABLE_CHUNKS) panic_s("Out of page table chunks.");
+	refilling_tables = true;
+	uintptr_t virt = Memory::NewKernelPage();
+	table_chunks[table_chunk_count].virt = virt;
+	table_chunks[table_chunk_count].phys = Memory::VirtToPhysBase(virt);
+	table_chunk_count++;
+	tables_left = TABLES_PER_CHUNK;
+	refilling_tables = false;
+}
+
+/**
+ * @brief Allocates an empty page table.
+ *
+ * @return uintptr_t Physical address of the table. Use tableVirt to access it.
+ */
+uintptr_t allocTable() {
+	// Once there's a physmap, any frame can be a table.
+	if (physmap_ready) {
+		uintptr_t phys = Memory::PhysicalAlloc(PHYS_ORDER_4KB);
+		if (!phys) panic_s("Out of physical memory.");
+		memset((void*) PHYS_TO_VIRT(phys), 0, PAGE_4KB_SIZE);
+		return phys;
+	}
+	if (tables_left == 0) {
+		if (refilling_tables) {
+			if (boot_tables_used == TABLE_RESERVE) panic_s("Out of page tables.");
+			uint64_t* table = boot_tables[boot_tables_used++];
+			memset(table, 0, PAGE_4KB_SIZE);
+			return (uintptr_t) table - KERNEL_VIRTUAL_BASE;
+		}
+		refillTables();
+	}
+	table_chunk* chunk = &table_chunks[table_chunk_count - 1];
+	tables_left--;
+	uintptr_t phys = chunk->phys + ((TABLES_PER_CHUNK - tables_left - 1) * PAGE_4KB_SIZE);
+	memset(tableVirt(phys), 0, PAGE_4KB_SIZE);
+	if (tables_left < TABLE_RESERVE && !refilling_tables) {
+		refillTables();
+	}
+	return phys;
+}
+
+/**
+ * @brief Replaces a large page with a table of the next size down, mapping the exact same memory with the same flags.
+ *
+ * @param entry The pdp entry (1GB page) or pde entry (2MB page) to split.
+ * @param page_size Size of the page the entry maps.
+ * @param virt Any virtual address inside the page.
+ */
+void splitPage(uint64_t* entry, size_t page_size, uintptr_t virt) {
+	size_t child_size = page_size / TABLE_ENTRIES;
+	// The PAT bit moves to bit 12 in large pages, so the frame has to be aligned to get rid of it.
+	uintptr_t frame = getFrame(*entry) & ~(page_size - 1);
+	uint64_t flags = (*entry & (0xFFFULL | BIT_NX)) & ~BIT_SIZE;
+	if (child_size != PAGE_4KB_SIZE) flags |= BIT_SIZE;
+
+	uintptr_t table = allocTable();
+	uint64_t* child = tableVirt(table);
+	for (int i = 0; i < TABLE_ENTRIES; i++) {
+		child[i] = (frame + (child_size * i)) | flags;
+	}
+	*entry = table | BIT_WRITE | BIT_PRESENT | (flags & BIT_USR);
+	// The translation didn't change, but the old large page could still be in the tlb.
+	Memory::FlushTLBPage(virt & ~(page_size - 1));
+}
+
+/**
+ * @brief Gets the table an entry points to, creating it (or splitting the large page in it) if needed.
+ *
+ * @param entry Entry in the level above.
+ * @param page_size Size of the memory the entry covers.
+ * @param virt Virtual address being mapped.
+ * @param table_flags BIT_USR if the table is for user memory.
+ * @return uint64_t* Pointer to the table.
+ */
+uint64_t* nextTable(uint64_t* entry, size_t page_size, uintptr_t virt, uint64_t table_flags) {
+	// A page in swap has to come back before part of it can be mapped over. If it can't, its contents are lost either way.
+	if (IS_SWAP_ENTRY(*entry) && !Memory::SwapIn(virt, false)) {
+		Memory::DropSwapSlot(SWAP_SLOT(*entry));
+		*entry = 0;
+	}
+	if (!(*entry & BIT_PRESENT)) {
+		*entry = allocTable() | BIT_WRITE | BIT_PRESENT | table_flags;
+	} else if (*entry & BIT_SIZE) {
+		splitPage(entry, page_size, virt);
+	}
+	// The whole hierarchy needs the user bit for user pages to be accessible.
+	*entry |= table_flags;
+	return tableVirt(*entry);
+}
+
+/**
+ * @brief Finds the entry that maps virt at a certain page size, creating any tables on the way.
+ *
+ * @param virt Virtual address.
+ * @param page_size PAGE_1GB_SIZE for a pdp entry, PAGE_2MB_SIZE for a pde entry, and PAGE_4KB_SIZE for a pte entry.
+ * @param table_flags BIT_USR if the tables are for user memory.
+ * @return uint64_t* Pointer to the entry.
+ */
+uint64_t* getEntry(uintptr_t virt, size_t page_size, uint64_t table_flags) {
+	uint64_t* pdp_t = nextTable(&pml4[GET_PML4_INDEX(virt)], 0, virt, table_flags);
+	if (page_size == PAGE_1GB_SIZE) return &pdp_t[GET_PDPT_INDEX(virt)];
+	uint64_t* pde_t = nextTable(&pdp_t[GET_PDPT_INDEX(virt)], PAGE_1GB_SIZE, virt, table_flags);
+	if (page_size == PAGE_2MB_SIZE) return &pde_t[GET_PAGE_DIR_INDEX(virt)];
+	uint64_t* pte_t = nextTable(&pde_t[GET_PAGE_DIR_INDEX(virt)], PAGE_2MB_SIZE, virt, table_flags);
+	return &pte_t[GET_PAGE_TABLE_INDEX(virt)];
+}
+
+/**
+ * @brief Maps virtual memory to physical memory, using the largest pages that fit.
+ * A 1GB or 2MB page gets used whenever both addresses are aligned to it and there's enough of the range left.
+ * Any large page that's in the way of a smaller mapping gets split up.
+ * Entries that were already present are invalidated right away. Nothing queued by anyone else gets flushed,
+ * so mapping doesn't break up a batch of unmaps, and never runs releases from inside the page fault handler.
+ *
+ * @param virt Virtual address to map. Rounded down to 4KB.
+ * @param phys Physical address to map it to. Must have the same offset into the 4KB page as virt.
+ * @param size Amount of bytes to map. Rounded up to 4KB.
+ * @param flags Page flags (BIT_WRITE, BIT_USR, BIT_NX, BIT_PCD, etc.). BIT_PRESENT and BIT_SIZE get set as needed.
+ */
+void Memory::Map(uintptr_t virt, uintptr_t phys, size_t size, uint64_t flags) {
+	uintptr_t end = (virt + size + PAGE_4KB_SIZE - 1) & ~(PAGE_4KB_SIZE - 1ULL);
+	virt &= ~(PAGE_4KB_SIZE - 1ULL);
+	phys &= ~(PAGE_4KB_SIZE - 1ULL);
+	flags &= (0xFFFULL | BIT_NX) & ~(BIT_SIZE | BIT_PRESENT);
+	// Global pages survive cr3 switches, which is only what we want for kernel memory.
+	if (flags & BIT_USR) flags &= ~BIT_GLOBAL;
+	uint64_t table_flags = flags & BIT_USR;
+	size_t replaced = 0;
+
+	while (virt < end) {
+		size_t page = PAGE_4KB_SIZE;
+		uint64_t* entry = NULL;
+		const size_t sizes[] = { PAGE_1GB_SIZE, PAGE_2MB_SIZE };
+		for (int i = 0; i < 2; i++) {
+			if (sizes[i] == PAGE_1GB_SIZE && !Features::get1GBPages()) continue;
+			if ((virt | phys) & (sizes[i] - 1) || end - virt < sizes[i]) continue;
+			entry = getEntry(virt, sizes[i], table_flags);
+			// Don't throw away a table that's already there, it may still be mapping other things.
+			if ((*entry & BIT_PRESENT) && !(*entry & BIT_SIZE)) {
+				entry = NULL;
+				continue;
+			}
+			page = sizes[i];
+			break;
+		}
+		if (entry == NULL) entry = getEntry(virt, PAGE_4KB_SIZE, table_flags);
+
+		bool was_present = *entry & BIT_PRESENT;
+		if (IS_SWAP_ENTRY(*entry)) Memory::DropSwapSlot(SWAP_SLOT(*entry));
+		*entry = (phys & PAGE_FRAME) | flags | BIT_PRESENT | (page != PAGE_4KB_SIZE ? BIT_SIZE : 0);
+		// Whatever was mapped here before has to leave the tlb. Past the threshold one full flush at the end is cheaper.
+		if (was_present && ++replaced <= Memory::GetTLBFlushThreshold()) Memory::FlushTLBPage(virt);
+		virt += page;
+		phys += page;
+	}
+	if (replaced > Memory::GetTLBFlushThreshold()) Memory::FlushTLBAll();
+}
+
+/**
+ * @brief Finds the entry that maps virt, without creating anything.
+ *
+ * @param virt Virtual address.
+ * @param page_size Set to the size of the page the entry maps. If nothing is mapped, it's the size of the hole at the level the walk stopped.
+ * @return uint64_t* The entry, NULL if virt isn't mapped.
+ */
+uint64_t* findEntry(uintptr_t virt, size_t* page_size) {
+	*page_size = (size_t) 1 << PML4_OFFSET;
+	uint64_t entry = pml4[GET_PML4_INDEX(virt)];
+	if (!(entry & BIT_PRESENT)) return NULL;
+
+	const size_t sizes[] = { PAGE_1GB_SIZE, PAGE_2MB_SIZE, PAGE_4KB_SIZE };
+	const uint64_t indexes[] = { GET_PDPT_INDEX(virt), GET_PAGE_DIR_INDEX(virt), GET_PAGE_TABLE_INDEX(virt) };
+	for (int i = 0; i < 3; i++) {
+		*page_size = sizes[i];
+		uint64_t* slot = &tableVirt(entry)[indexes[i]];
+		if (!(*slot & BIT_PRESENT)) return NULL;
+		if (sizes[i] == PAGE_4KB_SIZE || (*slot & BIT_SIZE)) return slot;
+		entry = *slot;
+	}
+	return NULL;
+}
+
+/**
+ * @brief Finds the swap entry left behind by a 2MB page that was swapped out.
+ *
+ * @param virt Any address in the page.
+ * @return uint64_t* The entry, NULL if the page isn't in swap.
+ */
+static uint64_t* findSwapEntry(uintptr_t virt) {
+	uint64_t pml4e = pml4[GET_PML4_INDEX(virt)];
+	if (!(pml4e & BIT_PRESENT)) return NULL;
+	uint64_t pdpe = tableVirt(pml4e)[GET_PDPT_INDEX(virt)];
+	if (!(pdpe & BIT_PRESENT) || (pdpe & BIT_SIZE)) return NULL;
+	uint64_t* pde = &tableVirt(pdpe)[GET_PAGE_DIR_INDEX(virt)];
+	return IS_SWAP_ENTRY(*pde) ? pde : NULL;
+}
+
+/**
+ * @brief Checks if a table was allocated on its own, and can be given back to the physical allocator.
+ * The static tables and the ones carved out of table chunks can't be.
+ */
+static bool tableFreeable(uintptr_t phys) {
+	phys = getFrame(phys);
+	if (phys < kernel_mapping_end) return false;
+	for (size_t i = 0; i < table_chunk_count; i++) {
+		if (phys >= table_chunks[i].phys && phys < table_chunks[i].phys + PAGE_2MB_SIZE) return false;
+	}
+	return true;
+}
+
+static bool tableEmpty(const uint64_t* table) {
+	for (int i = 0; i < TABLE_ENTRIES; i++) {
+		// Not just present entries, swap entries need the table to stick around too.
+		if (table[i] != 0) return false;
+	}
+	return true;
+}
+
+/**
+ * @brief Frees the page table and page directory around virt if nothing in them is mapped anymore.
+ * The tables wait on the tlb queue like any other frame, the walk caches could still be pointing at them.
+ * pdp tables are never freed, the pml4 entries pointing at them are shared with every address space.
+ */
+static void reclaimTables(uintptr_t virt) {
+	uint64_t pml4e = pml4[GET_PML4_INDEX(virt)];
+	if (!(pml4e & BIT_PRESENT)) return;
+	uint64_t* pdpe = &tableVirt(pml4e)[GET_PDPT_INDEX(virt)];
+	if (!(*pdpe & BIT_PRESENT) || (*pdpe & BIT_SIZE)) return;
+
+	bool freed = false;
+	uint64_t* pde = &tableVirt(*pdpe)[GET_PAGE_DIR_INDEX(virt)];
+	if ((*pde & BIT_PRESENT) && !(*pde & BIT_SIZE) && tableFreeable(*pde) && tableEmpty(tableVirt(*pde))) {
+		Memory::QueueFrameFree(getFrame(*pde), PHYS_ORDER_4KB);
+		*pde = 0;
+		freed = true;
+	}
+	if (tableFreeable(*pdpe) && tableEmpty(tableVirt(*pdpe))) {
+		Memory::QueueFrameFree(getFrame(*pdpe), PHYS_ORDER_4KB);
+		*pdpe = 0;
+		freed = true;
+	}
+	// invlpg drops the walk caches, but only for the current PCID.
+	if (freed && Features::getPCID()) Memory::QueueTLBFlushAll();
+}
+
+/**
+ * @brief Unmaps a range of virtual memory. The frames aren't freed, but page tables that end up empty are.
+ * Large pages that are only partly inside the range get split first, so the rest of them stays mapped.
+ * Pages in swap give back their swap slot, or get swapped in first if they're only partly inside the range.
+ *
+ * The invalidations are only queued. Until FlushTLBQueue runs the old mappings may still work through the tlb,
+ * so anything that was mapped has to be freed with QueueFrameFree (or QueueDeferredRelease), not directly.
+ *
+ * @param virt Start of the range. Rounded down to 4KB.
+ * @param size Size of the range. Rounded up to 4KB.
+ */
+void Memory::Unmap(uintptr_t virt, size_t size) {
+	uintptr_t end = (virt + size + PAGE_4KB_SIZE - 1) & ~(PAGE_4KB_SIZE - 1ULL);
+	virt &= ~(PAGE_4KB_SIZE - 1ULL);
+	while (virt < end) {
+		size_t page;
+		uint64_t* entry = findEntry(virt, &page);
+		uint64_t* swapped = (entry == NULL && page == PAGE_2MB_SIZE) ? findSwapEntry(virt) : NULL;
+		bool partial = (virt & (page - 1)) || end - virt < page;
+		if (swapped != NULL && partial && Memory::SwapIn(virt, false)) continue;
+		if (entry == NULL && (swapped == NULL || partial)) {
+			// Skip the whole hole.
+			virt = (virt & ~(page - 1)) + page;
+			continue;
+		}
+		if (partial) {
+			splitPage(entry, page, virt);
+			continue;
+		}
+		if (swapped != NULL) {
+			// Never present, so nothing to flush.
+			Memory::DropSwapSlot(SWAP_SLOT(*swapped));
+			*swapped = 0;
+		} else {
+			*entry = 0;
+			Memory::QueueTLBFlush(virt, page, page);
+		}
+		virt += page;
+		// Done with this page table (or page directory), see if it's empty now.
+		if (page != PAGE_1GB_SIZE && (!(virt & (PAGE_2MB_SIZE - 1)) || virt >= end)) reclaimTables(virt - page);
+	}
+}
+
+/**
+ * @brief Changes the cache type of an already mapped range. Large pages that are only partly inside the range get split.
+ * Unmapped parts of the range are skipped.
+ *
+ * @param virt Start of the range. Rounded down to 4KB.
+ * @param size Size of the range. Rounded up to 4KB.
+ * @param mode One of the PAGE_CACHE_* types.
+ */
+void Memory::SetCacheMode(uintptr_t virt, size_t size, uint64_t mode) {
+	uintptr_t end = (virt + size + PAGE_4KB_SIZE - 1) & ~(PAGE_4KB_SIZE - 1ULL);
+	virt &= ~(PAGE_4KB_SIZE - 1ULL);
+	while (virt < end) {
+		size_t page;
+		uint64_t* entry = findEntry(virt, &page);
+		if (entry == NULL) {
+			virt = (virt & ~(page - 1)) + page;
+			continue;
+		}
+		if ((virt & (page - 1)) || end - virt < page) {
+			splitPage(entry, page, virt);
+			continue;
+		}
+		*entry = (*entry & ~PAGE_CACHE_MASK) | (mode & PAGE_CACHE_MASK);
+		Memory::QueueTLBFlush(virt, page, page);
+		virt += page;
+	}
+	Memory::FlushTLBQueue();
+	// Anything still cached from the old type would get written back behind the new one's back.
+	asm volatile("wbinvd" ::: "memory");
+}
+
+/**
+ * @brief Maps all usable memory into the physmap, using the largest pages that fit.
+ * After this, PHYS_TO_VIRT works for any physical address in RAM, and new page tables come straight from the physical allocator.
+ */
+void Memory::InitPhysmap() {
+	uintptr_t start, end;
+	for (size_t i = 0; Memory::Info::getUsableRange(i, &start, &end); i++) {
+		// Only whole pages, the bits around the edges might not be RAM.
+		start = (start + PAGE_4KB_SIZE - 1) & ~(PAGE_4KB_SIZE - 1ULL);
+		end &= ~(PAGE_4KB_SIZE - 1ULL);
+		if (end > PHYSMAP_SIZE) end = PHYSMAP_SIZE;
+		if (start >= end) continue;
+		Memory::Map(PHYS_TO_VIRT(start), start, end - start, BIT_GLOBAL | BIT_WRITE);
+	}
+	physmap_ready = true;
+}
+
+/**
+ * @brief Gets the base physical address of the page containing addr, whatever the page size is.
+ *
+ * @param addr Virtual address.
+ * @return uintptr_t Physical address of the start of the page, 0 if it isn't mapped.
+ */
 uintptr_t Memory::VirtToPhysBase(uintptr_t addr) {
-	addr = addr & ~0x1FFFFF; // Clear the lower bytes of the addr to get the base page pointer
-	int pml4_index = GET_PML4_INDEX(addr);
-	int pdp_index = GET_PDPT_INDEX(addr);
-	int pde_index = GET_PAGE_DIR_INDEX(addr);
-	int pte_index = GET_PAGE_TABLE_INDEX(addr);
-	// Extract the addresses from the pages.
-	uint64_t* pdp_t = (uint64_t*) getFrame(pml4[pml4_index]);
-	if (pdp_t[pdp_index] & (1 << POS_SIZE)) {
-		// 1GB pages, the physical address is pdp_t entry
-		return (uintptr_t) getFrame(pdp_t[pdp_index]);
-	}
-
-	uint64_t* pde_t = (uint64_t*) getFrame(pdp_t[pdp_index]);
-	if (pde_t[pde_index] & (1 << POS_SIZE)) {
-		// 2MB pages, the physical address is pde_t entry
-		return (uintptr_t) getFrame(pde_t[pde_index]);
-	}
-	uint64_t* pdt_t = (uint64_t*) getFrame(pde_t[pde_index]);
+	uint64_t entry = pml4[GET_PML4_INDEX(addr)];
+	if (!(entry & BIT_PRESENT)) return 0;
+
+	entry = tableVirt(entry)[GET_PDPT_INDEX(addr)];
+	if (!(entry & BIT_PRESENT)) return 0;
+	// 1GB pages, the physical address is pdp_t entry
+	if (entry & BIT_SIZE) return getFrame(entry) & ~(PAGE_1GB_SIZE - 1ULL);
+
+	entry = tableVirt(entry)[GET_PAGE_DIR_INDEX(addr)];
+	if (!(entry & BIT_PRESENT)) return 0;
+	// 2MB pages, the physical address is pde_t entry
+	if (entry & BIT_SIZE) return getFrame(entry) & ~(PAGE_2MB_SIZE - 1ULL);
+
 	// If we made it this far, it's a 4kb page entry
-	return (uintptr_t) getFrame(pdt_t[pte_index]);
+	entry = tableVirt(entry)[GET_PAGE_TABLE_INDEX(addr)];
+	if (!(entry & BIT_PRESENT)) return 0;
+	return getFrame(entry);
 }
 
+/**
+ * @brief Translates a virtual address to the exact physical address it's mapped to.
+ *
+ * @param addr Virtual address.
+ * @return uintptr_t Physical address, 0 if it isn't mapped.
+ */
+uintptr_t Memory::VirtToPhys(uintptr_t addr) {
+	// The physmap and the kernel image are linear, no need to walk anything.
+	if (physmap_ready && addr >= PHYSMAP_BASE && addr < PHYSMAP_BASE + PHYSMAP_SIZE) return VIRT_TO_PHYS(addr);
+	if (addr >= KERNEL_VIRTUAL_BASE && addr < KERNEL_VIRTUAL_BASE + kernel_mapping_end) return addr - KERNEL_VIRTUAL_BASE;
+	uintptr_t base = Memory::VirtToPhysBase(addr);
+	if (base == 0) return 0;
+	// The base is aligned to the page size, so the offset is everything below the lowest set bit we care about.
+	uint64_t entry = pml4[GET_PML4_INDEX(addr)];
+	entry = tableVirt(entry)[GET_PDPT_INDEX(addr)];
+	if (entry & BIT_SIZE) return base + (addr & (PAGE_1GB_SIZE - 1));
+	entry = tableVirt(entry)[GET_PAGE_DIR_INDEX(addr)];
+	if (entry & BIT_SIZE) return base + (addr & (PAGE_2MB_SIZE - 1));
+	return base + (addr & (PAGE_4KB_SIZE - 1));
+}
+
+/**
+ * @brief Builds the virtual address that a set of table indexes point to.
+ * Larger pages just ignore the indexes below them, pass 0 for those.
+ */
 uintptr_t physToVirt(uint64_t pml4_index, uint64_t pdp_index, uint64_t pde_index, uint64_t pte_index, uint64_t page_size) {
-	if (page_size != PAGE_2MB_SIZE) return pte_index; // We'll deal with this eventually when we get 4kb pages set up. it returns pte to shut gcc up
-	// We dont need the lower 21 bits, the page address should start at an aligned boundary.
-	return CANONICAL_UPPER
-		+ (pml4_index << PML4_OFFSET)
+	if (page_size == PAGE_1GB_SIZE) pde_index = 0;
+	if (page_size != PAGE_4KB_SIZE) pte_index = 0;
+	uintptr_t addr = (pml4_index << PML4_OFFSET)
 		+ (pdp_index << PDP_OFFSET)
-		+ (pde_index << PDE_OFFSET);
+		+ (pde_index << PDE_OFFSET)
+		+ (pte_index << PTE_OFFSET);
+	// Bits 63:48 have to match bit 47.
+	if (pml4_index & 0x100) addr |= CANONICAL_UPPER;
+	return addr;
 }
 
 /**
@@ -281,31 +713,9 @@ uintptr_t physToVirt(uint64_t pml4_index, uint64_t pdp_index, uint64_t pde_index
 void Memory::mapFramebuffer(uintptr_t base_addr, size_t size) {
 	// We need to map the memory region provided into both physical and virtual memory.
 	Memory::reserveMemory(base_addr, size);
-	// The framebuffer should be in kernel memory
-
-	// amount of 2mb sections this takes up
-	size_t mb_pages_taken = (size + PAGE_2MB_SIZE) / PAGE_2MB_SIZE;
-
-	// clear the lower 21 bytes of the ptr so we can map the virutal pages
-	uintptr_t addr = base_addr & ~0x1FFFFF;
-	// for the amount of pages taken by the map, we're going to map each page to virtual memory.
-
-	for (size_t i = 0; i < mb_pages_taken; i++) {
-		int pml4_index = GET_PML4_INDEX(addr);
-		int pdp_index = GET_PDPT_INDEX(addr);
-		int pde_index = GET_PAGE_DIR_INDEX(addr);
-
-		// Extract the addresses from the pages.
-		uint64_t* pdp_t = (uint64_t*) getFrame(pml4[pml4_index]);
-		uint64_t* pde_t = (uint64_t*) getFrame(pdp_t[pdp_index]);
-
-		set_page_frame(&(pde_t[pde_index]), addr);
-		pde_t[pde_index] |= BIT_SIZE | BIT_WRITE | BIT_PRESENT;
-
-		addr += PAGE_2MB_SIZE;
-	}
-
-	return;
+	// The framebuffer is identity mapped. Map only covers what's actually in the range, with 2MB pages where they fit.
+	// Write-combining lets pixel writes go out as whole lines instead of one at a time.
+	Memory::Map(base_addr, base_addr, size, BIT_GLOBAL | BIT_WRITE | PAGE_CACHE_WC);
 }
 
 /**
@@ -318,90 +728,488 @@ void Memory::MapPreAllocMem(uintptr_t addr) {
 	// This address will be the virtual address, including the offset from KERNEL_VIRTUAL_BASE
 	// Before we set up any allocators, we use 2mb pages.
 	addr = addr & ~0x1FFFFF; // Clear the lower bytes of the addr to get the base page pointer
-	int pml4_index = GET_PML4_INDEX(addr);
-	int pdp_index = GET_PDPT_INDEX(addr);
-	int pde_index = GET_PAGE_DIR_INDEX(addr);
-
-	// Extract the addresses from the pages.
-	uint64_t* pdp_t = (uint64_t*) getFrame(pml4[pml4_index]);
-	uint64_t* pde_t = (uint64_t*) getFrame(pdp_t[pdp_index]);
 
 	// We need to map the entry. We're going to "identity" map it in a sense
 	// We're still going to use the kernel offset, but it's going to be mapped immediately after the kernel binary.
-	addr -= KERNEL_VIRTUAL_BASE;
-	set_page_frame(&(pde_t[pde_index]), addr);
-	pde_t[pde_index] |= BIT_SIZE | BIT_WRITE | BIT_PRESENT;
+	// The page directory is kpde, so this never needs a new table.
+	Memory::Map(addr, addr - KERNEL_VIRTUAL_BASE, PAGE_2MB_SIZE, BIT_GLOBAL | BIT_WRITE);
 
-	kernel_mapping_end = addr + PAGE_2MB_SIZE;
+	kernel_mapping_end = addr - KERNEL_VIRTUAL_BASE + PAGE_2MB_SIZE;
 }
 
+/**
+ * @brief Get a 2MB kernel page. The address comes from the kernel address space allocator (see vmalloc.cpp).
+ *
+ * @return uintptr_t Virtual address of the page.
+ */
 uintptr_t Memory::NewKernelPage() {
-	// We need to find an entry in the kpdp that we can map to.
-	// Each entry in kpdp is a 1GB region of memory. 
-	// We start at kpdp[510], if that's full we go to kpdp[511]
-	// If both of those are full, we start at kpdp[1]->kpdp[509] (index 0 is identity mapped to index 510)
-	// If we somehow need more than 512GB of virtual mappings for the kernel we've messed up somewhere.
-	// For our purposes, at least for now, we're only using 2MB pages.
-	// Eventually I want to be able to have the allocators request that the virtual memory manager breaks down  these 2MB pages into 4KB chunks.
-
-	/* First attempt. Check kpdp[510] and kpdp[511] for empty entry. */
-	int i = 510;
-	while (i <= TABLE_ENTRIES) {
-		if (i == 512) i = 1; /* Second attempt. Check the rest of kpdp. */
-		if (i == 509) break; // Break the loop after we loop through the entire kpdp
-		uint64_t* pde_t = (uint64_t*) getFrame(kpdp[i]);
-		// Each pdp entry has 512 pde entries.
-		// Each pde entry corresponds to 1GB of virtual addresses.
-		// Each entry in a pde is a 2MB page.
-		// If I ever get around to 4KB pages, each pde contains a pte, each of which is 512 4kb pages
-
-		// If the pde entry isn't present, we need to create a new pde or load one from disk
-		if (!(kpdp[i] & (1 << (BIT_PRESENT - 1)))) {
-			// TODO use kernel_allocator to alloc new tables
-			continue; // For now we're going to just continue.
-		}
-		for (int j = 0; j < TABLE_ENTRIES; j++) {
-			if (!(pde_t[j] & (1 << (BIT_PRESENT - 1)))) {
-				uintptr_t addr = Memory::PhysicalAlloc2MB();
-				// printf("\n0x%llx\n", addr);
-				/* This will be dealt with properly at a later time.
-				 * To deal with this properly I need to implement filesystems and swap space.
-				 */
-				if (!addr) panic_s("Out of physical memory.");
-
-				set_page_frame(&(pde_t[j]), addr);
-				pde_t[j] |= BIT_SIZE | BIT_WRITE | BIT_PRESENT;
-
-				// TODO make this use invlpg instead of this
-				// This forces a full tlb flush
-				asm volatile("mov %%rax, %%cr3" ::"a"((uint64_t) pml4 - KERNEL_VIRTUAL_BASE));
-
-				// The new virtual address must be assembled. It's a lil janky.
-				// pml4 index is 511
-				// pdp index is `i`
-				// pde index is `j`
-				// the rest is the base pointer to the address.
-				return physToVirt(511, i, j, 0, PAGE_2MB_SIZE);
-			}
-		}
-		i++;
+	uintptr_t virt = Memory::AllocKernelRange(PAGE_2MB_SIZE, PAGE_2MB_SIZE);
+	uintptr_t addr = Memory::PhysicalAlloc2MB();
+	if (!virt || !addr) {
+		// Freed pages might just be waiting on a tlb flush.
+		Memory::FlushTLBQueue();
+		if (!virt) virt = Memory::AllocKernelRange(PAGE_2MB_SIZE, PAGE_2MB_SIZE);
+		if (!addr) addr = Memory::PhysicalAlloc2MB();
 	}
+	if (!virt) panic_s("Kernel has run out of virtual memory space.");
+	// Caches give memory back first, then cold pages get compressed into swap until a frame frees up.
+	// Only once there's nothing left to swap out is it really over.
+	if (!addr && Memory::DirectReclaim(PAGE_2MB_SIZE / PAGE_4KB_SIZE) > 0) addr = Memory::PhysicalAlloc2MB();
+	while (!addr && Memory::SwapOutColdPage()) addr = Memory::PhysicalAlloc2MB();
+	if (!addr) panic_s("Out of physical memory.");
+
+	// Nothing was mapped here before, so there's nothing in the tlb to flush.
+	Memory::Map(virt, addr, PAGE_2MB_SIZE, BIT_GLOBAL | BIT_WRITE);
+	return virt;
+}
+
+/**
+ * @brief Maps a range of physical memory into the kernel's address space, using 1GB pages wherever alignment and size allow.
+ * Ranges of 1GB or more get a virtual address with the same offset into the 1GB as the physical one, so that every 1GB
+ * entirely inside the range can be a single 1GB page. The rest uses 2MB pages.
+ *
+ * @param phys_addr Physical address of the start of the range.
+ * @param size Size of the range in bytes. Rounded out to 2MB.
+ * @return uintptr_t Virtual address that phys_addr is mapped to.
+ */
+uintptr_t Memory::MapKernelRange(uintptr_t phys_addr, size_t size) {
+	uintptr_t start = phys_addr & ~(PAGE_2MB_SIZE - 1ULL);
+	uintptr_t end = (phys_addr + size + PAGE_2MB_SIZE - 1) & ~(PAGE_2MB_SIZE - 1ULL);
+
+	size_t alignment = PAGE_2MB_SIZE;
+	size_t skew = 0; // Offset into the 1GB that the virtual range has to start at
+	if (end - start >= PAGE_1GB_SIZE && Features::get1GBPages()) {
+		alignment = PAGE_1GB_SIZE;
+		skew = start & (PAGE_1GB_SIZE - 1);
+	}
+	uintptr_t virt = Memory::AllocKernelRange(skew + (end - start), alignment);
+	if (!virt) panic_s("Kernel has run out of virtual memory space.");
+	virt += skew;
+
+	Memory::Map(virt, start, end - start, BIT_GLOBAL | BIT_WRITE);
+	return virt + (phys_addr - start);
+}
+
+/**
+ * @brief Get a 1GB kernel page. This is a single tlb entry on cpus that support 1GB pages.
+ *
+ * @return uintptr_t Virtual address of the page.
+ */
+uintptr_t Memory::NewKernelHugePage() {
+	uintptr_t addr = Memory::PhysicalAlloc1GB();
+	if (!addr) panic_s("Out of physical memory.");
+	return Memory::MapKernelRange(addr, PAGE_1GB_SIZE);
+}
+
+static void releaseKernelRange(uintptr_t addr, uint64_t arg) {
+	(void) arg;
+	Memory::FreeKernelRange(addr);
+}
 
-	// If we still haven't found something we got a problem.
-	panic_s("Kernel has run out of virtual memory space.");
-	return 0; // Keep GCC happy. This is irrelevant.
+/**
+ * @brief Converts a page size to the order of the frame behind it.
+ */
+static uint8_t pageOrder(size_t page_size) {
+	if (page_size == PAGE_1GB_SIZE) return PHYS_ORDER_1GB;
+	if (page_size == PAGE_2MB_SIZE) return PHYS_ORDER_2MB;
+	return PHYS_ORDER_4KB;
 }
 
-#pragma GCC diagnostic ignored "-Wunused-parameter" 
+/* Copy-on-write. Sharing is counted in the frame descriptors, and those are per 2MB frame, so only 2MB pages can be shared.
+ * While a frame is shared its refcount is the amount of mappings of it. The rest of the time it's 0, the frame has just the one owner.
+ */
+cow_stats cow_counters;
+
+/**
+ * @brief Drops a mapping's reference to a frame, for when the mapping goes away.
+ * When only one mapping is left it owns the frame again. It stays read-only until it writes, then BreakCOW makes it writable without a copy.
+ *
+ * @param phys Physical address of the frame.
+ * @param page_size Size of the page that mapped it.
+ * @return true If the frame is still mapped somewhere else, so it can't be freed.
+ * @return false If the frame wasn't shared.
+ */
+static bool dropFrameRef(uintptr_t phys, size_t page_size) {
+	if (page_size != PAGE_2MB_SIZE) return false;
+	page_frame* frame = Memory::GetFrameDescriptor(phys);
+	if (frame == NULL || frame->refcount == 0) return false;
+	frame->refcount--;
+	if (frame->refcount == 1) {
+		frame->refcount = 0;
+		cow_counters.shared_frames--;
+	}
+	return true;
+}
+
+/**
+ * @brief Frees a page from NewKernelPage or NewKernelHugePage.
+ * The frame, the address range, and any page tables that end up empty are released after the next tlb flush.
+ * Freeing a lot of pages in a row only costs one flush (see FlushTLBQueue).
+ *
+ * @param addr Virtual address of the page.
+ */
 void Memory::FreeKernelPage(uintptr_t addr) {
+	size_t page;
+	uint64_t* entry = findEntry(addr, &page);
+	if (entry == NULL && !(addr & (PAGE_2MB_SIZE - 1)) && findSwapEntry(addr) != NULL) {
+		// There's no frame to free, Unmap gives back the swap slot.
+		Memory::Unmap(addr, PAGE_2MB_SIZE);
+		Memory::QueueDeferredRelease(releaseKernelRange, addr, 0);
+		return;
+	}
+	if (entry == NULL || (addr & (page - 1))) panic_s("Freeing a kernel page that isn't mapped.");
+	uintptr_t phys = getFrame(*entry) & ~(page - 1);
+	bool mergeable = *entry & BIT_MERGEABLE;
 
+	// The leaf doesn't say how big the allocation was. Without 1GB pages, NewKernelHugePage maps its 1GB with 2MB pages,
+	// so the size has to come from the order the frame was allocated with.
+	uint8_t order = pageOrder(page);
+	page_frame* frame = Memory::GetFrameDescriptor(phys);
+	if (frame != NULL && (frame->flags & FRAME_ALLOCATED) && frame->order > order) order = frame->order;
+	size_t size = PAGE_4KB_SIZE << order;
+	if (phys & (size - 1)) panic_s("Freeing a kernel page from the middle of a bigger allocation.");
+
+	Memory::Unmap(addr, size);
+	// A shared frame only goes back once its last mapping does.
+	if (size != page || !dropFrameRef(phys, page)) {
+		Memory::QueueFrameFree(phys, order);
+	} else if (mergeable) {
+		cow_counters.unmerged++;
+	}
+	Memory::QueueDeferredRelease(releaseKernelRange, addr, 0);
 }
 
 uintptr_t Memory::NewUserPage() {
 	return 0;
 }
 
-#pragma GCC diagnostic ignored "-Wunused-parameter" 
+/**
+ * @brief Unmaps and frees a user page. Like FreeKernelPage, the frame is only released after the next tlb flush.
+ *
+ * @param addr Any virtual address in the page.
+ */
 void Memory::FreeUserPage(uintptr_t addr) {
+	size_t page;
+	uint64_t* entry = findEntry(addr, &page);
+	uint64_t* swapped = entry == NULL ? findSwapEntry(addr) : NULL;
+	if (swapped != NULL && (*swapped & BIT_USR)) Memory::Unmap(addr & ~(PAGE_2MB_SIZE - 1ULL), PAGE_2MB_SIZE);
+	if (entry == NULL || !(*entry & BIT_USR)) return;
+	uintptr_t phys = getFrame(*entry) & ~(page - 1);
+	bool mergeable = *entry & BIT_MERGEABLE;
+
+	Memory::Unmap(addr & ~(page - 1), page);
+	if (!dropFrameRef(phys, page)) {
+		Memory::QueueFrameFree(phys, pageOrder(page));
+	} else if (mergeable) {
+		cow_counters.unmerged++;
+	}
+}
+
+/**
+ * @brief Maps the pages of src at dst as well, without copying anything. Writable pages become read-only copy-on-write
+ * pages in both places, and whichever mapping writes first gets its own copy (see BreakCOW). Read-only pages just stay shared.
+ *
+ * @param dst Where to map the shared pages. 2MB aligned, and nothing should be mapped there yet.
+ * @param src Pages to share. 2MB aligned, and mapped with 2MB pages from the physical allocator.
+ * @param size Size of the range. Rounded up to 2MB.
+ * @return true If the whole range is shared.
+ * @return false If part of src can't be shared. Nothing gets changed.
+ */
+bool Memory::MapShared(uintptr_t dst, uintptr_t src, size_t size) {
+	size = (size + PAGE_2MB_SIZE - 1) & ~(PAGE_2MB_SIZE - 1ULL);
+	if ((dst | src) & (PAGE_2MB_SIZE - 1) || size == 0) return false;
+	// Check the whole range first, so a failure doesn't leave half of it shared.
+	for (size_t offset = 0; offset < size; offset += PAGE_2MB_SIZE) {
+		size_t page;
+		uint64_t* entry = findEntry(src + offset, &page);
+		if (entry == NULL || page != PAGE_2MB_SIZE) return false;
+		page_frame* frame = Memory::GetFrameDescriptor(getFrame(*entry) & ~(PAGE_2MB_SIZE - 1ULL));
+		if (frame == NULL || frame->refcount == UINT16_MAX) return false;
+	}
+
+	for (size_t offset = 0; offset < size; offset += PAGE_2MB_SIZE) {
+		size_t page;
+		uint64_t* entry = findEntry(src + offset, &page);
+		if (*entry & BIT_WRITE) {
+			*entry = (*entry & ~BIT_WRITE) | BIT_COW;
+			Memory::QueueTLBFlush(src + offset, PAGE_2MB_SIZE, PAGE_2MB_SIZE);
+		}
+		uintptr_t phys = getFrame(*entry) & ~(PAGE_2MB_SIZE - 1ULL);
+		uint64_t flags = *entry & (0xFFFULL | BIT_NX);
+
+		page_frame* frame = Memory::GetFrameDescriptor(phys);
+		if (frame->refcount == 0) {
+			frame->refcount = 1;
+			cow_counters.shared_frames++;
+		}
+		frame->refcount++;
+		Memory::Map(dst + offset, phys, PAGE_2MB_SIZE, flags);
+		cow_counters.shared++;
+	}
+	Memory::FlushTLBQueue();
+	return true;
+}
+
+/**
+ * @brief Makes a copy-on-write copy of a kernel page. Free it with FreeKernelPage, like any other kernel page.
+ *
+ * @param addr Virtual address of a page from NewKernelPage.
+ * @return uintptr_t Virtual address of the copy, 0 if the page can't be shared.
+ */
+uintptr_t Memory::ShareKernelPage(uintptr_t addr) {
+	uintptr_t virt = Memory::AllocKernelRange(PAGE_2MB_SIZE, PAGE_2MB_SIZE);
+	if (!virt) panic_s("Kernel has run out of virtual memory space.");
+	if (!Memory::MapShared(virt, addr, PAGE_2MB_SIZE)) {
+		Memory::FreeKernelRange(virt);
+		return 0;
+	}
+	return virt;
+}
+
+/**
+ * @brief Gives a copy-on-write page its own frame. Called by the page fault handler for writes to present pages.
+ * If nothing else maps the frame anymore, the page just becomes writable again without a copy.
+ *
+ * @param addr The faulting address.
+ * @param user If the write came from ring 3.
+ * @return true If the page is writable now, and the write can be retried.
+ * @return false If it isn't a copy-on-write page, or there's no memory for the copy.
+ */
+bool Memory::BreakCOW(uintptr_t addr, bool user) {
+	size_t page;
+	uint64_t* entry = findEntry(addr, &page);
+	if (entry == NULL || page != PAGE_2MB_SIZE || !(*entry & BIT_COW)) return false;
+	if (user && !(*entry & BIT_USR)) return false;
+	uintptr_t virt = addr & ~(PAGE_2MB_SIZE - 1ULL);
+	uintptr_t phys = getFrame(*entry) & ~(PAGE_2MB_SIZE - 1ULL);
+	page_frame* frame = Memory::GetFrameDescriptor(phys);
+	if (frame == NULL) return false;
+
+	if (frame->refcount == 0) {
+		*entry = (*entry & ~BIT_COW) | BIT_WRITE;
+		cow_counters.reused++;
+	} else {
+		uintptr_t copy = Memory::PhysicalAlloc(PHYS_ORDER_2MB);
+		if (!copy) return false;
+		// rep movsq for the same reason the demand pager uses rep stosq, the fault handler doesn't save the sse registers.
+		uint64_t* to = (uint64_t*) PHYS_TO_VIRT(copy);
+		uint64_t* from = (uint64_t*) PHYS_TO_VIRT(phys);
+		size_t count = PAGE_2MB_SIZE / sizeof(uint64_t);
+		asm volatile("rep movsq" : "+D"(to), "+S"(from), "+c"(count) :: "memory");
+
+		*entry = copy | (*entry & (0xFFFULL | BIT_NX) & ~BIT_COW) | BIT_WRITE;
+		dropFrameRef(phys, PAGE_2MB_SIZE);
+		cow_counters.copied++;
+		if (*entry & BIT_MERGEABLE) cow_counters.unmerged++;
+	}
+	Memory::FlushTLBPage(virt);
+	return true;
+}
+
+/**
+ * @brief Sets or clears one of the bits the cpu ignores on every 2MB page in a range. Other page sizes and holes are skipped.
+ */
+static void setPageBit(uintptr_t addr, size_t size, uint64_t bit, bool set) {
+	uintptr_t end = (addr + size + PAGE_2MB_SIZE - 1) & ~(PAGE_2MB_SIZE - 1ULL);
+	for (addr &= ~(PAGE_2MB_SIZE - 1ULL); addr < end; addr += PAGE_2MB_SIZE) {
+		size_t page;
+		uint64_t* entry = findEntry(addr, &page);
+		if (entry == NULL || page != PAGE_2MB_SIZE) continue;
+		// The cpu ignores the bit, so there's nothing to flush.
+		if (set) {
+			*entry |= bit;
+		} else {
+			*entry &= ~bit;
+		}
+	}
+}
+
+/**
+ * @brief Marks kernel pages as candidates for same-page merging, or takes them out again.
+ * Only 2MB pages from the physical allocator ever get merged. Never mark anything that a device or the cpu
+ * reads on its own (page tables, dma buffers), a merged page can be moved to another frame at any time.
+ *
+ * @param addr Start of the range. Rounded down to 2MB.
+ * @param size Size of the range. Rounded up to 2MB.
+ * @param mergeable true to mark the pages, false to unmark them.
+ */
+void Memory::SetMergeable(uintptr_t addr, size_t size, bool mergeable) {
+	setPageBit(addr, size, BIT_MERGEABLE, mergeable);
+}
+
+/**
+ * @brief Finds the next mergeable page, for the same-page merging scanner.
+ *
+ * @param virt Where to start looking. Rounded down to 2MB.
+ * @param end Where to stop looking.
+ * @param phys Set to the frame behind the page.
+ * @return uintptr_t Virtual address of the page, 0 if there are none left before end.
+ */
+uintptr_t Memory::NextMergeablePage(uintptr_t virt, uintptr_t end, uintptr_t* phys) {
+	virt &= ~(PAGE_2MB_SIZE - 1ULL);
+	while (virt < end) {
+		size_t page;
+		uint64_t* entry = findEntry(virt, &page);
+		if (entry != NULL && page == PAGE_2MB_SIZE && (*entry & BIT_MERGEABLE)) {
+			*phys = getFrame(*entry) & ~(PAGE_2MB_SIZE - 1ULL);
+			page_frame* frame = Memory::GetFrameDescriptor(*phys);
+			if (frame != NULL && (frame->flags & FRAME_ALLOCATED) && frame->order == PHYS_ORDER_2MB) return virt;
+		}
+		// When nothing's mapped, page is the size of the hole, so empty tables get skipped in one go.
+		if (page < PAGE_2MB_SIZE) page = PAGE_2MB_SIZE;
+		virt = (virt & ~(page - 1)) + page;
+	}
+	return 0;
+}
+
+/**
+ * @brief Makes a mergeable page read-only, so it can't change while it's being compared or shared.
+ * The next write to it faults, and BreakCOW makes it writable again (without a copy, if it never got merged).
+ *
+ * @param virt Address of the page.
+ * @return true If the page is read-only now.
+ * @return false If it isn't a mergeable 2MB page.
+ */
+bool Memory::ProtectMergeable(uintptr_t virt) {
+	size_t page;
+	uint64_t* entry = findEntry(virt, &page);
+	if (entry == NULL || page != PAGE_2MB_SIZE || !(*entry & BIT_MERGEABLE)) return false;
+	if (*entry & BIT_WRITE) {
+		*entry = (*entry & ~BIT_WRITE) | BIT_COW;
+		Memory::FlushTLBPage(virt & ~(PAGE_2MB_SIZE - 1ULL));
+	}
+	return true;
+}
 
+/**
+ * @brief Points a mergeable page at another frame with the same contents, and gives its old frame back.
+ * Both pages have to be protected with ProtectMergeable, and the caller has to have checked that they match.
+ *
+ * @param virt Address of the page to merge.
+ * @param into Frame to share with it.
+ * @return true If the page was merged and its old frame freed.
+ * @return false If the page can't be merged, or its old frame is still shared with something else.
+ */
+bool Memory::MergePage(uintptr_t virt, uintptr_t into) {
+	size_t page;
+	uint64_t* entry = findEntry(virt, &page);
+	if (entry == NULL || page != PAGE_2MB_SIZE || !(*entry & BIT_MERGEABLE) || (*entry & BIT_WRITE)) return false;
+	uintptr_t phys = getFrame(*entry) & ~(PAGE_2MB_SIZE - 1ULL);
+	page_frame* frame = Memory::GetFrameDescriptor(into);
+	if (phys == into || frame == NULL || frame->refcount == UINT16_MAX) return false;
+
+	if (frame->refcount == 0) {
+		frame->refcount = 1;
+		cow_counters.shared_frames++;
+	}
+	frame->refcount++;
+	*entry = into | (*entry & (0xFFFULL | BIT_NX));
+	Memory::QueueTLBFlush(virt & ~(PAGE_2MB_SIZE - 1ULL), PAGE_2MB_SIZE, PAGE_2MB_SIZE);
+
+	// The old frame can still be in the tlb, so it goes through the queue like any other free.
+	bool freed = !dropFrameRef(phys, PAGE_2MB_SIZE);
+	if (freed) {
+		Memory::QueueFrameFree(phys, PHYS_ORDER_2MB);
+		cow_counters.merged++;
+	}
+	Memory::FlushTLBQueue();
+	return freed;
+}
+
+/**
+ * @brief Marks kernel pages as candidates for swap, or takes them out again. Only 2MB pages from the physical allocator
+ * that aren't shared ever get swapped out. Same rules as SetMergeable, plus nothing the page fault handler itself touches,
+ * and nothing used with interrupts off that can't take a fault.
+ *
+ * @param addr Start of the range. Rounded down to 2MB.
+ * @param size Size of the range. Rounded up to 2MB.
+ * @param swappable true to mark the pages, false to unmark them.
+ */
+void Memory::SetSwappable(uintptr_t addr, size_t size, bool swappable) {
+	setPageBit(addr, size, BIT_SWAPPABLE, swappable);
+}
+
+/**
+ * @brief Finds the next swappable page that hasn't been used lately, for the swap clock (see swap.cpp).
+ * Pages the cpu marked accessed get the bit cleared and are passed over, so they're only picked if they stay unused
+ * until the clock comes around again. The bit is cleared without a tlb flush, at worst a page looks used for a bit longer.
+ *
+ * @param virt Where to start looking. Rounded down to 2MB.
+ * @param end Where to stop looking.
+ * @param phys Set to the frame behind the page.
+ * @return uintptr_t Virtual address of the page, 0 if there are none left before end.
+ */
+uintptr_t Memory::NextColdPage(uintptr_t virt, uintptr_t end, uintptr_t* phys) {
+	virt &= ~(PAGE_2MB_SIZE - 1ULL);
+	while (virt < end) {
+		size_t page;
+		uint64_t* entry = findEntry(virt, &page);
+		if (entry != NULL && page == PAGE_2MB_SIZE && (*entry & BIT_SWAPPABLE)) {
+			if (*entry & BIT_ACCESS) {
+				*entry &= ~BIT_ACCESS;
+			} else {
+				*phys = getFrame(*entry) & ~(PAGE_2MB_SIZE - 1ULL);
+				page_frame* frame = Memory::GetFrameDescriptor(*phys);
+				// Shared frames would have to leave every mapping at once, those stay put.
+				if (frame != NULL && (frame->flags & FRAME_ALLOCATED) && frame->order == PHYS_ORDER_2MB && frame->refcount == 0) return virt;
+			}
+		}
+		if (page < PAGE_2MB_SIZE) page = PAGE_2MB_SIZE;
+		virt = (virt & ~(page - 1)) + page;
+	}
+	return 0;
+}
+
+/**
+ * @brief Replaces a swappable page with a swap entry, and flushes it from the tlb right away.
+ * Nothing can get at the frame through the page afterwards, so it can be compressed and freed.
+ *
+ * @param virt Address of the page.
+ * @param slot Swap slot to put in the entry.
+ * @return uint64_t The entry the page had, 0 if it isn't a swappable 2MB page.
+ */
+uint64_t Memory::EvictPage(uintptr_t virt, size_t slot) {
+	size_t page;
+	uint64_t* entry = findEntry(virt, &page);
+	if (entry == NULL || page != PAGE_2MB_SIZE || !(*entry & BIT_SWAPPABLE)) return 0;
+	uint64_t old = *entry;
+	*entry = SWAP_ENTRY(slot) | (old & BIT_USR);
+	Memory::FlushTLBPage(virt & ~(PAGE_2MB_SIZE - 1ULL));
+	return old;
+}
+
+/**
+ * @brief Gets the swap entry of a page that's in swap.
+ *
+ * @param virt Any address in the page.
+ * @return uint64_t The entry, 0 if the page isn't in swap.
+ */
+uint64_t Memory::GetSwapEntry(uintptr_t virt) {
+	uint64_t* entry = findSwapEntry(virt);
+	return entry != NULL ? *entry : 0;
+}
+
+/**
+ * @brief Puts a page back in place of its swap entry.
+ *
+ * @param virt Any address in the page.
+ * @param entry The new entry, with the frame and flags.
+ * @return true If the page is back.
+ * @return false If the page wasn't in swap.
+ */
+bool Memory::RestorePage(uintptr_t virt, uint64_t entry) {
+	uint64_t* slot = findSwapEntry(virt);
+	if (slot == NULL) return false;
+	// It wasn't present, so there's nothing in the tlb.
+	*slot = entry;
+	return true;
+}
+
+/**
+ * @brief Copies the copy-on-write counters.
+ *
+ * @param snapshot Where to put the counters.
+ */
+void Memory::Info::getCOWStats(cow_stats* snapshot) {
+	*snapshot = cow_counters;
 }
\ No newline at end of file
@@ -0,0 +1,273 @@
+#include <memory/vmalloc.hpp>
+#include <memory/rb_tree.hpp>
+#include <memory/virtual_mem.hpp>
+#include <memory/physical_mem.hpp>
+#include <memory/tlb.hpp>
+#include <panic.h>
+
+/* Every range of the kernel address space is an area. Free areas sit in two trees, one sorted by address (so neighbours can be merged)
+ * and one sorted by size then address (for best fit). Used areas are only in the address tree of used areas, so vfree can find them.
+ * Areas come out of a fixed pool, the allocator can't depend on anything that might need it to get memory.
+ */
+typedef struct vm_area {
+	rb_node addr_node;      // In free_by_addr or used_by_addr
+	rb_node size_node;      // In free_by_size, free areas only
+	uintptr_t start;
+	size_t size;
+	size_t pages;           // Frames mapped by vmalloc, 0 for ranges that aren't from vmalloc
+	struct vm_area* next;   // Next unused area in the pool
+} vm_area;
+
+vm_area area_pool[MAX_VM_AREAS];
+vm_area* unused_areas = NULL;
+bool vmalloc_ready = false;
+
+rb_tree free_by_addr = RB_TREE_INIT;
+rb_tree free_by_size = RB_TREE_INIT;
+rb_tree used_by_addr = RB_TREE_INIT;
+
+vmalloc_stats vm_counters;
+
+static vm_area* newArea(uintptr_t start, size_t size) {
+	vm_area* area = unused_areas;
+	if (area == NULL) panic_s("Out of kernel virtual memory areas.");
+	unused_areas = area->next;
+	area->start = start;
+	area->size = size;
+	area->pages = 0;
+	return area;
+}
+
+static void deleteArea(vm_area* area) {
+	area->next = unused_areas;
+	unused_areas = area;
+}
+
+static void insertByAddr(rb_tree* tree, vm_area* area) {
+	rb_node** link = &tree->root;
+	rb_node* parent = NULL;
+	while (*link != NULL) {
+		parent = *link;
+		link = area->start < RB_ENTRY(parent, vm_area, addr_node)->start ? &parent->left : &parent->right;
+	}
+	rbLink(&area->addr_node, parent, link);
+	rbInsertColor(tree, &area->addr_node);
+}
+
+static void insertBySize(vm_area* area) {
+	rb_node** link = &free_by_size.root;
+	rb_node* parent = NULL;
+	while (*link != NULL) {
+		parent = *link;
+		vm_area* other = RB_ENTRY(parent, vm_area, size_node);
+		bool left = area->size < other->size || (area->size == other->size && area->start < other->start);
+		link = left ? &parent->left : &parent->right;
+	}
+	rbLink(&area->size_node, parent, link);
+	rbInsertColor(&free_by_size, &area->size_node);
+}
+
+static void insertFree(vm_area* area) {
+	insertByAddr(&free_by_addr, area);
+	insertBySize(area);
+	vm_counters.free_areas++;
+}
+
+static void eraseFree(vm_area* area) {
+	rbErase(&free_by_addr, &area->addr_node);
+	rbErase(&free_by_size, &area->size_node);
+	vm_counters.free_areas--;
+}
+
+/**
+ * @brief Sets up the pool and makes the whole vmalloc space one free area.
+ */
+static void initVmalloc() {
+	for (size_t i = 0; i < MAX_VM_AREAS; i++) {
+		deleteArea(&area_pool[i]);
+	}
+	insertFree(newArea(VMALLOC_BASE, VMALLOC_SIZE));
+	vmalloc_ready = true;
+}
+
+/**
+ * @brief Finds the used area starting at addr.
+ */
+static vm_area* findUsed(uintptr_t addr) {
+	rb_node* node = used_by_addr.root;
+	while (node != NULL) {
+		vm_area* area = RB_ENTRY(node, vm_area, addr_node);
+		if (addr == area->start) return area;
+		node = addr < area->start ? node->left : node->right;
+	}
+	return NULL;
+}
+
+/**
+ * @brief Finds the smallest free area with at least size bytes.
+ */
+static rb_node* lowerBoundSize(size_t size) {
+	rb_node* node = free_by_size.root;
+	rb_node* best = NULL;
+	while (node != NULL) {
+		if (RB_ENTRY(node, vm_area, size_node)->size >= size) {
+			best = node;
+			node = node->left;
+		} else {
+			node = node->right;
+		}
+	}
+	return best;
+}
+
+/**
+ * @brief Allocates a range of kernel virtual addresses. Nothing gets mapped, that's up to the caller.
+ * Uses the smallest free range that fits (best fit), to keep the big ranges around for big allocations.
+ *
+ * @param size Size of the range, rounded up to 4KB.
+ * @param alignment Alignment of the start of the range, a power of two and at least 4KB.
+ * @return uintptr_t Start of the range, 0 if there's no space.
+ */
+uintptr_t Memory::AllocKernelRange(size_t size, size_t alignment) {
+	if (!vmalloc_ready) initVmalloc();
+	size = (size + 0xFFF) & ~0xFFFULL;
+	if (alignment < 0x1000) alignment = 0x1000;
+	if (size == 0 || (alignment & (alignment - 1))) return 0;
+
+	// Areas are sorted by size, so the first one that fits with the alignment is the best fit.
+	// Most of the time that's the very first one, only bigger alignments have to look further.
+	for (rb_node* node = lowerBoundSize(size); node != NULL; node = rbNext(node)) {
+		vm_area* area = RB_ENTRY(node, vm_area, size_node);
+		uintptr_t start = (area->start + alignment - 1) & ~(alignment - 1);
+		uintptr_t area_end = area->start + area->size;
+		if (start < area->start || start + size > area_end || start + size < start) continue;
+
+		eraseFree(area);
+		// Whatever's left on either side stays free.
+		if (start + size < area_end) insertFree(newArea(start + size, area_end - (start + size)));
+		if (start > area->start) {
+			area->size = start - area->start;
+			insertFree(area);
+			area = newArea(start, size);
+		} else {
+			area->size = size;
+		}
+		insertByAddr(&used_by_addr, area);
+		vm_counters.used_areas++;
+		vm_counters.used_bytes += size;
+		return start;
+	}
+	return 0;
+}
+
+/**
+ * @brief Frees a range from AllocKernelRange, merging it with the free ranges around it. Whatever was mapped there has to be unmapped first.
+ *
+ * @param addr Start of the range.
+ * @return true If the range was freed.
+ * @return false If addr isn't the start of an allocated range.
+ */
+bool Memory::FreeKernelRange(uintptr_t addr) {
+	if (!vmalloc_ready) return false;
+	vm_area* area = findUsed(addr);
+	if (area == NULL) return false;
+	rbErase(&used_by_addr, &area->addr_node);
+	vm_counters.used_areas--;
+	vm_counters.used_bytes -= area->size;
+
+	// Find the free areas right before and after it.
+	rb_node* node = free_by_addr.root;
+	vm_area* prev = NULL;
+	vm_area* next = NULL;
+	while (node != NULL) {
+		vm_area* other = RB_ENTRY(node, vm_area, addr_node);
+		if (other->start < area->start) {
+			prev = other;
+			node = node->right;
+		} else {
+			next = other;
+			node = node->left;
+		}
+	}
+
+	if (prev != NULL && prev->start + prev->size == area->start) {
+		eraseFree(prev);
+		prev->size += area->size;
+		deleteArea(area);
+		area = prev;
+	}
+	if (next != NULL && area->start + area->size == next->start) {
+		eraseFree(next);
+		area->size += next->size;
+		deleteArea(next);
+	}
+	insertFree(area);
+	return true;
+}
+
+/**
+ * @brief Allocates virtually contiguous kernel memory. The frames behind it are 4KB each and don't have to be contiguous,
+ * so this works for big allocations even when physical memory is fragmented.
+ * Every allocation is followed by an unmapped guard page, so running off the end faults instead of corrupting the next one.
+ *
+ * @param bytes Size of the allocation.
+ * @return void* The memory, NULL if there isn't enough virtual or physical memory.
+ */
+void* vmalloc(size_t bytes) {
+	if (bytes == 0) return NULL;
+	size_t pages = (bytes + PAGE_4KB_SIZE - 1) / PAGE_4KB_SIZE;
+	uintptr_t start = Memory::AllocKernelRange((pages + 1) * PAGE_4KB_SIZE);
+	if (start == 0) return NULL;
+
+	vm_area* area = findUsed(start);
+	for (size_t i = 0; i < pages; i++) {
+		uintptr_t frame = Memory::PhysicalAllocPage(start + (i * PAGE_4KB_SIZE));
+		if (!frame) {
+			vfree((void*) start);
+			return NULL;
+		}
+		Memory::Map(start + (i * PAGE_4KB_SIZE), frame, PAGE_4KB_SIZE, BIT_GLOBAL | BIT_WRITE);
+		area->pages++;
+		vm_counters.vmalloc_pages++;
+	}
+	return (void*) start;
+}
+
+static void releaseVmallocRange(uintptr_t addr, uint64_t arg) {
+	(void) arg;
+	Memory::FreeKernelRange(addr);
+}
+
+/**
+ * @brief Frees memory from vmalloc.
+ *
+ * @param ptr Pointer returned by vmalloc. NULL is ignored.
+ */
+void vfree(void* ptr) {
+	if (ptr == NULL) return;
+	vm_area* area = findUsed((uintptr_t) ptr);
+	if (area == NULL) panic_s("vfree called on memory that didn't come from vmalloc.");
+
+	// Nothing can be reused until the tlb has been flushed, so the frames and the range wait on the queue.
+	for (size_t i = 0; i < area->pages; i++) {
+		uintptr_t page = area->start + (i * PAGE_4KB_SIZE);
+		Memory::QueueFrameFree(Memory::VirtToPhysBase(page), PHYS_ORDER_4KB);
+	}
+	Memory::Unmap(area->start, area->pages * PAGE_4KB_SIZE);
+	vm_counters.vmalloc_pages -= area->pages;
+	Memory::QueueDeferredRelease(releaseVmallocRange, area->start, 0);
+}
+
+/**
+ * @brief Copies the vmalloc counters.
+ *
+ * @param snapshot Where to put the counters.
+ */
+void Memory::Info::getVmallocStats(vmalloc_stats* snapshot) {
+	*snapshot = vm_counters;
+	snapshot->largest_free = 0;
+	// The size tree is sorted by size, so the biggest free area is the last one.
+	rb_node* node = free_by_size.root;
+	while (node != NULL && node->right != NULL) node = node->right;
+	if (node != NULL) snapshot->largest_free = RB_ENTRY(node, vm_area, size_node)->size;
+}
@@ -0,0 +1,120 @@
+#include <memory/zero_pool.hpp>
+#include <memory/virtual_mem.hpp>
+#include <memory/physical_mem.hpp>
+#include <memory/shrinker.hpp>
+#include <klibc/idle.h>
+
+uintptr_t zeroed_pages[ZERO_POOL_SIZE];
+zero_pool_stats pool_stats;
+
+/**
+ * @brief Zeroes memory with non-temporal stores (movnti).
+ * These go straight to memory instead of through the cache, so zeroing 2MB in the background doesn't
+ * throw out everything the foreground was using. The sfence makes sure the stores are visible before the page gets handed out.
+ *
+ * @param addr Start of the memory, 8 byte aligned.
+ * @param bytes Amount of bytes to zero, a multiple of 64.
+ */
+static void zeroNonTemporal(uintptr_t addr, size_t bytes) {
+	uint64_t zero = 0;
+	for (uintptr_t end = addr + bytes; addr < end; addr += 64) {
+		// One cache line per iteration, so the write combining buffers can flush whole lines.
+		asm volatile(
+			"movnti %1, 0(%0)\n"
+			"movnti %1, 8(%0)\n"
+			"movnti %1, 16(%0)\n"
+			"movnti %1, 24(%0)\n"
+			"movnti %1, 32(%0)\n"
+			"movnti %1, 40(%0)\n"
+			"movnti %1, 48(%0)\n"
+			"movnti %1, 56(%0)\n"
+			:: "r"(addr), "r"(zero) : "memory");
+	}
+	asm volatile("sfence" ::: "memory");
+}
+
+/**
+ * @brief Zeroes memory with rep stosq. Used when someone is waiting on the page,
+ * they're about to use it anyways, so it may as well end up in the cache.
+ *
+ * @param addr Start of the memory, 8 byte aligned.
+ * @param bytes Amount of bytes to zero, a multiple of 8.
+ */
+static void zeroCached(uintptr_t addr, size_t bytes) {
+	size_t count = bytes / sizeof(uint64_t);
+	asm volatile("rep stosq" : "+D"(addr), "+c"(count) : "a"(0ULL) : "memory");
+}
+
+static size_t countZeroPool() {
+	return pool_stats.pooled * (PAGE_2MB_SIZE / PAGE_4KB_SIZE);
+}
+
+/**
+ * @brief Shrinker for the pool. The pages are only a head start, so they can all go.
+ */
+static size_t shrinkZeroPool(size_t frames) {
+	size_t freed = 0;
+	while (pool_stats.pooled > 0 && freed < frames) {
+		pool_stats.pooled--;
+		Memory::FreeKernelPage(zeroed_pages[pool_stats.pooled]);
+		freed += PAGE_2MB_SIZE / PAGE_4KB_SIZE;
+	}
+	return freed;
+}
+
+/**
+ * @brief Registers the pool refill as an idle task. The pool starts out empty, and fills up the first time the kernel is idle.
+ */
+void Memory::InitZeroPool() {
+	registerIdleTask(Memory::RefillZeroPool);
+	Memory::RegisterShrinker("zero pool", countZeroPool, shrinkZeroPool);
+}
+
+/**
+ * @brief Zeroes one page and adds it to the pool, if the pool has space.
+ *
+ * @return true If a page was added.
+ * @return false If the pool is already full, or memory is low.
+ */
+bool Memory::RefillZeroPool() {
+	if (pool_stats.pooled >= ZERO_POOL_SIZE) return false;
+	// Don't fill back up what reclaim just took.
+	size_t high;
+	Memory::Info::getWatermarks(NULL, &high);
+	if (Memory::Info::getFreePageCount() < high) return false;
+	uintptr_t page = Memory::NewKernelPage();
+	zeroNonTemporal(page, PAGE_2MB_SIZE);
+	// Every page in the pool is the same, so same-page merging can fold them all into one frame until they get used.
+	Memory::SetMergeable(page, PAGE_2MB_SIZE, true);
+	zeroed_pages[pool_stats.pooled] = page;
+	pool_stats.pooled++;
+	pool_stats.refilled++;
+	return true;
+}
+
+/**
+ * @brief Get a 2MB kernel page that is entirely zero.
+ * Comes from the pool if there's one ready, otherwise a new page gets zeroed on the spot.
+ *
+ * @return uintptr_t Virtual address of the page.
+ */
+uintptr_t Memory::NewZeroedKernelPage() {
+	if (pool_stats.pooled > 0) {
+		pool_stats.pooled--;
+		pool_stats.hits++;
+		return zeroed_pages[pool_stats.pooled];
+	}
+	pool_stats.misses++;
+	uintptr_t page = Memory::NewKernelPage();
+	zeroCached(page, PAGE_2MB_SIZE);
+	return page;
+}
+
+/**
+ * @brief Copies the pool's stats.
+ *
+ * @param snapshot Where to copy the stats to.
+ */
+void Memory::Info::getZeroPoolStats(zero_pool_stats* snapshot) {
+	*snapshot = pool_stats;
+}
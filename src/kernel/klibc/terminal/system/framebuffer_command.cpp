@@ -0,0 +1,150 @@
+#include <string.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+
+#include <timing.h>
+
+#include <klibc/kprint.h>
+#include <klibc/logger.h>
+#include <klibc/features.hpp>
+#include <klibc/multiboot.hpp>
+#include <klibc/internal_calls.h>
+#include <memory/virtual_mem.hpp>
+
+#include <terminal/terminal.h>
+#include <terminal/commands/systemCommands.h>
+
+extern "C" {
+	int fbbench(int argc, char** argv);
+	int fbbench_help(int argc, char** argv);
+}
+
+#define FBBENCH_DEFAULT_FRAMES 16
+
+// The benchmark draws through the identity mapping from mapFramebuffer, and only ever changes that mapping's type.
+// The framebuffer isn't set up at boot (the terminal is VGA text mode), so fbbench creates the mapping itself and is the only thing that draws to it.
+// pml4[0] shares its pdp table with pml4[511], so the same entries show up in the higher half too. They're the same entries, so the type always matches.
+uintptr_t bench_fb = 0;
+
+/**
+ * @brief Fills every line of the framebuffer with one color, a pixel at a time like the renderers do.
+ *
+ * @param fb Framebuffer tag.
+ * @param color Color to fill with.
+ */
+void fillFramebuffer(multiboot_tag_framebuffer* fb, uint32_t color) {
+	uint8_t* line = (uint8_t*) bench_fb;
+	uint32_t bytes = fb->common.framebuffer_bpp / 8;
+	for (uint32_t y = 0; y < fb->common.framebuffer_height; y++) {
+		if (bytes == 4) {
+			uint32_t* pixel = (uint32_t*) line;
+			for (uint32_t x = 0; x < fb->common.framebuffer_width; x++) pixel[x] = color;
+		} else {
+			for (uint32_t x = 0; x < fb->common.framebuffer_width * bytes; x += bytes) {
+				line[x] = color;
+				line[x + 1] = (color >> 8) & 255;
+				line[x + 2] = (color >> 16) & 255;
+			}
+		}
+		line += fb->common.framebuffer_pitch;
+	}
+	// Write-combining buffers aren't ordered, this makes sure everything actually reached the framebuffer.
+	asm volatile("sfence" ::: "memory");
+}
+
+/**
+ * @brief Times filling the framebuffer with a certain cache type and prints the results.
+ *
+ * @param fb Framebuffer tag.
+ * @param mode PAGE_CACHE_* type to map the framebuffer with.
+ * @param name Name of the type.
+ * @param frames Amount of full frames to draw.
+ * @return uint64_t Cycles per frame.
+ */
+uint64_t benchCacheMode(multiboot_tag_framebuffer* fb, uint64_t mode, const char* name, size_t frames) {
+	size_t size = (size_t) fb->common.framebuffer_height * fb->common.framebuffer_pitch;
+	Memory::SetCacheMode(bench_fb, size, mode);
+
+	size_t start_ms = get_system_up_time();
+	uint64_t start = rdtsc();
+	for (size_t i = 0; i < frames; i++) {
+		fillFramebuffer(fb, (i & 1) ? 0x000000 : 0x202020);
+	}
+	uint64_t cycles = (rdtsc() - start) / frames;
+	size_t ms = get_system_up_time() - start_ms;
+
+	set_colors(VGA_COLOR_PINK, VGA_DEFAULT_BG);
+	printf("%s:\n", name);
+	set_to_last();
+	set_colors(VGA_COLOR_LIGHT_GREY, VGA_DEFAULT_BG);
+	printf("\t%llu cycles per frame\n", cycles);
+	if (ms > 0) {
+		printf("\t%llu MiB/s (%llu frames in %llums)\n", ((uint64_t) size * frames * 1000 / ms) / 1024 / 1024, frames, ms);
+	}
+	set_to_last();
+	return cycles;
+}
+
+/**
+ * @brief Measures the fill rate of the framebuffer mapped write-back, then write-combining.
+ * The framebuffer is left write-combining afterwards, the way mapFramebuffer maps it.
+ *
+ * @param argc Argument count.
+ * @param argv -f <frames> sets the amount of frames drawn for every cache type.
+ * @return int Always 0.
+ */
+int fbbench(int argc, char** argv) {
+	size_t frames = FBBENCH_DEFAULT_FRAMES;
+	for (int i = 1; i < argc; i++) {
+		if (strcmp(argv[i], "-f") == 0 || strcmp(argv[i], "--frames") == 0) {
+			if (i + 1 >= argc || atoi(argv[i + 1]) <= 0) {
+				logger(ERROR, "Expected a frame count after %s.\n", argv[i]);
+				return 0;
+			}
+			frames = atoi(argv[++i]);
+		}
+	}
+
+	multiboot_tag_framebuffer* fb = MultibootManager::getFramebufferTag();
+	if (fb == NULL || fb->common.framebuffer_type != MULTIBOOT_FRAMEBUFFER_TYPE_RGB || fb->common.framebuffer_bpp < 24) {
+		logger(ERROR, "No linear framebuffer to benchmark.\n");
+		return 0;
+	}
+	if (!Features::getPAT()) {
+		logger(WARN, "PAT is not supported, write-combining falls back to write-through.\n");
+	}
+
+	size_t size = (size_t) fb->common.framebuffer_height * fb->common.framebuffer_pitch;
+	bench_fb = fb->common.framebuffer_addr;
+	if (Memory::VirtToPhys(bench_fb) != bench_fb) Memory::mapFramebuffer(bench_fb, size);
+
+	printf("Filling a %ux%u framebuffer %llu times:\n", fb->common.framebuffer_width, fb->common.framebuffer_height, frames);
+	uint64_t wb = benchCacheMode(fb, PAGE_CACHE_WB, "Write-Back", frames);
+	uint64_t wc = benchCacheMode(fb, PAGE_CACHE_WC, "Write-Combining", frames);
+	if (wc > 0) {
+		printf("Write-combining is %llu.%llux as fast.\n", wb / wc, ((wb * 10) / wc) % 10);
+	}
+	return 0;
+}
+
+#pragma GCC diagnostic ignored "-Wunused-parameter"
+int fbbench_help(int argc, char** argv) {
+	const char* optional[] = {
+		"--frames <frames>,",
+		"-f <frames>   -> Amount of frames to draw with every cache type. Defaults to 16.\n",
+
+		"Switches the framebuffer's mapping to write-back and then back to write-combining, and prints how fast it can be filled with each."
+	};
+	HelpEntry entry = {
+		"FBBench",
+		"Framebuffer fill rate benchmark.",
+		NULL,
+		0,
+		optional,
+		3
+	};
+	printSpecificHelp(&entry);
+	return 0;
+}
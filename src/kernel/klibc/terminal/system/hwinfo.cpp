@@ -87,7 +87,7 @@ void printUptime() {
 void printMemInfo() {
 	const mmap_info* info = Memory::Info::getMMapInfo();
 	uint64_t k_end = (uint64_t) &kernel_end - KERNEL_VIRTUAL_BASE;
-	size_t used = (Memory::Info::getUsedPageCount() * PAGE_2MB_SIZE) + k_end;
+	size_t used = (Memory::Info::getUsedPageCount() * PAGE_4KB_SIZE) + k_end;
 	if (used < 10000000) { // 10 MiB
 		used = (used / 1024); // Make it in KiB
 		printValue("Memory: ", "%lluKiB / %lluMiB\n", used, (info->usable / 1024) / 1024);
@@ -8,6 +8,14 @@
 #include <klibc/logger.h>
 #include <memory/physical_mem.hpp>
 #include <memory/virtual_mem.hpp>
+#include <memory/zero_pool.hpp>
+#include <memory/tlb.hpp>
+#include <memory/pcid.hpp>
+#include <memory/page_fault.hpp>
+#include <memory/vmalloc.hpp>
+#include <memory/ksm.hpp>
+#include <memory/swap.hpp>
+#include <klibc/features.hpp>
 
 #include <terminal/terminal.h>
 #include <terminal/commands/systemCommands.h>
@@ -54,6 +62,10 @@ void printMapSize() {
 	set_to_last();
 	set_colors(VGA_COLOR_DARK_GREY, VGA_DEFAULT_BG);
 	printf("\t%llu bytes\n\t%llu KiB\n\t%llu MiB\n", memory_map_size, memory_map_size / 1024, (memory_map_size / 1024) / 1024);
+
+	// Round the usable memory up to the next GiB, so small systems don't divide by zero.
+	uint64_t usable_gib = (memory_info->usable + PAGE_1GB_SIZE - 1) / PAGE_1GB_SIZE;
+	if (usable_gib > 0) printf("\t%llu bytes per GiB of usable memory\n", memory_map_size / usable_gib);
 	set_to_last();
 }
 
@@ -74,6 +86,202 @@ void printFreePhysical() {
 	set_to_last();
 }
 
+void printCounters() {
+	phys_counters snapshot;
+	Memory::Info::getCounters(&snapshot);
+	set_colors(VGA_COLOR_LIGHT_BLUE, VGA_DEFAULT_BG);
+	printf("Physical Allocator Counters:\n");
+	set_to_last();
+	set_colors(VGA_COLOR_BLUE, VGA_DEFAULT_BG);
+	printf("\tFree Frames: %llu / %llu\n", snapshot.free_frames, snapshot.total_frames);
+	if (snapshot.deferred_frames != 0) printf("\tDeferred Frames: %llu (not initialized yet)\n", snapshot.deferred_frames);
+	printf("\tAllocs: %llu, Frees: %llu, Failed: %llu\n", snapshot.alloc_count, snapshot.free_count, snapshot.failed_count);
+	printf("\tLive Blocks: 4KB: %llu, 2MB: %llu, 1GB: %llu\n",
+		snapshot.allocated_blocks[PHYS_ORDER_4KB], snapshot.allocated_blocks[PHYS_ORDER_2MB], snapshot.allocated_blocks[PHYS_ORDER_1GB]);
+
+	const char* zone_names[ZONE_COUNT] = { "DMA", "DMA32", "Normal" };
+	for (uint8_t zone = 0; zone < ZONE_COUNT; zone++) {
+		size_t watermark;
+		Memory::Info::getZoneCounters(zone, &watermark, &snapshot);
+		if (snapshot.total_frames == 0) continue;
+		printf("\tZone %s: %llu / %llu frames free, watermark %llu, %llu failed\n", zone_names[zone], snapshot.free_frames, snapshot.total_frames, watermark, snapshot.failed_count);
+	}
+
+	for (size_t i = 0; i < Memory::Info::getRegionCount(); i++) {
+		uintptr_t base, end;
+		Memory::Info::getRegionCounters(i, &base, &end, &snapshot);
+		printf("\tRegion 0x%llx -> 0x%llx: %llu / %llu frames free\n", base, end, snapshot.free_frames, snapshot.total_frames);
+	}
+	set_to_last();
+}
+
+void printZeroPool() {
+	zero_pool_stats stats;
+	Memory::Info::getZeroPoolStats(&stats);
+	set_colors(VGA_COLOR_LIGHT_BLUE, VGA_DEFAULT_BG);
+	printf("Zeroed Page Pool: ");
+	set_to_last();
+	set_colors(VGA_COLOR_BLUE, VGA_DEFAULT_BG);
+	printf("%llu / %u pages ready, %llu hits, %llu misses, %llu zeroed in the background\n", stats.pooled, ZERO_POOL_SIZE, stats.hits, stats.misses, stats.refilled);
+	set_to_last();
+}
+
+void printTLB() {
+	tlb_stats stats;
+	Memory::Info::getTLBStats(&stats);
+	set_colors(VGA_COLOR_LIGHT_BLUE, VGA_DEFAULT_BG);
+	printf("TLB Flushes: ");
+	set_to_last();
+	set_colors(VGA_COLOR_BLUE, VGA_DEFAULT_BG);
+	printf("%llu invlpg (%llu ranges), %llu full, %llu batches of %llu queued ranges, %llu deferred frees, threshold %llu pages\n",
+		stats.invlpgs, stats.range_flushes, stats.full_flushes, stats.batches, stats.queued, stats.deferred, Memory::GetTLBFlushThreshold());
+	set_to_last();
+
+	pcid_stats pcid;
+	Memory::Info::getPCIDStats(&pcid);
+	set_colors(VGA_COLOR_LIGHT_BLUE, VGA_DEFAULT_BG);
+	printf("PCIDs: ");
+	set_to_last();
+	set_colors(VGA_COLOR_BLUE, VGA_DEFAULT_BG);
+	if (!Features::getPCID()) {
+		printf("not supported, %llu address space switches\n", pcid.switches);
+	} else {
+		printf("%llu switches (%llu without a flush), %llu assigned, %llu rollovers, %llu invpcids\n",
+			pcid.switches, pcid.noflush, pcid.assigned, pcid.rollovers, pcid.invpcids);
+	}
+	set_to_last();
+}
+
+void printPageFaults() {
+	fault_stats stats;
+	Memory::Info::getFaultStats(&stats);
+	set_colors(VGA_COLOR_LIGHT_BLUE, VGA_DEFAULT_BG);
+	printf("Page Faults: ");
+	set_to_last();
+	set_colors(VGA_COLOR_BLUE, VGA_DEFAULT_BG);
+	printf("%llu total, %llu demand paged, %llu copy-on-write, %llu swapped in, %llu unhandled\n",
+		stats.faults, stats.demand, stats.cow, stats.swap, stats.unhandled);
+	cow_stats cow;
+	Memory::Info::getCOWStats(&cow);
+	printf("Copy-on-write: %llu pages shared, %llu frames still shared, %llu copied, %llu reused\n",
+		cow.shared, cow.shared_frames, cow.copied, cow.reused);
+	demand_region region;
+	for (size_t i = 0; Memory::Info::getDemandRegion(i, &region); i++) {
+		printf("    %s: 0x%llx - 0x%llx, %llu / %llu pages touched\n", region.name, region.start, region.end,
+			region.faults, (region.end - region.start) / PAGE_4KB_SIZE);
+	}
+	set_to_last();
+}
+
+/**
+ * @brief Writes to the first pages of the kernel scratch range, so the untouched ones get demand paged in.
+ * Pages that were touched before keep their frames, so running it again with the same amount doesn't fault.
+ *
+ * @param pages Amount of 4KB pages to touch.
+ */
+void touchScratch(size_t pages) {
+	uintptr_t scratch = Memory::GetDemandScratch();
+	if (scratch == 0) {
+		logger(ERROR, "The kernel scratch range wasn't reserved.\n");
+		return;
+	}
+	if (pages > DEMAND_SCRATCH_SIZE / PAGE_4KB_SIZE) pages = DEMAND_SCRATCH_SIZE / PAGE_4KB_SIZE;
+
+	fault_stats before, after;
+	Memory::Info::getFaultStats(&before);
+	for (size_t i = 0; i < pages; i++) {
+		*(volatile uint8_t*) (scratch + (i * PAGE_4KB_SIZE)) = 1;
+	}
+	Memory::Info::getFaultStats(&after);
+	printf("Touched %llu pages of kernel scratch, %llu of them were demand paged in.\n", pages, after.demand - before.demand);
+}
+
+void printVmalloc() {
+	vmalloc_stats stats;
+	Memory::Info::getVmallocStats(&stats);
+	set_colors(VGA_COLOR_LIGHT_BLUE, VGA_DEFAULT_BG);
+	printf("Kernel Address Space: ");
+	set_to_last();
+	set_colors(VGA_COLOR_BLUE, VGA_DEFAULT_BG);
+	printf("%lluMiB in %llu ranges, %llu free ranges (largest %lluMiB), %llu vmalloc pages\n",
+		stats.used_bytes / 1024 / 1024, stats.used_areas, stats.free_areas, stats.largest_free / 1024 / 1024, stats.vmalloc_pages);
+	set_to_last();
+}
+
+void printKSM() {
+	ksm_stats stats;
+	Memory::Info::getKSMStats(&stats);
+	set_colors(VGA_COLOR_LIGHT_BLUE, VGA_DEFAULT_BG);
+	printf("Same-Page Merging: ");
+	set_to_last();
+	set_colors(VGA_COLOR_BLUE, VGA_DEFAULT_BG);
+	printf("%lluMiB reclaimed, %llu pages merged, %llu passes, %llu pages scanned (%llu changed, %llu mismatched)\n",
+		stats.reclaimed * PAGE_2MB_SIZE / 1024 / 1024, stats.merged, stats.passes, stats.scanned, stats.changed, stats.mismatched);
+	set_to_last();
+}
+
+#define SWAP_FILL_MAX_PAGES 4096 // 8GB, machines with more than that won't run out
+
+uintptr_t fill_pages[SWAP_FILL_MAX_PAGES];
+
+/**
+ * @brief Allocates swappable kernel pages until physical memory runs out and NewKernelPage has swapped out that many pages,
+ * then reads every page back, so the ones in swap get swapped in again. The pages are freed afterwards.
+ * Every page is filled with its own index, so they all compress well and can be told apart.
+ *
+ * @param pages Amount of pages to swap out before stopping.
+ */
+void fillSwap(size_t pages) {
+	swap_stats before, after;
+	Memory::Info::getSwapStats(&before);
+	size_t allocated = 0;
+	for (; allocated < SWAP_FILL_MAX_PAGES; allocated++) {
+		Memory::Info::getSwapStats(&after);
+		if (after.swapped_out - before.swapped_out >= pages) break;
+		// With swap full the next page that doesn't fit would be a panic.
+		if (after.stored + 1 >= SWAP_MAX_SLOTS) break;
+		uint64_t* page = (uint64_t*) Memory::NewKernelPage();
+		for (size_t i = 0; i < PAGE_2MB_SIZE / sizeof(uint64_t); i++) page[i] = allocated;
+		Memory::SetSwappable((uintptr_t) page, PAGE_2MB_SIZE, true);
+		fill_pages[allocated] = (uintptr_t) page;
+	}
+	Memory::Info::getSwapStats(&after);
+	size_t swapped_out = after.swapped_out - before.swapped_out;
+
+	size_t corrupted = 0;
+	for (size_t n = 0; n < allocated; n++) {
+		const uint64_t* page = (const uint64_t*) fill_pages[n];
+		for (size_t i = 0; i < PAGE_2MB_SIZE / sizeof(uint64_t); i++) {
+			if (page[i] != n) {
+				corrupted++;
+				break;
+			}
+		}
+	}
+	Memory::Info::getSwapStats(&after);
+	size_t swapped_in = after.swapped_in - before.swapped_in;
+	for (size_t n = 0; n < allocated; n++) Memory::FreeKernelPage(fill_pages[n]);
+
+	printf("Filled %llu pages (%lluMiB), %llu were swapped out and %llu swapped back in.\n",
+		allocated, allocated * PAGE_2MB_SIZE / 1024 / 1024, swapped_out, swapped_in);
+	if (swapped_out < pages) printf("Stopped before memory ran out, there's more of it than the fill goes up to or swap is full.\n");
+	if (corrupted > 0) logger(ERROR, "%llu pages came back with the wrong contents.\n", corrupted);
+}
+
+void printSwap() {
+	swap_stats stats;
+	Memory::Info::getSwapStats(&stats);
+	set_colors(VGA_COLOR_LIGHT_BLUE, VGA_DEFAULT_BG);
+	printf("Compressed Swap: ");
+	set_to_last();
+	set_colors(VGA_COLOR_BLUE, VGA_DEFAULT_BG);
+	printf("%llu / %llu pages stored in %lluKiB", stats.stored, (uint64_t) SWAP_MAX_SLOTS, stats.stored_bytes / 1024);
+	if (stats.stored > 0) printf(" (%llu%% of their size)", stats.stored_bytes * 100 / (stats.stored * PAGE_2MB_SIZE));
+	printf(", %llu swapped out, %llu swapped in, %llu incompressible, %llu dropped\n",
+		stats.swapped_out, stats.swapped_in, stats.incompressible, stats.dropped);
+	set_to_last();
+}
+
 bool printIndividual(int argc, char** argv) {
 	bool printedSomething = false;
 	for (int i = 1; i < argc; i++) {
@@ -95,6 +303,43 @@ bool printIndividual(int argc, char** argv) {
 		} else if (strcmp(argv[i], "-fp") == 0 || strcmp(argv[i], "--free-physical") == 0) {
 			printFreePhysical();
 			printedSomething = true;
+		} else if (strcmp(argv[i], "-c") == 0 || strcmp(argv[i], "--counters") == 0) {
+			printCounters();
+			printedSomething = true;
+		} else if (strcmp(argv[i], "-z") == 0 || strcmp(argv[i], "--zero-pool") == 0) {
+			printZeroPool();
+			printedSomething = true;
+		} else if (strcmp(argv[i], "-tlb") == 0 || strcmp(argv[i], "--tlb") == 0) {
+			printTLB();
+			printedSomething = true;
+		} else if (strcmp(argv[i], "-pf") == 0 || strcmp(argv[i], "--page-faults") == 0) {
+			if (i + 1 < argc && strcmp(argv[i + 1], "--touch") == 0) {
+				i++;
+				if (i + 1 >= argc || atoi(argv[i + 1]) <= 0) {
+					logger(ERROR, "Expected an amount of pages after --touch.\n");
+					return true;
+				}
+				touchScratch(atoi(argv[++i]));
+			}
+			printPageFaults();
+			printedSomething = true;
+		} else if (strcmp(argv[i], "-vm") == 0 || strcmp(argv[i], "--vmalloc") == 0) {
+			printVmalloc();
+			printedSomething = true;
+		} else if (strcmp(argv[i], "-ksm") == 0 || strcmp(argv[i], "--merging") == 0) {
+			printKSM();
+			printedSomething = true;
+		} else if (strcmp(argv[i], "-sw") == 0 || strcmp(argv[i], "--swap") == 0) {
+			if (i + 1 < argc && strcmp(argv[i + 1], "--fill") == 0) {
+				i++;
+				if (i + 1 >= argc || atoi(argv[i + 1]) <= 0) {
+					logger(ERROR, "Expected an amount of pages after --fill.\n");
+					return true;
+				}
+				fillSwap(atoi(argv[++i]));
+			}
+			printSwap();
+			printedSomething = true;
 		}
 	}
 	return printedSomething;
@@ -124,6 +369,27 @@ int meminfo(int argc, char** argv) {
 
 	/* Free Physical Pages */
 	printFreePhysical();
+
+	/* Physical Allocator Counters */
+	printCounters();
+
+	/* Zeroed Page Pool */
+	printZeroPool();
+
+	/* TLB Flushes */
+	printTLB();
+
+	/* Page Faults */
+	printPageFaults();
+
+	/* Kernel Address Space */
+	printVmalloc();
+
+	/* Same-Page Merging */
+	printKSM();
+
+	/* Compressed Swap */
+	printSwap();
 	return 0;
 }
 
@@ -187,7 +453,84 @@ int meminfo_help(int argc, char** argv) {
 		} else if (strcmp(argv[1], "-fp") == 0 || strcmp(argv[1], "--free-physical") == 0) {
 			HelpEntry entry = {
 				"MemInfo (Free Physical Pages)",
-				"Prints the amount of free physical pages in memory.\n\nThis is mostly for debugging purposes, but may be interesting to users.\nThe system uses 2MB physical pages, multiplying this number by 2MB (0x200000), should give you roughly the usable memory.",
+				"Prints the amount of free physical pages in memory.\n\nThis is mostly for debugging purposes, but may be interesting to users.\nThe system tracks 4KB physical pages, multiplying this number by 4KB (0x1000), should give you roughly the free memory.",
+				NULL,
+				0,
+				NULL,
+				0
+			};
+			printSpecificHelp(&entry);
+			return 0;
+		} else if (strcmp(argv[1], "-c") == 0 || strcmp(argv[1], "--counters") == 0) {
+			HelpEntry entry = {
+				"MemInfo (Physical Allocator Counters)",
+				"Prints the physical allocator counters, both in total and for each region of memory.\n\nThese are kept up to date on every allocation, so this is cheap to run as often as you like.",
+				NULL,
+				0,
+				NULL,
+				0
+			};
+			printSpecificHelp(&entry);
+			return 0;
+		} else if (strcmp(argv[1], "-z") == 0 || strcmp(argv[1], "--zero-pool") == 0) {
+			HelpEntry entry = {
+				"MemInfo (Zeroed Page Pool)",
+				"Prints the state of the zeroed page pool.\n\nThe kernel zeroes pages while it's idle, so anything that needs a clean page can grab one without waiting. Misses are allocations that found the pool empty and had to zero a page themselves.",
+				NULL,
+				0,
+				NULL,
+				0
+			};
+			printSpecificHelp(&entry);
+			return 0;
+		} else if (strcmp(argv[1], "-tlb") == 0 || strcmp(argv[1], "--tlb") == 0) {
+			HelpEntry entry = {
+				"MemInfo (TLB Flushes)",
+				"Prints how many TLB invalidations have happened.\n\nSmall ranges are invalidated page by page with invlpg. Anything over the threshold, or a batch that gets too big, flushes the whole TLB instead and counts as a full flush.",
+				NULL,
+				0,
+				NULL,
+				0
+			};
+			printSpecificHelp(&entry);
+			return 0;
+		} else if (strcmp(argv[1], "-pf") == 0 || strcmp(argv[1], "--page-faults") == 0) {
+			HelpEntry entry = {
+				"MemInfo (Page Faults)",
+				"Prints the page fault counters, the copy-on-write counters and every demand paged region.\n\nDemand regions are reserved without any memory behind them. The first time a page in one is touched, the page fault handler maps a zeroed frame there.\n\nCopy-on-write pages share a frame until one of them is written to, then the writer gets its own copy.\n\n-pf --touch <pages> writes to that many pages of the kernel scratch range first, so the pages that weren't touched yet get demand paged in.",
+				NULL,
+				0,
+				NULL,
+				0
+			};
+			printSpecificHelp(&entry);
+			return 0;
+		} else if (strcmp(argv[1], "-vm") == 0 || strcmp(argv[1], "--vmalloc") == 0) {
+			HelpEntry entry = {
+				"MemInfo (Kernel Address Space)",
+				"Prints how much of the kernel's virtual address space is in use.\n\nKernel pages and vmalloc allocations get their addresses from here. Freed ranges are merged with their neighbours, so the free range count shows how fragmented the space is.",
+				NULL,
+				0,
+				NULL,
+				0
+			};
+			printSpecificHelp(&entry);
+			return 0;
+		} else if (strcmp(argv[1], "-ksm") == 0 || strcmp(argv[1], "--merging") == 0) {
+			HelpEntry entry = {
+				"MemInfo (Same-Page Merging)",
+				"Prints how much memory has been reclaimed by merging identical pages.\n\nPages marked as mergeable are checksummed in the background, and pages with the same contents end up sharing one read-only frame until one of them is written to. Changed pages were still being written to, mismatched pages had the same checksum as another page but different contents.",
+				NULL,
+				0,
+				NULL,
+				0
+			};
+			printSpecificHelp(&entry);
+			return 0;
+		} else if (strcmp(argv[1], "-sw") == 0 || strcmp(argv[1], "--swap") == 0) {
+			HelpEntry entry = {
+				"MemInfo (Compressed Swap)",
+				"Prints the state of the compressed swap.\n\nWhen physical memory runs out, cold pages marked as swappable are compressed into memory and decompressed again when they're touched. Incompressible pages didn't compress to half their size and were left alone, dropped pages were freed while they were in swap.\n\n-sw --fill <pages> allocates kernel pages until memory runs out and that many pages have been swapped out, then reads them all back and frees them.",
 				NULL,
 				0,
 				NULL,
@@ -210,6 +553,20 @@ int meminfo_help(int argc, char** argv) {
 		"-k          -> Prints the size of the raw kernel.\n",
 		"--free-physical,",
 		"-fp         -> Prints the amount of free physical pages in memory.\n",
+		"--counters,",
+		"-c          -> Prints the physical allocator counters.\n",
+		"--zero-pool,",
+		"-z          -> Prints the state of the zeroed page pool.\n",
+		"--tlb,",
+		"-tlb        -> Prints the TLB flush counters.\n",
+		"--page-faults,",
+		"-pf         -> Prints the page fault counters and demand paged regions. Add --touch <pages> to demand page in part of the kernel scratch range.\n",
+		"--vmalloc,",
+		"-vm         -> Prints the kernel address space counters.\n",
+		"--merging,",
+		"-ksm        -> Prints the same-page merging counters.\n",
+		"--swap,",
+		"-sw         -> Prints the compressed swap counters. Add --fill <pages> to run memory out until that many pages are swapped out.\n",
 
 		"If no flags are provided it will print all of the above.",
 	};
@@ -219,7 +576,7 @@ int meminfo_help(int argc, char** argv) {
 		NULL,
 		0,
 		optional,
-		12
+		26
 	};
 	printSpecificHelp(&entry);
 
@@ -0,0 +1,205 @@
+#include <string.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+
+#include <klibc/kprint.h>
+#include <klibc/logger.h>
+#include <klibc/features.hpp>
+#include <klibc/internal_calls.h>
+#include <memory/physical_mem.hpp>
+#include <memory/virtual_mem.hpp>
+
+#include <terminal/terminal.h>
+#include <terminal/commands/systemCommands.h>
+
+extern "C" {
+	int pagecolor(int argc, char** argv);
+	int pagecolor_help(int argc, char** argv);
+}
+
+#define PAGECOLOR_MAX_PAGES 4096
+#define PAGECOLOR_PASSES 16
+// The crowded set only gets this fraction of the colors, so it only gets that fraction of the cache.
+#define PAGECOLOR_CROWDING 8
+
+uintptr_t bench_frames[PAGECOLOR_MAX_PAGES];
+volatile uint64_t bench_sink;
+
+/**
+ * @brief Prints the cache geometry the colors come from, whether coloring is on, and the counters.
+ */
+void printColoring() {
+	const cache_info* llc = Features::getLLC();
+	color_stats stats;
+	Memory::Info::getColorStats(&stats);
+
+	set_colors(VGA_COLOR_LIGHT_BLUE, VGA_DEFAULT_BG);
+	printf("Last level cache: ");
+	set_to_last();
+	set_colors(VGA_COLOR_BLUE, VGA_DEFAULT_BG);
+	if (llc == NULL) {
+		printf("unknown\n");
+	} else {
+		printf("L%u, %uKiB, %u ways, %u byte lines, %u sets\n", llc->level, llc->size / 1024, llc->ways, llc->line_size, llc->sets);
+	}
+	printf("%llu colors, page coloring is %s\n", stats.colors, Memory::GetPageColoring() ? "on" : "off");
+	printf("%llu colored allocations, %llu fallbacks, %llu blocks split\n", stats.colored, stats.fallbacks, stats.splits);
+	set_to_last();
+}
+
+/**
+ * @brief Reads every cache line of a set of frames through the physmap, a few times over.
+ *
+ * @param pages Amount of frames in bench_frames.
+ * @param line_size Size of a cache line.
+ * @return uint64_t Average cycles per cache line read.
+ */
+uint64_t walkFrames(size_t pages, size_t line_size) {
+	uint64_t sum = 0;
+	uint64_t start = 0;
+	// The first pass only pulls everything into the cache, it isn't timed.
+	for (size_t pass = 0; pass <= PAGECOLOR_PASSES; pass++) {
+		if (pass == 1) start = rdtsc();
+		for (size_t i = 0; i < pages; i++) {
+			volatile uint64_t* page = (volatile uint64_t*) PHYS_TO_VIRT(bench_frames[i]);
+			for (size_t offset = 0; offset < PAGE_4KB_SIZE; offset += line_size) {
+				sum += page[offset / sizeof(uint64_t)];
+			}
+		}
+	}
+	uint64_t cycles = rdtsc() - start;
+	bench_sink = sum;
+	return cycles / ((uint64_t) PAGECOLOR_PASSES * pages * (PAGE_4KB_SIZE / line_size));
+}
+
+/**
+ * @brief Allocates a set of frames, times walking over them, and frees them again.
+ *
+ * @param name Name of the set.
+ * @param pages Amount of frames.
+ * @param colors How many different colors the frames get, 0 to use PhysicalAlloc instead.
+ * @param line_size Size of a cache line.
+ * @return uint64_t Cycles per cache line, 0 if the frames couldn't be allocated.
+ */
+uint64_t benchColors(const char* name, size_t pages, size_t colors, size_t line_size) {
+	color_stats before, after;
+	Memory::Info::getColorStats(&before);
+	size_t allocated = 0;
+	for (; allocated < pages; allocated++) {
+		uintptr_t frame = colors == 0 ? Memory::PhysicalAlloc(PHYS_ORDER_4KB) : Memory::PhysicalAllocColored(allocated % colors);
+		if (frame == 0) break;
+		bench_frames[allocated] = frame;
+	}
+	Memory::Info::getColorStats(&after);
+
+	uint64_t cycles = 0;
+	if (allocated == pages) cycles = walkFrames(pages, line_size);
+	for (size_t i = 0; i < allocated; i++) Memory::PhysicalFree(bench_frames[i], PHYS_ORDER_4KB);
+
+	set_colors(VGA_COLOR_PINK, VGA_DEFAULT_BG);
+	printf("%s:\n", name);
+	set_to_last();
+	set_colors(VGA_COLOR_LIGHT_GREY, VGA_DEFAULT_BG);
+	if (allocated != pages) {
+		printf("\tOut of memory after %llu frames\n", allocated);
+	} else {
+		printf("\t%llu cycles per line\n", cycles);
+		if (after.fallbacks != before.fallbacks) printf("\t%llu frames got the wrong color\n", after.fallbacks - before.fallbacks);
+	}
+	set_to_last();
+	return cycles;
+}
+
+/**
+ * @brief Compares walking a working set (half the cache by default) that's crammed into a few colors,
+ * one straight from the buddy allocator, and one spread over every color.
+ *
+ * @param pages Size of the working set in 4KB frames.
+ */
+void benchColoring(size_t pages) {
+	const cache_info* llc = Features::getLLC();
+	color_stats stats;
+	Memory::Info::getColorStats(&stats);
+	size_t colors = stats.colors;
+	size_t crowded = colors / PAGECOLOR_CROWDING;
+	if (crowded == 0) crowded = 1;
+
+	printf("Reading %llu frames (%lluKiB) %u times:\n", pages, pages * PAGE_4KB_SIZE / 1024, PAGECOLOR_PASSES);
+	uint64_t slow = benchColors("Crowded", pages, crowded, llc->line_size);
+	benchColors("Buddy order", pages, 0, llc->line_size);
+	uint64_t fast = benchColors("Colored", pages, colors, llc->line_size);
+	if (slow > 0 && fast > 0) {
+		printf("Spreading the frames over every color is %llu.%llux as fast as crowding them.\n", slow / fast, ((slow * 10) / fast) % 10);
+	}
+}
+
+/**
+ * @brief Shows or changes the page coloring mode, or benchmarks it.
+ *
+ * @param argc Argument count.
+ * @param argv --on/--off toggle coloring, -b runs the benchmark (with -p <pages> as the working set).
+ * @return int Always 0.
+ */
+int pagecolor(int argc, char** argv) {
+	bool bench = false;
+	size_t pages = 0;
+	for (int i = 1; i < argc; i++) {
+		if (strcmp(argv[i], "--on") == 0 || strcmp(argv[i], "--off") == 0) {
+			bool enabled = strcmp(argv[i], "--on") == 0;
+			if (!Memory::SetPageColoring(enabled)) {
+				logger(ERROR, "The cache geometry isn't known, there's nothing to color pages with.\n");
+				return 0;
+			}
+		} else if (strcmp(argv[i], "-b") == 0 || strcmp(argv[i], "--bench") == 0) {
+			bench = true;
+		} else if (strcmp(argv[i], "-p") == 0 || strcmp(argv[i], "--pages") == 0) {
+			if (i + 1 >= argc || atoi(argv[i + 1]) <= 0) {
+				logger(ERROR, "Expected a page count after %s.\n", argv[i]);
+				return 0;
+			}
+			pages = atoi(argv[++i]);
+		}
+	}
+
+	if (!bench) {
+		printColoring();
+		return 0;
+	}
+	const cache_info* llc = Features::getLLC();
+	color_stats stats;
+	Memory::Info::getColorStats(&stats);
+	if (llc == NULL || stats.colors < 2) {
+		logger(ERROR, "The cache geometry isn't known, there's nothing to benchmark.\n");
+		return 0;
+	}
+	if (pages == 0) pages = llc->size / 2 / PAGE_4KB_SIZE;
+	if (pages > PAGECOLOR_MAX_PAGES) pages = PAGECOLOR_MAX_PAGES;
+	benchColoring(pages);
+	return 0;
+}
+
+#pragma GCC diagnostic ignored "-Wunused-parameter"
+int pagecolor_help(int argc, char** argv) {
+	const char* optional[] = {
+		"--on,",
+		"--off           -> Turns page coloring for vmalloc and demand paged memory on or off.\n",
+		"--bench,",
+		"-b              -> Benchmarks reading a working set with its frames in a few colors, in buddy order, and in every color.\n",
+		"--pages <pages>,",
+		"-p <pages>      -> Size of the benchmark's working set, in 4KB frames. Defaults to half the last level cache (at most 4096).\n",
+
+		"Without options, prints the last level cache's geometry, the amount of page colors, and how often allocations got their color."
+	};
+	HelpEntry entry = {
+		"PageColor",
+		"Page coloring for the physical allocator.",
+		NULL,
+		0,
+		optional,
+		7
+	};
+	printSpecificHelp(&entry);
+	return 0;
+}
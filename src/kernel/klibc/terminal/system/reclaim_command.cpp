@@ -0,0 +1,125 @@
+#include <string.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+
+#include <klibc/kprint.h>
+#include <klibc/logger.h>
+#include <memory/physical_mem.hpp>
+#include <memory/virtual_mem.hpp>
+#include <memory/shrinker.hpp>
+
+#include <terminal/terminal.h>
+#include <terminal/commands/systemCommands.h>
+
+extern "C" {
+	int memreclaim(int argc, char** argv);
+	int memreclaim_help(int argc, char** argv);
+}
+
+#define FRAMES_TO_MIB(frames) ((frames) * PAGE_4KB_SIZE / 1024 / 1024)
+
+/**
+ * @brief Prints the watermarks, the reclaim counters, and what every shrinker has done since boot.
+ */
+void printShrinkers() {
+	size_t low, high;
+	Memory::Info::getWatermarks(&low, &high);
+	reclaim_stats stats;
+	Memory::Info::getReclaimStats(&stats);
+
+	set_colors(VGA_COLOR_LIGHT_BLUE, VGA_DEFAULT_BG);
+	printf("Watermarks: ");
+	set_to_last();
+	set_colors(VGA_COLOR_BLUE, VGA_DEFAULT_BG);
+	printf("%lluMiB low, %lluMiB high, %lluMiB free\n", FRAMES_TO_MIB(low), FRAMES_TO_MIB(high), FRAMES_TO_MIB(Memory::Info::getFreePageCount()));
+	printf("Reclaim: %llu wakeups, %llu background runs, %llu direct runs, %lluMiB freed\n",
+		stats.wakeups, stats.background, stats.direct, FRAMES_TO_MIB(stats.freed));
+	set_to_last();
+
+	shrinker entry;
+	for (size_t i = 0; Memory::Info::getShrinker(i, &entry); i++) {
+		set_colors(VGA_COLOR_PINK, VGA_DEFAULT_BG);
+		printf("%s:\n", entry.name);
+		set_to_last();
+		set_colors(VGA_COLOR_LIGHT_GREY, VGA_DEFAULT_BG);
+		printf("\t%lluMiB reclaimable, %llu runs, %lluMiB freed since boot\n", FRAMES_TO_MIB(entry.count()), entry.runs, FRAMES_TO_MIB(entry.freed));
+		if (entry.runs > 0) printf("\tLast run freed %llu frames in %llu cycles\n", entry.last_freed, entry.last_cycles);
+		set_to_last();
+	}
+}
+
+/**
+ * @brief Runs the shrinkers, and prints what each of them freed and how long it took.
+ *
+ * @param argc Argument count.
+ * @param argv -m <MiB> limits how much is reclaimed, -l only lists the shrinkers.
+ * @return int Always 0.
+ */
+int memreclaim(int argc, char** argv) {
+	size_t frames = SIZE_MAX;
+	for (int i = 1; i < argc; i++) {
+		if (strcmp(argv[i], "-l") == 0 || strcmp(argv[i], "--list") == 0) {
+			printShrinkers();
+			return 0;
+		} else if (strcmp(argv[i], "-m") == 0 || strcmp(argv[i], "--mib") == 0) {
+			if (i + 1 >= argc || atoi(argv[i + 1]) <= 0) {
+				logger(ERROR, "Expected an amount of MiB after %s.\n", argv[i]);
+				return 0;
+			}
+			frames = (size_t) atoi(argv[++i]) * 1024 * 1024 / PAGE_4KB_SIZE;
+		}
+	}
+
+	// The counters from before tell which shrinkers actually ran this time.
+	size_t count = Memory::Info::getShrinkerCount();
+	size_t runs[MAX_SHRINKERS];
+	shrinker entry;
+	for (size_t i = 0; i < count; i++) {
+		Memory::Info::getShrinker(i, &entry);
+		runs[i] = entry.runs;
+	}
+
+	size_t free_before = Memory::Info::getFreePageCount();
+	size_t freed = Memory::ShrinkCaches(frames);
+
+	for (size_t i = 0; i < count; i++) {
+		Memory::Info::getShrinker(i, &entry);
+		set_colors(VGA_COLOR_PINK, VGA_DEFAULT_BG);
+		printf("%s:\n", entry.name);
+		set_to_last();
+		set_colors(VGA_COLOR_LIGHT_GREY, VGA_DEFAULT_BG);
+		if (entry.runs == runs[i]) {
+			printf("\tNothing freed\n");
+		} else {
+			printf("\t%lluMiB (%llu frames) in %llu cycles\n", FRAMES_TO_MIB(entry.last_freed), entry.last_freed, entry.last_cycles);
+		}
+		set_to_last();
+	}
+	printf("Reclaimed %lluMiB, free memory went from %lluMiB to %lluMiB.\n",
+		FRAMES_TO_MIB(freed), FRAMES_TO_MIB(free_before), FRAMES_TO_MIB(Memory::Info::getFreePageCount()));
+	return 0;
+}
+
+#pragma GCC diagnostic ignored "-Wunused-parameter"
+int memreclaim_help(int argc, char** argv) {
+	const char* optional[] = {
+		"--mib <MiB>,",
+		"-m <MiB>    -> Stops once this much memory has been reclaimed. Defaults to everything the caches can give back.\n",
+		"--list,",
+		"-l          -> Lists the shrinkers and the reclaim counters, without reclaiming anything.\n",
+
+		"Asks every registered cache (slabs, the zeroed page pool, etc.) to give back the memory it doesn't need, and prints what each one freed and how long it took."
+	};
+	HelpEntry entry = {
+		"MemReclaim",
+		"Reclaims memory from the kernel's caches.",
+		NULL,
+		0,
+		optional,
+		5
+	};
+	printSpecificHelp(&entry);
+	return 0;
+}
@@ -199,5 +199,8 @@ void registerSystemCommands() {
 	registerCommand((Command) { logo_command, logo_help, "logo", NULL, 0 });
 	registerCommand((Command) { time_command, time_help, "time", NULL, 0 });
 	registerCommand((Command) { meminfo, meminfo_help, "meminfo", NULL, 0 });
+	registerCommand((Command) { fbbench, fbbench_help, "fbbench", NULL, 0 });
+	registerCommand((Command) { memreclaim, memreclaim_help, "memreclaim", NULL, 0 });
+	registerCommand((Command) { pagecolor, pagecolor_help, "pagecolor", NULL, 0 });
 	registerCommand((Command) { sysinfo, NULL, "sysinfo", NULL, 0 });
 }
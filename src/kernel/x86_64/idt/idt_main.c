@@ -67,12 +67,17 @@ __attribute__((interrupt)) void simd_floating_point_exception_handler(struct int
 __attribute__((interrupt)) void virtualization_exception_handler(struct interrupt_frame* frame) { panic_s("Virtualization Exception has occurred."); }
 __attribute__((interrupt)) void control_protection_exception_handler(struct interrupt_frame* frame) { panic_s("Control Protection Exception has occurred."); }
 
-__attribute__((interrupt)) void page_fault_handler(struct interrupt_frame* frame) {
+// Demand paging, see memory/page_fault.cpp
+extern bool handlePageFault(uint64_t addr, uint64_t error_code);
+
+// Exceptions with an error code get it as a second argument, gcc pops it before the iret.
+__attribute__((interrupt)) void page_fault_handler(struct interrupt_frame* frame, uword_t error_code) {
 	unsigned long cr2;
 	asm volatile ("movq %%cr2, %0" : "=r" (cr2));
 
-	unsigned long error_code;
-	asm volatile ("pop %0" : "=r" (error_code));
+	// If the address was in a demand region, a frame has been mapped there and the instruction can run again.
+	if (handlePageFault(cr2, error_code)) return;
+
 	char err[65];
 	itoa(error_code, err, 2);
 	int present = error_code & 0b1;
@@ -175,7 +180,8 @@ void initIDT() {
 	set_idt_entry(&idt[11], segment_not_present_handler, 0, 0x8E);
 	set_idt_entry(&idt[12], stack_segment_fault_handler, 0, 0x8E);
 	set_idt_entry(&idt[13], general_protection_fault_handler, 0, 0x8E);
-	set_idt_entry(&idt[14], page_fault_handler, 0, 0x8E);
+	// The page fault handler takes an error code, the cast is just to get it past set_idt_entry.
+	set_idt_entry(&idt[14], (void (*)(struct interrupt_frame*)) (void*) page_fault_handler, 0, 0x8E);
 	set_idt_entry(&idt[16], x87_fpu_floating_point_error_handler, 0, 0x8E);
 	set_idt_entry(&idt[17], alignment_check_handler, 0, 0x8E);
 	set_idt_entry(&idt[18], machine_check_handler, 0, 0x8E);